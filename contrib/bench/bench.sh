@@ -0,0 +1,390 @@
+#!/bin/sh
+
+# Benchmarks for the jpeg filter. See README.md in this directory.
+
+set -e
+
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+CONTRIB_DIR=$(dirname "$BENCH_DIR")
+
+if [ "$BENCH_WORK" = "" ]; then
+	BENCH_WORK="$BENCH_DIR/work"
+fi
+
+if [ "$BENCH_NGINX" = "" ]; then
+	BENCH_NGINX=/usr/local/nginx/sbin/nginx
+fi
+
+if [ "$BENCH_PORT" = "" ]; then
+	BENCH_PORT=8089
+fi
+
+if [ "$BENCH_ITERATIONS" = "" ]; then
+	BENCH_ITERATIONS=10
+fi
+
+if [ "$BENCH_DURATION" = "" ]; then
+	BENCH_DURATION=20
+fi
+
+if [ "$BENCH_CONNECTIONS" = "" ]; then
+	BENCH_CONNECTIONS=16
+fi
+
+if [ "$BENCH_LOAD_IMAGE" = "" ]; then
+	BENCH_LOAD_IMAGE=medium_420_base
+fi
+
+if [ "$CC" = "" ]; then
+	CC=cc
+fi
+
+BIN="$BENCH_WORK/bin"
+CORPUS="$BENCH_WORK/corpus"
+OUT="$BENCH_WORK/out"
+NGX="$BENCH_WORK/nginx"
+DROPON="$CONTRIB_DIR/dropon.png"
+
+# The corpus: name, width, height, and the options for mkcorpus
+CORPUS_IMAGES="
+small_420_base 640 480
+small_444_prog 640 480 -p -s 444
+medium_420_base 2048 1536
+medium_420_prog 2048 1536 -p
+medium_422_rst 2048 1536 -s 422 -r 1
+large_420_base 6000 4000
+large_444_prog 6000 4000 -p -s 444
+large_420_rst 6000 4000 -r 4
+huge_420_base 15000 10000
+"
+
+# The processing chains: name, the directives for nginx, and the arguments for micro
+CONFIGS="bypass grayscale darken dropon optimize progressive chain transcode"
+
+config_directives() {
+	case "$1" in
+		bypass)      echo "";;
+		grayscale)   echo "jpeg_filter_effect grayscale;";;
+		darken)      echo "jpeg_filter_effect darken 32;";;
+		dropon)      echo "jpeg_filter_dropon_align bottom right; jpeg_filter_dropon_offset -10 -10; jpeg_filter_dropon_file $DROPON;";;
+		optimize)    echo "jpeg_filter_optimize on; jpeg_filter_effect grayscale;";;
+		progressive) echo "jpeg_filter_progressive on; jpeg_filter_effect grayscale;";;
+		chain)       echo "jpeg_filter_effect grayscale; jpeg_filter_effect brighten 16; jpeg_filter_effect tintblue 8; jpeg_filter_dropon_align bottom right; jpeg_filter_dropon_file $DROPON;";;
+		transcode)   echo "jpeg_filter_transcode on; jpeg_filter_effect pixelate; jpeg_filter_effect darken 40;";;
+	esac
+}
+
+config_micro() {
+	case "$1" in
+		bypass)      echo "";;
+		grayscale)   echo "grayscale";;
+		darken)      echo "darken:32";;
+		dropon)      echo "align:bottom:right offset:-10:-10 dropon:$DROPON";;
+		optimize)    echo "-O grayscale";;
+		progressive) echo "-P grayscale";;
+		chain)       echo "grayscale brighten:16 tintblue:8 align:bottom:right dropon:$DROPON";;
+		transcode)   echo "pixelate darken:40";;
+	esac
+}
+
+# The options for micro come first, then the image, then the operations
+micro_run() {
+	image="$1"; config="$2"; shift 2
+
+	options=""
+	ops=""
+
+	for arg in $(config_micro "$config"); do
+		case "$arg" in
+			-*) options="$options $arg";;
+			*)  ops="$ops $arg";;
+		esac
+	done
+
+	"$BIN/micro" $options "$@" "$CORPUS/$image.jpg" $ops
+}
+
+images() {
+	echo "$CORPUS_IMAGES" | while read name width height options; do
+		if [ "$name" = "" ]; then
+			continue
+		fi
+
+		if [ "$name" = "huge_420_base" -a "$BENCH_HUGE" != "1" ]; then
+			continue
+		fi
+
+		echo "$name"
+	done
+}
+
+do_build() {
+	mkdir -p "$BIN"
+
+	$CC -O2 -Wall $CFLAGS -o "$BIN/mkcorpus" "$BENCH_DIR/mkcorpus.c" $LDFLAGS -ljpeg -lm
+	$CC -O2 -Wall $CFLAGS -o "$BIN/micro" "$BENCH_DIR/micro.c" $LDFLAGS -lmodjpeg -ljpeg -lpng -lm
+}
+
+do_corpus() {
+	mkdir -p "$CORPUS"
+
+	echo "$CORPUS_IMAGES" | while read name width height options; do
+		if [ "$name" = "" ]; then
+			continue
+		fi
+
+		if [ "$name" = "huge_420_base" -a "$BENCH_HUGE" != "1" ]; then
+			continue
+		fi
+
+		if [ ! -f "$CORPUS/$name.jpg" ]; then
+			echo "Generating $name ($width x $height $options)"
+			"$BIN/mkcorpus" $options -o "$CORPUS/$name.jpg" "$width" "$height"
+		fi
+	done
+}
+
+do_micro() {
+	printf "%-18s %-12s %5s %9s %9s %9s %9s %9s %9s %9s %9s %10s %10s\n" \
+		image config n decode50 decode99 chain50 chain99 encode50 encode99 total50 total99 in out
+
+	for image in $(images); do
+		for config in $CONFIGS; do
+			mkdir -p "$OUT/$config"
+
+			micro_run "$image" "$config" -n "$BENCH_ITERATIONS" -o "$OUT/$config/$image.jpg" | \
+				awk -v image="$image" -v config="$config" -F '\t' \
+				'{ printf "%-18s %-12s %5d %9.3f %9.3f %9.3f %9.3f %9.3f %9.3f %9.3f %9.3f %10d %10d\n", image, config, $1, $2, $3, $4, $5, $6, $7, $8, $9, $10, $11 }'
+		done
+	done
+}
+
+# Checksums of the outputs of micro. "bypass" is the original image, as nginx would send it
+outputs() {
+	for image in $(images); do
+		for config in $CONFIGS; do
+			mkdir -p "$OUT/$config"
+
+			if [ "$config" = "bypass" ]; then
+				cp "$CORPUS/$image.jpg" "$OUT/$config/$image.jpg"
+			else
+				micro_run "$image" "$config" -n 1 -o "$OUT/$config/$image.jpg" > /dev/null
+			fi
+		done
+	done
+
+	(cd "$OUT" && md5sum */*.jpg)
+}
+
+do_reference() {
+	outputs > "$BENCH_WORK/reference.md5"
+
+	echo "Wrote $BENCH_WORK/reference.md5"
+}
+
+nginx_start() {
+	mkdir -p "$NGX/conf" "$NGX/logs" "$NGX/html"
+
+	for image in $(images); do
+		ln -sf "$CORPUS/$image.jpg" "$NGX/html/$image.jpg"
+	done
+
+	cat > "$NGX/conf/nginx.conf" <<EOF
+worker_processes $(nproc);
+pid logs/nginx.pid;
+error_log logs/error.log warn;
+
+events {
+	worker_connections 1024;
+}
+
+http {
+	access_log off;
+	sendfile on;
+	keepalive_timeout 65;
+	types { image/jpeg jpg; }
+
+	server {
+		listen 127.0.0.1:$BENCH_PORT;
+		root $NGX/html;
+
+		location = /status {
+			jpeg_filter_status;
+		}
+EOF
+
+	for config in $CONFIGS; do
+		cat >> "$NGX/conf/nginx.conf" <<EOF
+
+		location /$config/ {
+			alias $NGX/html/;
+			jpeg_filter on;
+			jpeg_filter_buffer 64M;
+			$BENCH_NGINX_DIRECTIVES
+			$(config_directives "$config")
+		}
+EOF
+	done
+
+	cat >> "$NGX/conf/nginx.conf" <<EOF
+	}
+}
+EOF
+
+	"$BENCH_NGINX" -p "$NGX" -c conf/nginx.conf
+
+	sleep 1
+}
+
+nginx_stop() {
+	if [ -f "$NGX/logs/nginx.pid" ]; then
+		kill -QUIT "$(cat "$NGX/logs/nginx.pid")" 2>/dev/null || true
+		sleep 1
+	fi
+}
+
+# Sum of the peak resident set sizes of the worker processes in KB
+nginx_rss() {
+	master=$(cat "$NGX/logs/nginx.pid")
+	rss=0
+
+	for pid in $(pgrep -P "$master"); do
+		kb=$(awk '/^VmHWM:/ { print $2 }' "/proc/$pid/status" 2>/dev/null || echo 0)
+		rss=$((rss + kb))
+	done
+
+	echo "$rss"
+}
+
+# Prints requests per second, and the 50th and 99th percentile of the latency in milliseconds
+load_run() {
+	url="$1"
+
+	if command -v wrk > /dev/null; then
+		wrk -t 2 -c "$BENCH_CONNECTIONS" -d "${BENCH_DURATION}s" --latency "$url" | awk '
+			function ms(v) {
+				if(v ~ /us$/) { sub(/us$/, "", v); return v / 1000 }
+				if(v ~ /ms$/) { sub(/ms$/, "", v); return v }
+				if(v ~ /s$/) { sub(/s$/, "", v); return v * 1000 }
+				return v
+			}
+			$1 == "50%" { p50 = ms($2) }
+			$1 == "99%" { p99 = ms($2) }
+			$1 == "Requests/sec:" { rps = $2 }
+			END { printf "%.1f %.3f %.3f\n", rps, p50, p99 }
+		'
+	elif command -v ab > /dev/null; then
+		ab -k -q -t "$BENCH_DURATION" -n 1000000 -c "$BENCH_CONNECTIONS" "$url" | awk '
+			$1 == "Requests" && $3 == "second:" { rps = $4 }
+			$1 == "50%" { p50 = $2 }
+			$1 == "99%" { p99 = $2 }
+			END { printf "%.1f %.3f %.3f\n", rps, p50, p99 }
+		'
+	else
+		echo "Neither wrk nor ab found" >&2
+		exit 1
+	fi
+}
+
+do_load() {
+	trap nginx_stop EXIT
+
+	printf "%-18s %-12s %10s %10s %10s %10s\n" image config req/s p50ms p99ms rss_kb
+
+	for config in $CONFIGS; do
+		# Every config gets fresh workers, such that the RSS belongs to it
+		nginx_start
+
+		result=$(load_run "http://127.0.0.1:$BENCH_PORT/$config/$BENCH_LOAD_IMAGE.jpg")
+
+		printf "%-18s %-12s %10s %10s %10s %10s\n" "$BENCH_LOAD_IMAGE" "$config" $result "$(nginx_rss)"
+
+		nginx_stop
+	done
+}
+
+do_check() {
+	status=0
+	current="$BENCH_WORK/current.md5"
+
+	outputs > "$current"
+
+	if [ -f "$BENCH_WORK/reference.md5" ]; then
+		if diff "$BENCH_WORK/reference.md5" "$current"; then
+			echo "micro: outputs are the same as the reference"
+		else
+			echo "micro: outputs differ from the reference"
+			status=1
+		fi
+	else
+		echo "micro: no reference, run \"$0 reference\" first"
+	fi
+
+	# Dropping the operations that don't change the image must not change the image
+	optimized=0
+
+	for image in $(images); do
+		for config in $CONFIGS; do
+			if [ "$config" = "bypass" ]; then
+				continue
+			fi
+
+			if ! micro_run "$image" "$config" -n 1 -c > /dev/null; then
+				echo "micro: $config/$image differs without the optimizer"
+				optimized=1
+				status=1
+			fi
+		done
+	done
+
+	if [ $optimized -eq 0 ]; then
+		echo "micro: outputs are the same without the optimizer"
+	fi
+
+	if [ -x "$BENCH_NGINX" ]; then
+		trap nginx_stop EXIT
+
+		nginx_start
+
+		for image in $(images); do
+			for config in $CONFIGS; do
+				curl -s -o "$BENCH_WORK/nginx.jpg" "http://127.0.0.1:$BENCH_PORT/$config/$image.jpg"
+
+				# A transcoded image keeps the Huffman tables of the original image, only the coefficients are the same
+				if [ "$config" = "transcode" ]; then
+					if micro_run "$image" "$config" -n 1 -t "$BENCH_WORK/nginx.jpg" > /dev/null; then
+						echo "nginx: $config/$image ok"
+					else
+						echo "nginx: $config/$image differs from micro"
+						status=1
+					fi
+				elif cmp -s "$BENCH_WORK/nginx.jpg" "$OUT/$config/$image.jpg"; then
+					echo "nginx: $config/$image ok"
+				else
+					echo "nginx: $config/$image differs from micro"
+					status=1
+				fi
+			done
+		done
+
+		nginx_stop
+	else
+		echo "nginx: $BENCH_NGINX not found, skipping"
+	fi
+
+	return $status
+}
+
+case "$1" in
+	build)     do_build;;
+	corpus)    do_corpus;;
+	micro)     do_micro;;
+	reference) do_reference;;
+	check)     do_check;;
+	load)      do_load;;
+	all)       do_build; do_corpus; do_micro; do_check; do_load;;
+	*)
+		echo "Usage: $0 build|corpus|micro|reference|check|load|all"
+		exit 1
+		;;
+esac
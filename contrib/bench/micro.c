@@ -0,0 +1,549 @@
+/*
+ * Copyright (c) Ingo Oppermann
+ *
+ * Microbenchmark for the decode, chain, and encode path of the jpeg
+ * filter without nginx. The processing chain is optimized and applied
+ * exactly like ngx_http_jpeg_filter_transform() does it, such that the
+ * output is byte for byte the same as the one from nginx with the same
+ * directives. Except for images that nginx transcoded because of
+ * jpeg_filter_transcode. These keep the Huffman tables of the original
+ * image, i.e. only their DCT coefficients are the same, see -t.
+ *
+ * Usage: micro [-n iterations] [-m max_pixel] [-O] [-P] [-A] [-c] [-t transcoded.jpg] [-o output.jpg] image.jpg [op ...]
+ *
+ *   -n    number of iterations, default 10
+ *   -m    max. number of pixels, default 0 (unlimited)
+ *   -O    jpeg_filter_optimize on
+ *   -P    jpeg_filter_progressive on
+ *   -A    jpeg_filter_arithmetric on
+ *   -c    check that the chain without the operations that the optimizer
+ *         dropped results in the same image, exits with 2 if it doesn't
+ *   -t    check that the DCT coefficients of an image from nginx with
+ *         jpeg_filter_transcode on are the same as the ones of the processed
+ *         image, exits with 2 if they aren't
+ *   -o    write the processed image of the last iteration into a file
+ *
+ * The operations are applied in the given order:
+ *
+ *   grayscale                       jpeg_filter_effect grayscale
+ *   pixelate                        jpeg_filter_effect pixelate
+ *   brighten:N, darken:N            jpeg_filter_effect brighten|darken N
+ *   tintblue:N, tintyellow:N,
+ *   tintred:N, tintgreen:N          jpeg_filter_effect tint... N
+ *   align:V:H                       jpeg_filter_dropon_align V H
+ *   offset:V:H                      jpeg_filter_dropon_offset V H
+ *   dropon:image[:mask]             jpeg_filter_dropon_file image [mask]
+ *
+ * Prints one tab separated line with the median and the 99th percentile
+ * of each stage in milliseconds, and the sizes of the images.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <jpeglib.h>
+#include <libmodjpeg.h>
+
+/* The same as in nginx, for the processing chain and the optimizer of the module */
+typedef intptr_t  ngx_int_t;
+typedef uintptr_t ngx_uint_t;
+
+#include "../../ngx_http_jpeg_filter_chain.h"
+
+typedef ngx_http_jpeg_filter_op_t op_t;
+
+/* The quantized DCT coefficients of an image */
+typedef struct {
+	struct jpeg_decompress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	jvirt_barray_ptr *coefs;
+} coefs_t;
+
+static void usage(const char *name) {
+	fprintf(stderr, "Usage: %s [-n iterations] [-m max_pixel] [-O] [-P] [-A] [-c] [-t transcoded.jpg] [-o output.jpg] image.jpg [op ...]\n", name);
+	exit(1);
+}
+
+static char *read_file(const char *name, size_t *len) {
+	FILE *fp;
+	long size;
+	char *buf;
+
+	fp = fopen(name, "rb");
+	if(fp == NULL) {
+		perror(name);
+		return NULL;
+	}
+
+	fseek(fp, 0, SEEK_END);
+	size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+
+	if(size <= 0) {
+		fprintf(stderr, "%s: empty file\n", name);
+		fclose(fp);
+		return NULL;
+	}
+
+	*len = (size_t)size;
+	buf = malloc(*len);
+
+	if(buf == NULL || fread(buf, 1, *len, fp) != *len) {
+		fprintf(stderr, "%s: can't read file\n", name);
+		fclose(fp);
+		free(buf);
+		return NULL;
+	}
+
+	fclose(fp);
+
+	return buf;
+}
+
+static double now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static int cmp(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+static double percentile(double *v, int n, int p) {
+	qsort(v, n, sizeof(double), cmp);
+
+	return v[(n - 1) * p / 100];
+}
+
+static int align_value(const char *s) {
+	if(strcmp(s, "top") == 0) return MJ_ALIGN_TOP;
+	if(strcmp(s, "bottom") == 0) return MJ_ALIGN_BOTTOM;
+	if(strcmp(s, "left") == 0) return MJ_ALIGN_LEFT;
+	if(strcmp(s, "right") == 0) return MJ_ALIGN_RIGHT;
+	if(strcmp(s, "center") == 0) return MJ_ALIGN_CENTER;
+
+	return -1;
+}
+
+/* Same mapping as ngx_http_jpeg_filter_compile() */
+static int parse_op(char *s, op_t *op) {
+	char *arg1, *arg2;
+	int n;
+
+	memset(op, 0, sizeof(op_t));
+
+	arg1 = strchr(s, ':');
+	if(arg1 != NULL) {
+		*arg1++ = '\0';
+	}
+
+	arg2 = (arg1 != NULL) ? strchr(arg1, ':') : NULL;
+	if(arg2 != NULL) {
+		*arg2++ = '\0';
+	}
+
+	if(strcmp(s, "grayscale") == 0) {
+		op->op = NGX_HTTP_JPEG_FILTER_OP_GRAYSCALE;
+		return 0;
+	}
+
+	if(strcmp(s, "pixelate") == 0) {
+		op->op = NGX_HTTP_JPEG_FILTER_OP_PIXELATE;
+		return 0;
+	}
+
+	if(strcmp(s, "dropon") == 0) {
+		if(arg1 == NULL) {
+			return -1;
+		}
+
+		op->op = NGX_HTTP_JPEG_FILTER_OP_DROPON;
+		op->dropon = malloc(sizeof(mj_dropon_t));
+		if(op->dropon == NULL) {
+			return -1;
+		}
+
+		mj_init_dropon(op->dropon);
+
+		return (mj_read_dropon_from_file(op->dropon, arg1, arg2, MJ_BLEND_FULL) == MJ_OK) ? 0 : -1;
+	}
+
+	if(arg1 == NULL) {
+		return -1;
+	}
+
+	if(strcmp(s, "align") == 0) {
+		if(arg2 == NULL || align_value(arg1) == -1 || align_value(arg2) == -1) {
+			return -1;
+		}
+
+		op->op = NGX_HTTP_JPEG_FILTER_OP_ALIGN;
+		op->arg1 = align_value(arg1) | align_value(arg2);
+
+		return 0;
+	}
+
+	if(strcmp(s, "offset") == 0) {
+		if(arg2 == NULL) {
+			return -1;
+		}
+
+		op->op = NGX_HTTP_JPEG_FILTER_OP_OFFSET;
+		op->arg1 = atoi(arg1);
+		op->arg2 = atoi(arg2);
+
+		return 0;
+	}
+
+	n = atoi(arg1);
+	if(n < 0) {
+		n = 0;
+	}
+
+	if(strcmp(s, "brighten") == 0) {
+		op->op = NGX_HTTP_JPEG_FILTER_OP_LUMINANCE;
+		op->arg1 = n;
+	}
+	else if(strcmp(s, "darken") == 0) {
+		op->op = NGX_HTTP_JPEG_FILTER_OP_LUMINANCE;
+		op->arg1 = -n;
+	}
+	else if(strcmp(s, "tintblue") == 0) {
+		op->op = NGX_HTTP_JPEG_FILTER_OP_TINT;
+		op->arg1 = n;
+	}
+	else if(strcmp(s, "tintyellow") == 0) {
+		op->op = NGX_HTTP_JPEG_FILTER_OP_TINT;
+		op->arg1 = -n;
+	}
+	else if(strcmp(s, "tintred") == 0) {
+		op->op = NGX_HTTP_JPEG_FILTER_OP_TINT;
+		op->arg2 = n;
+	}
+	else if(strcmp(s, "tintgreen") == 0) {
+		op->op = NGX_HTTP_JPEG_FILTER_OP_TINT;
+		op->arg2 = -n;
+	}
+	else {
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Same as the chain in ngx_http_jpeg_filter_transform() */
+static void apply(mj_jpeg_t *m, op_t *ops, int nops) {
+	int i, align = 0, offset_x = 0, offset_y = 0;
+
+	for(i = 0; i < nops; i++) {
+		switch(ops[i].op) {
+			case NGX_HTTP_JPEG_FILTER_OP_GRAYSCALE:
+				mj_effect_grayscale(m);
+				break;
+			case NGX_HTTP_JPEG_FILTER_OP_PIXELATE:
+				mj_effect_pixelate(m);
+				break;
+			case NGX_HTTP_JPEG_FILTER_OP_LUMINANCE:
+				mj_effect_luminance(m, ops[i].arg1);
+				break;
+			case NGX_HTTP_JPEG_FILTER_OP_TINT:
+				mj_effect_tint(m, ops[i].arg1, ops[i].arg2);
+				break;
+			case NGX_HTTP_JPEG_FILTER_OP_ALIGN:
+				align = ops[i].arg1;
+				break;
+			case NGX_HTTP_JPEG_FILTER_OP_OFFSET:
+				offset_y = ops[i].arg1;
+				offset_x = ops[i].arg2;
+				break;
+			case NGX_HTTP_JPEG_FILTER_OP_DROPON:
+				mj_compose(m, ops[i].dropon, align, offset_x, offset_y);
+				break;
+			default:
+				break;
+		}
+	}
+}
+
+/* Read the coefficients with libjpeg. A broken image ends the program */
+static void read_coefs(coefs_t *c, unsigned char *buf, size_t len) {
+	c->cinfo.err = jpeg_std_error(&c->jerr);
+	jpeg_create_decompress(&c->cinfo);
+
+	jpeg_mem_src(&c->cinfo, buf, len);
+	jpeg_read_header(&c->cinfo, TRUE);
+
+	c->coefs = jpeg_read_coefficients(&c->cinfo);
+}
+
+/*
+ * Number of blocks with different coefficients, -1 if the images don't have the same components or
+ * quantization tables. The transcoder only changes the quantized coefficients, i.e. both have to be the same.
+ */
+static long compare_coefs(coefs_t *a, coefs_t *b) {
+	int ci;
+	long diff = 0;
+	JDIMENSION row, col;
+	JBLOCKARRAY ra, rb;
+	jpeg_component_info *ca, *cb;
+
+	if(a->cinfo.image_width != b->cinfo.image_width || a->cinfo.image_height != b->cinfo.image_height || a->cinfo.num_components != b->cinfo.num_components) {
+		return -1;
+	}
+
+	for(ci = 0; ci < a->cinfo.num_components; ci++) {
+		ca = &a->cinfo.comp_info[ci];
+		cb = &b->cinfo.comp_info[ci];
+
+		if(ca->h_samp_factor != cb->h_samp_factor || ca->v_samp_factor != cb->v_samp_factor) {
+			return -1;
+		}
+
+		if(ca->quant_table == NULL || cb->quant_table == NULL || memcmp(ca->quant_table->quantval, cb->quant_table->quantval, sizeof(ca->quant_table->quantval)) != 0) {
+			return -1;
+		}
+
+		for(row = 0; row < ca->height_in_blocks; row++) {
+			ra = (*a->cinfo.mem->access_virt_barray)((j_common_ptr)&a->cinfo, a->coefs[ci], row, 1, FALSE);
+			rb = (*b->cinfo.mem->access_virt_barray)((j_common_ptr)&b->cinfo, b->coefs[ci], row, 1, FALSE);
+
+			for(col = 0; col < ca->width_in_blocks; col++) {
+				if(memcmp(ra[0][col], rb[0][col], sizeof(JBLOCK)) != 0) {
+					diff++;
+				}
+			}
+		}
+	}
+
+	return diff;
+}
+
+/* Decode, process, and encode the image once */
+static int process(char *in, size_t in_len, size_t max_pixel, op_t *ops, int nops, int options, unsigned char **out, size_t *out_len) {
+	mj_jpeg_t m;
+
+	mj_init_jpeg(&m);
+
+	if(mj_read_jpeg_from_memory(&m, in, in_len, max_pixel) != MJ_OK) {
+		return -1;
+	}
+
+	apply(&m, ops, nops);
+
+	if(mj_write_jpeg_to_memory(&m, out, out_len, options) != 0) {
+		mj_free_jpeg(&m);
+		return -1;
+	}
+
+	mj_free_jpeg(&m);
+
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	int c, i, iterations = 10, options = 0, nops = 0, compare = 0;
+	size_t max_pixel = 0, in_len, out_len = 0, check_len = 0, transcoded_len = 0;
+	char *output = NULL, *transcoded_file = NULL, *in, *transcoded = NULL;
+	unsigned char *out = NULL, *check = NULL;
+	double t, *decode, *chain, *encode, *total;
+	op_t *ops, *unoptimized;
+	coefs_t processed_coefs, transcoded_coefs;
+	long diff;
+	FILE *fp;
+
+	while((c = getopt(argc, argv, "n:m:OPAct:o:")) != -1) {
+		switch(c) {
+			case 'n':
+				iterations = atoi(optarg);
+				break;
+			case 'm':
+				max_pixel = strtoul(optarg, NULL, 10);
+				break;
+			case 'O':
+				options |= MJ_OPTION_OPTIMIZE;
+				break;
+			case 'P':
+				options |= MJ_OPTION_PROGRESSIVE;
+				break;
+			case 'A':
+				options |= MJ_OPTION_ARITHMETRIC;
+				break;
+			case 'c':
+				compare = 1;
+				break;
+			case 't':
+				transcoded_file = optarg;
+				break;
+			case 'o':
+				output = optarg;
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+
+	if(optind >= argc || iterations < 1) {
+		usage(argv[0]);
+	}
+
+	/* Read the original image like the body filter would have buffered it */
+	in = read_file(argv[optind], &in_len);
+	if(in == NULL) {
+		return 1;
+	}
+
+	if(transcoded_file != NULL) {
+		transcoded = read_file(transcoded_file, &transcoded_len);
+		if(transcoded == NULL) {
+			return 1;
+		}
+	}
+
+	/* Dropons are loaded once, like with jpeg_filter_dropon_file without variables */
+	ops = calloc(argc, sizeof(op_t));
+	if(ops == NULL) {
+		return 1;
+	}
+
+	for(i = optind + 1; i < argc; i++) {
+		if(parse_op(argv[i], &ops[nops]) != 0) {
+			fprintf(stderr, "Invalid operation: %s\n", argv[i]);
+			return 1;
+		}
+
+		nops++;
+	}
+
+	/* The module drops the operations that don't change the image */
+	unoptimized = calloc(argc, sizeof(op_t));
+	if(unoptimized == NULL) {
+		return 1;
+	}
+
+	memcpy(unoptimized, ops, nops * sizeof(op_t));
+
+	ngx_http_jpeg_filter_optimize(ops, nops);
+
+	decode = calloc(iterations, sizeof(double));
+	chain = calloc(iterations, sizeof(double));
+	encode = calloc(iterations, sizeof(double));
+	total = calloc(iterations, sizeof(double));
+
+	if(decode == NULL || chain == NULL || encode == NULL || total == NULL) {
+		return 1;
+	}
+
+	for(i = 0; i < iterations; i++) {
+		mj_jpeg_t m;
+
+		mj_init_jpeg(&m);
+
+		t = now();
+
+		if(mj_read_jpeg_from_memory(&m, in, in_len, max_pixel) != MJ_OK) {
+			fprintf(stderr, "%s: can't decode image\n", argv[optind]);
+			return 1;
+		}
+
+		decode[i] = now() - t;
+		t = now();
+
+		apply(&m, ops, nops);
+
+		chain[i] = now() - t;
+		t = now();
+
+		free(out);
+		out = NULL;
+		out_len = 0;
+
+		if(mj_write_jpeg_to_memory(&m, &out, &out_len, options) != 0) {
+			fprintf(stderr, "%s: can't encode image\n", argv[optind]);
+			return 1;
+		}
+
+		encode[i] = now() - t;
+		total[i] = decode[i] + chain[i] + encode[i];
+
+		mj_free_jpeg(&m);
+	}
+
+	if(compare == 1) {
+		if(process(in, in_len, max_pixel, unoptimized, nops, options, &check, &check_len) != 0) {
+			fprintf(stderr, "%s: can't process image without the optimizer\n", argv[optind]);
+			return 1;
+		}
+
+		if(check_len != out_len || memcmp(check, out, out_len) != 0) {
+			fprintf(stderr, "%s: the optimized chain results in a different image\n", argv[optind]);
+			return 2;
+		}
+
+		free(check);
+	}
+
+	if(transcoded != NULL) {
+		read_coefs(&processed_coefs, out, out_len);
+		read_coefs(&transcoded_coefs, (unsigned char *)transcoded, transcoded_len);
+
+		diff = compare_coefs(&processed_coefs, &transcoded_coefs);
+
+		jpeg_destroy_decompress(&processed_coefs.cinfo);
+		jpeg_destroy_decompress(&transcoded_coefs.cinfo);
+
+		if(diff != 0) {
+			if(diff < 0) {
+				fprintf(stderr, "%s: the components or quantization tables differ from the processed image\n", transcoded_file);
+			}
+			else {
+				fprintf(stderr, "%s: %ld blocks differ from the processed image\n", transcoded_file, diff);
+			}
+
+			return 2;
+		}
+
+		free(transcoded);
+	}
+
+	if(output != NULL) {
+		fp = fopen(output, "wb");
+		if(fp == NULL || fwrite(out, 1, out_len, fp) != out_len) {
+			perror(output);
+			return 1;
+		}
+
+		fclose(fp);
+	}
+
+	printf("%d\t%.3f\t%.3f\t%.3f\t%.3f\t%.3f\t%.3f\t%.3f\t%.3f\t%zu\t%zu\n",
+		iterations,
+		percentile(decode, iterations, 50), percentile(decode, iterations, 99),
+		percentile(chain, iterations, 50), percentile(chain, iterations, 99),
+		percentile(encode, iterations, 50), percentile(encode, iterations, 99),
+		percentile(total, iterations, 50), percentile(total, iterations, 99),
+		in_len, out_len);
+
+	/* The optimizer never drops a dropon */
+	for(i = 0; i < nops; i++) {
+		if(ops[i].op == NGX_HTTP_JPEG_FILTER_OP_DROPON) {
+			mj_free_dropon(ops[i].dropon);
+			free(ops[i].dropon);
+		}
+	}
+
+	free(unoptimized);
+	free(ops);
+	free(out);
+	free(in);
+
+	return 0;
+}
@@ -0,0 +1,156 @@
+/*
+ * Copyright (c) Ingo Oppermann
+ *
+ * Generates a synthetic JPEG image for the benchmarks. The content is
+ * deterministic, such that the same parameters always result in the
+ * same image, and it is a mix of smooth gradients, edges, and noise
+ * in order to compress roughly like a photo.
+ *
+ * The image is generated line by line, i.e. even images with 150
+ * megapixel don't need much memory.
+ *
+ * Usage: mkcorpus [-p] [-s 444|422|420] [-r rows] [-q quality] -o image.jpg width height
+ *
+ *   -p    write a progressive JPEG
+ *   -s    chroma subsampling, default 420
+ *   -r    restart interval in MCU rows, default 0 (no restart markers)
+ *   -q    quality, default 85
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+
+#include <jpeglib.h>
+
+static void usage(const char *name) {
+	fprintf(stderr, "Usage: %s [-p] [-s 444|422|420] [-r rows] [-q quality] -o image.jpg width height\n", name);
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	JSAMPROW row;
+	FILE *fp;
+	char *output = NULL;
+	int c, progressive = 0, subsampling = 420, restart = 0, quality = 85;
+	unsigned int width, height, x, y, seed = 1;
+
+	while((c = getopt(argc, argv, "ps:r:q:o:")) != -1) {
+		switch(c) {
+			case 'p':
+				progressive = 1;
+				break;
+			case 's':
+				subsampling = atoi(optarg);
+				break;
+			case 'r':
+				restart = atoi(optarg);
+				break;
+			case 'q':
+				quality = atoi(optarg);
+				break;
+			case 'o':
+				output = optarg;
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+
+	if(output == NULL || argc - optind != 2) {
+		usage(argv[0]);
+	}
+
+	if(subsampling != 444 && subsampling != 422 && subsampling != 420) {
+		usage(argv[0]);
+	}
+
+	width = atoi(argv[optind]);
+	height = atoi(argv[optind + 1]);
+
+	if(width == 0 || height == 0 || width > JPEG_MAX_DIMENSION || height > JPEG_MAX_DIMENSION) {
+		fprintf(stderr, "Invalid dimensions %ux%u\n", width, height);
+		return 1;
+	}
+
+	fp = fopen(output, "wb");
+	if(fp == NULL) {
+		perror(output);
+		return 1;
+	}
+
+	row = malloc(width * 3);
+	if(row == NULL) {
+		fclose(fp);
+		return 1;
+	}
+
+	cinfo.err = jpeg_std_error(&jerr);
+	jpeg_create_compress(&cinfo);
+	jpeg_stdio_dest(&cinfo, fp);
+
+	cinfo.image_width = width;
+	cinfo.image_height = height;
+	cinfo.input_components = 3;
+	cinfo.in_color_space = JCS_RGB;
+
+	jpeg_set_defaults(&cinfo);
+	jpeg_set_quality(&cinfo, quality, TRUE);
+
+	/* The defaults are 2x2 for the luminance and 1x1 for the chrominance components, i.e. 4:2:0 */
+	if(subsampling == 444) {
+		cinfo.comp_info[0].h_samp_factor = 1;
+		cinfo.comp_info[0].v_samp_factor = 1;
+	}
+	else if(subsampling == 422) {
+		cinfo.comp_info[0].h_samp_factor = 2;
+		cinfo.comp_info[0].v_samp_factor = 1;
+	}
+
+	cinfo.restart_in_rows = restart;
+
+	if(progressive) {
+		jpeg_simple_progression(&cinfo);
+	}
+
+	jpeg_start_compress(&cinfo, TRUE);
+
+	for(y = 0; y < height; y++) {
+		for(x = 0; x < width; x++) {
+			double fx = (double)x / width, fy = (double)y / height;
+			int n, r, g, b;
+
+			/* A simple LCG keeps the noise the same on all platforms */
+			seed = seed * 1103515245 + 12345;
+			n = (int)((seed >> 16) & 0x1f) - 16;
+
+			r = (int)(255 * fx) + n;
+			g = (int)(128 + 127 * sin(fx * 12.0 + fy * 7.0)) + n;
+			b = (int)(255 * fy) + n;
+
+			/* Some hard edges */
+			if(((x / 97) + (y / 61)) % 5 == 0) {
+				r = 255 - r;
+				b = 255 - b;
+			}
+
+			row[x * 3 + 0] = r < 0 ? 0 : (r > 255 ? 255 : r);
+			row[x * 3 + 1] = g < 0 ? 0 : (g > 255 ? 255 : g);
+			row[x * 3 + 2] = b < 0 ? 0 : (b > 255 ? 255 : b);
+		}
+
+		jpeg_write_scanlines(&cinfo, &row, 1);
+	}
+
+	jpeg_finish_compress(&cinfo);
+	jpeg_destroy_compress(&cinfo);
+
+	free(row);
+	fclose(fp);
+
+	return 0;
+}
@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) Ingo Oppermann
+ *
+ * The resolved processing chain of the jpeg filter and its optimizer.
+ *
+ * This doesn't depend on nginx other than for ngx_int_t and ngx_uint_t,
+ * such that contrib/bench/micro.c applies the same optimizer as the module.
+ */
+
+#ifndef _NGX_HTTP_JPEG_FILTER_CHAIN_H_INCLUDED_
+#define _NGX_HTTP_JPEG_FILTER_CHAIN_H_INCLUDED_
+
+/* Operations of the resolved processing chain */
+#define NGX_HTTP_JPEG_FILTER_OP_NONE                       0
+#define NGX_HTTP_JPEG_FILTER_OP_GRAYSCALE                  1
+#define NGX_HTTP_JPEG_FILTER_OP_PIXELATE                   2
+#define NGX_HTTP_JPEG_FILTER_OP_LUMINANCE                  3
+#define NGX_HTTP_JPEG_FILTER_OP_TINT                       4
+#define NGX_HTTP_JPEG_FILTER_OP_ALIGN                      5
+#define NGX_HTTP_JPEG_FILTER_OP_OFFSET                     6
+#define NGX_HTTP_JPEG_FILTER_OP_DROPON                     7
+#define NGX_HTTP_JPEG_FILTER_OP_DROPON_DYNAMIC             8
+
+/* A resolved element of the processing chain */
+typedef struct {
+	ngx_uint_t	 op;                /* Operation, one of NGX_HTTP_JPEG_FILTER_OP_* */
+	ngx_int_t	 arg1;              /* Luminance, blue tint, alignment, or vertical offset. Depends on the operation */
+	ngx_int_t	 arg2;              /* Red tint or horizontal offset. Depends on the operation */
+	mj_dropon_t	*dropon;            /* Preloaded dropon. Depends on the operation */
+} ngx_http_jpeg_filter_op_t;
+
+/*
+ * Drop the operations from the resolved processing chain that don't change the resulting image, because
+ * each effect walks all coefficients of the image once. These are effects with a value of 0, and a grayscale
+ * or pixelate that is repeated without anything in between that could undo it. Dropons read and write all
+ * components, so nothing is moved across them. Tints before a grayscale are kept, because it is not known
+ * whether mj_effect_grayscale() clears everything a tint changes.
+ */
+static void ngx_http_jpeg_filter_optimize(ngx_http_jpeg_filter_op_t *ops, ngx_uint_t nops) {
+	ngx_uint_t  i, grayscale, pixelate;
+
+	grayscale = 0;
+	pixelate = 0;
+
+	for(i = 0; i < nops; i++) {
+		switch(ops[i].op) {
+			case NGX_HTTP_JPEG_FILTER_OP_GRAYSCALE:
+				if(grayscale == 1) {
+					ops[i].op = NGX_HTTP_JPEG_FILTER_OP_NONE;
+				}
+
+				grayscale = 1;
+				break;
+			case NGX_HTTP_JPEG_FILTER_OP_PIXELATE:
+				if(pixelate == 1) {
+					ops[i].op = NGX_HTTP_JPEG_FILTER_OP_NONE;
+				}
+
+				pixelate = 1;
+				break;
+			case NGX_HTTP_JPEG_FILTER_OP_LUMINANCE:
+				/* Only the DC coefficients of the Y component are changed */
+				if(ops[i].arg1 == 0) {
+					ops[i].op = NGX_HTTP_JPEG_FILTER_OP_NONE;
+				}
+
+				break;
+			case NGX_HTTP_JPEG_FILTER_OP_TINT:
+				/* Only the DC coefficients of the color components are changed */
+				if(ops[i].arg1 == 0 && ops[i].arg2 == 0) {
+					ops[i].op = NGX_HTTP_JPEG_FILTER_OP_NONE;
+				}
+				else {
+					grayscale = 0;
+				}
+
+				break;
+			case NGX_HTTP_JPEG_FILTER_OP_DROPON:
+			case NGX_HTTP_JPEG_FILTER_OP_DROPON_DYNAMIC:
+				grayscale = 0;
+				pixelate = 0;
+				break;
+			default:
+				break;
+		}
+	}
+
+	return;
+}
+
+#endif /* _NGX_HTTP_JPEG_FILTER_CHAIN_H_INCLUDED_ */
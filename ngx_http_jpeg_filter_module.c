@@ -24,18 +24,34 @@
  * Default: 0
  * Context: http, server, location
  *
- * jpeg_filter_optimize on|off
+ * jpeg_filter_time_budget time
+ * Default: 0
+ * Context: http, server, location
+ *
+ * jpeg_filter_max_memory size
+ * Default: 0
+ * Context: http, server, location
+ *
+ * jpeg_filter_optimize on|off|auto
  * Default: off
  * Context: http, server, location
  *
- * jpeg_filter_progressive on|off
+ * jpeg_filter_progressive on|off|auto
  * Default: off
  * Context: http, server, location
  *
+ * jpeg_filter_auto [pixel=number] [size=size] [gain=size]
+ * Default: pixel=100000 size=10k gain=1k
+ * Context: http, server, location
+ *
  * jpeg_filter_arithmetric on|off
  * Default: off
  * Context: http, server, location
  *
+ * jpeg_filter_transcode on|off
+ * Default: off
+ * Context: http, server, location
+ *
  * jpeg_filter_graceful on|off
  * Default: off
  * Context: http, server, location
@@ -44,6 +60,49 @@
  * Default: 2M
  * Context: http, server, location
  *
+ * jpeg_filter_thread_pool name|off
+ * Default: off
+ * Context: http, server, location
+ *
+ * jpeg_filter_bands number
+ * Default: 1
+ * Context: http, server, location
+ *
+ * jpeg_filter_cache zone=name[:size] [key=string] [valid=time]
+ * jpeg_filter_cache off
+ * Default: off
+ * Context: http, server, location
+ *
+ * jpeg_filter_dropon_cache size
+ * Default: 0
+ * Context: http
+ *
+ * jpeg_filter_arena size [hugepages]
+ * Default: 0
+ * Context: http
+ *
+ * jpeg_filter_cache_path path [levels=levels] keys_zone=name:size [inactive=time] [max_size=size] ...
+ * Default: -
+ * Context: http
+ *
+ * jpeg_filter_store zone=name [key=string] [valid=time]
+ * jpeg_filter_store off
+ * Default: off
+ * Context: http, server, location
+ *
+ * jpeg_filter_limit [concurrent=number] [memory=size] [queue=time]
+ * jpeg_filter_limit off
+ * Default: off
+ * Context: http
+ *
+ * jpeg_filter_bypass string ...
+ * Default: -
+ * Context: http, server, location
+ *
+ * jpeg_filter_status
+ * Default: -
+ * Context: location
+ *
  * jpeg_filter_effect grayscale|pixelate
  * jpeg_filter_effect darken|brighten value
  * jpeg_filter_effect tintblue|tintyellow|tintred|tintgreen value
@@ -76,6 +135,8 @@
 
 #include <libmodjpeg.h>
 
+#include "ngx_http_jpeg_filter_chain.h"
+
 #define NGX_HTTP_IMAGE_NONE      0
 #define NGX_HTTP_IMAGE_JPEG      1
 
@@ -87,9 +148,42 @@
 #define NGX_HTTP_JPEG_FILTER_PHASE_PROCESS        2
 #define NGX_HTTP_JPEG_FILTER_PHASE_PASS           3
 #define NGX_HTTP_JPEG_FILTER_PHASE_DONE           4
+#define NGX_HTTP_JPEG_FILTER_PHASE_THREAD         5
+#define NGX_HTTP_JPEG_FILTER_PHASE_DISCARD        6
+#define NGX_HTTP_JPEG_FILTER_PHASE_QUEUE          7
+
+/* States of the admission of a request by jpeg_filter_limit */
+#define NGX_HTTP_JPEG_FILTER_LIMIT_NONE           0
+#define NGX_HTTP_JPEG_FILTER_LIMIT_QUEUED         1
+#define NGX_HTTP_JPEG_FILTER_LIMIT_ADMITTED       2
+#define NGX_HTTP_JPEG_FILTER_LIMIT_REFUSED        3
+
+/*
+ * How often a queued request tries to get admitted, in milliseconds. The interval doubles with every
+ * try. Requests that are done in the same worker wake up the queued ones right away.
+ */
+#define NGX_HTTP_JPEG_FILTER_LIMIT_RETRY          10
+#define NGX_HTTP_JPEG_FILTER_LIMIT_RETRY_MAX      160
+
+#define NGX_HTTP_JPEG_FILTER_AUTO                 2
+
+/* The output codings chosen by jpeg_filter_optimize auto and jpeg_filter_progressive auto */
+#define NGX_HTTP_JPEG_FILTER_CODING_OPTIMIZE      0
+#define NGX_HTTP_JPEG_FILTER_CODING_PROGRESSIVE   1
+#define NGX_HTTP_JPEG_FILTER_CODINGS              2
+
+#define NGX_HTTP_JPEG_FILTER_CODING_WARMUP        4      /* Number of images that are probed before a coding may be turned off */
+#define NGX_HTTP_JPEG_FILTER_CODING_PROBE         16     /* Every that many images a coding is probed again */
 
 #define NGX_HTTP_JPEG_FILTER_UNMODIFIED           0
 #define NGX_HTTP_JPEG_FILTER_MODIFIED             1
+#define NGX_HTTP_JPEG_FILTER_STORED               2
+
+/* The states of looking up the processed image in jpeg_filter_store */
+#define NGX_HTTP_JPEG_FILTER_STORE_NONE           0
+#define NGX_HTTP_JPEG_FILTER_STORE_READING        1
+#define NGX_HTTP_JPEG_FILTER_STORE_MISS           2
+#define NGX_HTTP_JPEG_FILTER_STORE_DONE           3
 
 /* Types for the filter elements */
 #define NGX_HTTP_JPEG_FILTER_TYPE_EFFECT1                  1
@@ -102,7 +196,50 @@
 #define NGX_HTTP_JPEG_FILTER_TYPE_DROPON_MEMORY1           8
 #define NGX_HTTP_JPEG_FILTER_TYPE_DROPON_MEMORY2           9
 
+/* Results of responses for the metrics */
+#define NGX_HTTP_JPEG_FILTER_RESULT_PROCESSED              0
+#define NGX_HTTP_JPEG_FILTER_RESULT_CACHED                 1
+#define NGX_HTTP_JPEG_FILTER_RESULT_NOT_MODIFIED           2
+#define NGX_HTTP_JPEG_FILTER_RESULT_SKIPPED                3
+#define NGX_HTTP_JPEG_FILTER_RESULT_GRACEFUL               4
+#define NGX_HTTP_JPEG_FILTER_RESULT_REJECTED               5
+#define NGX_HTTP_JPEG_FILTER_RESULT_LIMITED                6
+#define NGX_HTTP_JPEG_FILTER_RESULT_ABORTED                7
+#define NGX_HTTP_JPEG_FILTER_RESULTS                       8
+
+/* Stages of processing an image for the metrics */
+#define NGX_HTTP_JPEG_FILTER_STAGE_READ                    0
+#define NGX_HTTP_JPEG_FILTER_STAGE_DECODE                  1
+#define NGX_HTTP_JPEG_FILTER_STAGE_CHAIN                   2
+#define NGX_HTTP_JPEG_FILTER_STAGE_ENCODE                  3
+#define NGX_HTTP_JPEG_FILTER_STAGES                        4
+
+#define NGX_HTTP_JPEG_FILTER_BUCKETS                       11
+#define NGX_HTTP_JPEG_FILTER_OPS                           (NGX_HTTP_JPEG_FILTER_OP_DROPON_DYNAMIC + 1)
+
 #define NGX_HTTP_JPEG_FILTER_BUFFER_SIZE          2 * 1024 * 1024
+#define NGX_HTTP_JPEG_FILTER_BUFFER_INITIAL       64 * 1024
+#define NGX_HTTP_JPEG_FILTER_OUTPUT_SLACK         4 * 1024
+
+/* Cost model for jpeg_filter_time_budget, see ngx_http_jpeg_filter_estimate() */
+#define NGX_HTTP_JPEG_FILTER_COST_SEED            15000  /* Microseconds per million samples of a baseline image */
+#define NGX_HTTP_JPEG_FILTER_COST_CLASSES         4      /* Baseline or progressive, Huffman or arithmetic coded */
+#define NGX_HTTP_JPEG_FILTER_COST_WEIGHT          8      /* Weight of the past in the moving average of the cost */
+
+/* Largest category of a DC difference in an 8 bit baseline image */
+#define NGX_HTTP_JPEG_FILTER_DC_CATEGORY          11
+
+/* Min. number of samples of a band for jpeg_filter_bands, smaller images are not worth the tasks */
+#define NGX_HTTP_JPEG_FILTER_BAND_SAMPLES         1000000
+
+/* Size of a transparent huge page for jpeg_filter_arena. Larger blocks are rounded up to a multiple of it */
+#define NGX_HTTP_JPEG_FILTER_HUGEPAGE             (2 * 1024 * 1024)
+
+#define NGX_HTTP_JPEG_FILTER_CACHE_VALID          600
+
+/* An image may use at most this fraction of the zone of jpeg_filter_cache, larger ones would evict too many others */
+#define NGX_HTTP_JPEG_FILTER_CACHE_FRACTION       8
+#define NGX_HTTP_JPEG_FILTER_STORE_VALID          86400
 
 /* Configuration of the elements in the processing chain */
 typedef struct {
@@ -110,36 +247,346 @@ typedef struct {
 	ngx_http_complex_value_t  cv1;      /* First complex value. Depends on the type if it is used */
 	ngx_http_complex_value_t  cv2;      /* Second complex value. Depends on the type if it is used */
 	mj_dropon_t              *dropon;   /* libmodjpeg dropon type. Depends on the type if it is used */
+	ngx_http_jpeg_filter_op_t op;       /* The element resolved at configuration time */
+	ngx_uint_t                variable; /* Whether the element has to be resolved for each request */
 } ngx_http_jpeg_filter_element_t;
 
+/* Evaluated complex values of an element in the processing chain */
+typedef struct {
+	ngx_str_t	val1;               /* Value of cv1 without the terminating '\0', data is NULL if not available */
+	ngx_str_t	val2;               /* Value of cv2 without the terminating '\0', data is NULL if not available */
+} ngx_http_jpeg_filter_value_t;
+
+/* Shared memory of the cache for processed images */
+typedef struct {
+	ngx_rbtree_t       rbtree;          /* Cached images by key */
+	ngx_rbtree_node_t  sentinel;
+	ngx_queue_t        queue;           /* Cached images, least recently used last */
+} ngx_http_jpeg_filter_cache_sh_t;
+
+typedef struct {
+	ngx_http_jpeg_filter_cache_sh_t  *sh;
+	ngx_slab_pool_t                  *shpool;
+	size_t                            max_size;  /* Max. size of a cached image */
+} ngx_http_jpeg_filter_cache_t;
+
+/* A cached processed image. The image data follows the struct */
+typedef struct {
+	ngx_rbtree_node_t  node;            /* The rbtree key are the first bytes of the key */
+	ngx_queue_t        queue;
+	u_char             key[16];         /* MD5 of the cache key */
+	time_t             expire;          /* Time when this entry becomes invalid */
+	size_t             len;             /* Length of the image */
+	u_char             data[1];         /* The image */
+} ngx_http_jpeg_filter_cache_node_t;
+
+/* A cached dynamic dropon. Starts like ngx_http_jpeg_filter_cache_node_t in order to share the rbtree functions */
+typedef struct {
+	ngx_rbtree_node_t  node;            /* The rbtree key are the first bytes of the key */
+	ngx_queue_t        queue;
+	u_char             key[16];         /* MD5 of the paths and file infos, or of the bytestreams */
+	size_t             size;            /* Estimated memory used by the dropon */
+	ngx_uint_t         refs;            /* Number of requests currently using the dropon */
+	ngx_uint_t         cached;          /* Whether the dropon is in the cache or only used by a single request */
+	mj_dropon_t        dropon;
+} ngx_http_jpeg_filter_dropon_node_t;
+
+/* Cache for the dynamic dropons of a worker */
+typedef struct {
+	ngx_rbtree_t       rbtree;          /* Cached dropons by key */
+	ngx_rbtree_node_t  sentinel;
+	ngx_queue_t        queue;           /* Cached dropons, least recently used last */
+
+	size_t             size;            /* Estimated memory used by all cached dropons */
+	size_t             max_size;        /* Max. memory used by all cached dropons */
+
+	ngx_uint_t         hits;
+	ngx_uint_t         misses;
+	ngx_uint_t         evictions;
+
+#if (NGX_THREADS)
+	ngx_thread_mutex_t mutex;           /* The dropons are loaded in the threads of a thread pool as well */
+#endif
+} ngx_http_jpeg_filter_dropon_cache_t;
+
+/* A block of the arena. The memory for the image follows the struct */
+typedef struct {
+	ngx_queue_t        queue;
+	size_t             size;            /* Size of the mapping including this struct */
+} ngx_http_jpeg_filter_block_t;
+
+/*
+ * Buffers for the original and the processed images of a worker that are kept across requests. They are only taken
+ * and given back by the worker itself, never by the threads of a thread pool.
+ */
+typedef struct {
+	ngx_queue_t        queue;           /* Free blocks, least recently used last */
+	size_t             size;            /* Size of all free blocks */
+	size_t             max_size;        /* Max. size of all free blocks */
+	ngx_flag_t         hugepages;       /* Whether large blocks are backed by transparent huge pages */
+
+	ngx_uint_t         hits;
+	ngx_uint_t         misses;
+} ngx_http_jpeg_filter_arena_t;
+
+/* Metrics of a location in shared memory */
+typedef struct {
+	ngx_atomic_t       responses[NGX_HTTP_JPEG_FILTER_RESULTS];   /* Responses by result */
+	ngx_atomic_t       in_bytes;        /* Size of the processed original images */
+	ngx_atomic_t       out_bytes;       /* Size of the processed images */
+	ngx_atomic_t       pixels;          /* Pixel of the processed images */
+	ngx_atomic_t       buffered;        /* Memory currently used for buffering original images */
+
+	ngx_atomic_t       stage_buckets[NGX_HTTP_JPEG_FILTER_STAGES][NGX_HTTP_JPEG_FILTER_BUCKETS + 1];  /* Latency histograms, not cumulative */
+	ngx_atomic_t       stage_usec[NGX_HTTP_JPEG_FILTER_STAGES];  /* Sum of the latencies in microseconds */
+
+	ngx_atomic_t       op_count[NGX_HTTP_JPEG_FILTER_OPS];       /* Applied operations of the processing chain */
+	ngx_atomic_t       op_usec[NGX_HTTP_JPEG_FILTER_OPS];        /* Time spent on the operations in microseconds */
+} ngx_http_jpeg_filter_metrics_t;
+
+/* A location with metrics */
+typedef struct {
+	void              *clcf;            /* Core configuration of the location, identifies it */
+	ngx_str_t          server;          /* First name of the server */
+	ngx_str_t          location;        /* Name of the location */
+	ngx_uint_t         instance;        /* Number of locations before with the same names */
+} ngx_http_jpeg_filter_status_location_t;
+
+/* Resources in use by all workers for jpeg_filter_limit, in shared memory */
+typedef struct {
+	ngx_atomic_t       concurrent;      /* Number of admitted requests */
+	ngx_atomic_t       memory;          /* Estimated memory of the admitted requests */
+} ngx_http_jpeg_filter_limit_t;
+
+/* Payoff of an output coding in a location as measured by this worker */
+typedef struct {
+	ngx_uint_t         images;          /* Number of images the coding was considered for */
+	ngx_uint_t         probes;          /* Number of images that have been encoded with and without the coding */
+	ngx_int_t          saved;           /* Moving average of the bytes saved by the coding */
+	ngx_int_t          usec;            /* Moving average of the additional time for encoding in microseconds */
+	ngx_uint_t         off;             /* Whether the coding doesn't pay off */
+} ngx_http_jpeg_filter_coding_t;
+
+/* A Huffman table of the original image for transcoding */
+typedef struct {
+	ngx_uint_t         defined;         /* Whether the table has been defined by a DHT segment */
+	u_char             values[256];     /* Symbols in the order of their codes */
+	ngx_int_t          mincode[17];     /* Smallest code of each length */
+	ngx_int_t          maxcode[17];     /* Largest code of each length, -1 if there are none */
+	ngx_int_t          valptr[17];      /* Index in values of the smallest code of each length */
+	u_char             look_len[256];   /* Length of the code in the next 8 bits, 0 if it is longer */
+	u_char             look_sym[256];   /* Symbol of the code in the next 8 bits */
+	uint16_t           code[256];       /* Code of each symbol */
+	u_char             size[256];       /* Length of the code of each symbol, 0 if the symbol has no code */
+} ngx_http_jpeg_filter_huffman_t;
+
+/* State of transcoding the entropy coded data of the original image, see ngx_http_jpeg_filter_transcode() */
+typedef struct {
+	ngx_http_jpeg_filter_op_t  *ops;    /* Resolved processing chain, for the changes of the DC coefficients */
+	ngx_uint_t         nops;
+	ngx_uint_t         shifted;         /* Whether the processing chain changes the DC coefficients */
+	ngx_int_t          shift[3];        /* Change of the quantized DC coefficients of the Y, Cb, and Cr component */
+	ngx_uint_t         pixelate;        /* Whether the AC coefficients are dropped */
+
+	ngx_http_jpeg_filter_huffman_t  dc[4];
+	ngx_http_jpeg_filter_huffman_t  ac[4];
+
+	ngx_uint_t         width;           /* From the frame header */
+	ngx_uint_t         height;
+	ngx_uint_t         components;
+	ngx_uint_t         id[4];           /* Id, sampling factors, and quantization table of each component */
+	ngx_uint_t         h[4];
+	ngx_uint_t         v[4];
+	ngx_uint_t         tq[4];
+	ngx_uint_t         quant[4];        /* DC quantizer of each quantization table, 0 if it is not defined */
+	ngx_uint_t         hmax;
+	ngx_uint_t         vmax;
+	ngx_uint_t         restart;         /* Restart interval in MCUs, 0 if none */
+	ngx_uint_t         rgb;             /* Whether an Adobe marker says that the components are not YCbCr */
+
+	ngx_uint_t         scan_components; /* Number of components in the current scan */
+	ngx_uint_t         scan_dc[4];      /* DC and AC table, number of blocks in a MCU, and DC change of each component in the scan */
+	ngx_uint_t         scan_ac[4];
+	ngx_uint_t         scan_blocks[4];
+	ngx_int_t          scan_shift[4];
+	ngx_uint_t         mcus;            /* Number of MCUs in the current scan */
+
+	u_char            *in;              /* Next byte of the entropy coded data */
+	u_char            *in_last;
+	uint32_t           get;             /* Bits read but not decoded yet */
+	ngx_uint_t         get_bits;
+	ngx_uint_t         fake;            /* Zero bits fed to the decoder after the end of the entropy coded data */
+	ngx_uint_t         marker;          /* Whether the end of the entropy coded data has been reached */
+
+	u_char            *out;             /* Next byte of the processed image */
+	u_char            *out_end;
+	uint32_t           put;             /* Bits encoded but not written yet */
+	ngx_uint_t         put_bits;
+	ngx_uint_t         overflow;        /* Whether the processed image doesn't fit into the buffer */
+} ngx_http_jpeg_filter_transcoder_t;
+
+#if (NGX_THREADS)
+/* A band of restart intervals of the image that is transcoded by a task of its own */
+typedef struct {
+	ngx_http_jpeg_filter_transcoder_t  t;
+	ngx_uint_t         first;           /* First restart interval of the band */
+	ngx_uint_t         mcus;            /* Number of MCUs in the band */
+	u_char            *in;              /* Entropy coded data of the first interval */
+	u_char            *out;             /* The transcoded band */
+	ngx_int_t          rc;              /* Result of transcoding the band */
+	ngx_thread_task_t *task;
+} ngx_http_jpeg_filter_band_t;
+#endif
+
+typedef struct {
+	size_t		dropon_cache_size;  /* Max. memory for cached dynamic dropons per worker, 0 to disable */
+
+	size_t		arena_size;         /* Max. memory for kept image buffers per worker, 0 to disable */
+	ngx_flag_t	arena_hugepages;    /* Whether the image buffers are backed by transparent huge pages */
+
+	ngx_shm_zone_t *limit_zone;         /* Shared memory zone for jpeg_filter_limit, NULL if disabled */
+	ngx_uint_t	limit_concurrent;   /* Max. number of admitted requests, 0 for unlimited */
+	size_t		limit_memory;       /* Max. estimated memory of the admitted requests, 0 for unlimited */
+	ngx_msec_t	limit_queue;        /* How long a request may wait for admission, 0 to not wait */
+
+	ngx_flag_t	status;             /* Whether metrics are collected, i.e. jpeg_filter_status is used somewhere */
+	ngx_array_t	locations;          /* Locations with the jpeg filter enabled, in the order of their metrics */
+	ngx_shm_zone_t *status_zone;        /* Shared memory zone for the metrics, NULL if not collected */
+
+#if (NGX_HTTP_CACHE)
+	ngx_array_t	caches;             /* The caches from jpeg_filter_cache_path (ngx_http_file_cache_t *) */
+#endif
+} ngx_http_jpeg_filter_main_conf_t;
+
 typedef struct {
 	ngx_uint_t	max_pixel;          /* Max. allowed pixel in image */
+	ngx_msec_t	time_budget;        /* Max. time for processing an image, 0 for unlimited */
+	size_t		max_memory;         /* Max. estimated memory for processing an image, 0 for unlimited */
 
 	ngx_flag_t	enable;             /* Whether the module is enabled */
-	ngx_flag_t	optimize;           /* Whether to optimize the Huffman tables in the resulting JPEG */
-	ngx_flag_t	progressive;        /* Whether the resulting JPEG should stored in progressive mode */
+	ngx_uint_t	optimize;           /* Whether to optimize the Huffman tables in the resulting JPEG, or NGX_HTTP_JPEG_FILTER_AUTO */
+	ngx_uint_t	progressive;        /* Whether the resulting JPEG should stored in progressive mode, or NGX_HTTP_JPEG_FILTER_AUTO */
 	ngx_flag_t      arithmetric;        /* Whether to use arithmetric coding in the resulting JPEG */
+	ngx_flag_t      transcode;          /* Whether to transcode the image if the processing chain allows it */
 	ngx_flag_t 	graceful;           /* Whether the unmodified image should be sent if processing fails */
 
+	ngx_uint_t	auto_pixel;         /* Min. pixel of an image for the automatic codings */
+	size_t		auto_size;          /* Min. size of an image for the automatic codings */
+	size_t		auto_gain;          /* Min. bytes saved per millisecond of encoding for an automatic coding to pay off */
+
 	ngx_array_t    *filter_elements;    /* Processing chain */
+	ngx_uint_t      variables;          /* Whether any element of the processing chain has to be resolved for each request */
+	ngx_http_jpeg_filter_op_t *ops;     /* Processing chain resolved at configuration time */
 
 	size_t		buffer_size;        /* Max. allowed size of the body */
+
+#if (NGX_THREADS)
+	ngx_thread_pool_t  *thread_pool;    /* Thread pool for processing the image, NULL if processed in the worker */
+#endif
+	ngx_int_t	bands;              /* Number of bands an image is split into for transcoding it with the thread pool */
+
+	ngx_array_t               *bypass;       /* Conditions for passing on the response untouched, NULL if not set */
+
+	ngx_uint_t                 metrics;      /* Index of the metrics and the cost model of this location */
+
+	ngx_shm_zone_t            *cache_zone;   /* Shared memory zone for caching processed images, NULL if disabled */
+	ngx_http_complex_value_t  *cache_key;    /* Key for the cache, NULL for the URI of the request */
+	time_t                     cache_valid;  /* How long a processed image is cached */
+
+#if (NGX_HTTP_CACHE)
+	ngx_shm_zone_t            *store_zone;   /* Zone of the cache on disk for processed images, NULL if disabled */
+	ngx_http_complex_value_t  *store_key;    /* Key for the cache on disk, NULL for the URI of the request */
+	time_t                     store_valid;  /* How long a processed image is cached on disk */
+#endif
 } ngx_http_jpeg_filter_conf_t;
 
 typedef struct {
 	u_char		*in_image;          /* Holds the original image */
 	u_char		*in_last;           /* Pointer to the end of in_image */
+	u_char		*in_end;            /* Pointer to the end of the memory allocated for in_image */
+	ngx_uint_t	in_borrowed;        /* Whether in_image is the buffer of the body itself, i.e. not allocated by us */
 
 	u_char		*out_image;         /* Holds the final processed image */
 	u_char 		*out_last;          /* Pointer to the end of out_image */
+	u_char		*out_buffer;        /* Buffer from the pool offered to the encoder for the processed image */
+	size_t		out_size;           /* Size of out_buffer */
 
-	size_t		length;             /* Size of the original image */
+	size_t		length;             /* Size of the original image as announced by the Content-Length header, 0 if unknown */
 
 	ngx_uint_t	width;              /* Width of the original image */
 	ngx_uint_t	height;             /* Height of the original image */
+	ngx_uint_t	components;         /* Number of color components of the original image */
+	ngx_uint_t	progressive;        /* Whether the original image is progressive */
+	ngx_uint_t	arithmetic;         /* Whether the original image is arithmetic coded */
+	size_t		samples;            /* Number of samples of all components of the original image */
+	ngx_uint_t	over_budget;        /* Time in microseconds after which processing was aborted because of the time budget, 0 if not */
+	ngx_uint_t	aborted;            /* Whether processing was aborted because the client is gone */
+	ngx_uint_t	gone;               /* Whether the client is gone. Set by the worker, only read by a thread */
+	ngx_uint_t	frame;              /* Whether the frame header (SOFn) of the original image has been found */
+	size_t		scan_offset;        /* Offset in in_image of the next marker to scan */
 
 	ngx_uint_t	phase;              /* The current phase the module is in */
 	ngx_uint_t      skip;               /* Skip the processing of the body */
+
+	ngx_http_jpeg_filter_conf_t   *conf;    /* Configuration of the location that processes the image */
+	ngx_http_jpeg_filter_value_t  *values;  /* Evaluated complex values of the processing chain, NULL if there are no variables */
+	ngx_http_jpeg_filter_op_t     *ops;     /* Processing chain resolved for this request, NULL if there are no variables */
+	ngx_log_t                     *log;     /* Log for processing the image */
+
+	ngx_int_t	rc;                 /* Result of processing the image */
+
+	int		options;            /* Options for encoding the processed image */
+	int		probe;              /* Option that is probed by encoding the image without it as well, 0 if none */
+	ngx_int_t	probe_saved;        /* Bytes saved by the probed option */
+	ngx_int_t	probe_usec;         /* Additional time for encoding with the probed option in microseconds */
+	ngx_uint_t	probed;             /* Whether the probe has been done */
+	ngx_uint_t	coded;              /* Whether the options have been chosen */
+
+	ngx_http_jpeg_filter_transcoder_t  *transcoder;  /* State for transcoding the image, NULL if it is decoded by libmodjpeg */
+	ngx_uint_t	transcoded;         /* Whether the image has been transcoded */
+
+	ngx_str_t	etag;               /* ETag of the processed image, empty if the original image has no validators */
+	ngx_uint_t	etag_weak;          /* Whether the ETag is weak */
+
+	ngx_http_jpeg_filter_metrics_t  *metrics;  /* Metrics of the location, NULL if not collected */
+	ngx_msec_t	read_start;         /* Time when the first data of the original image arrived */
+	size_t		buffered;           /* Memory for buffering the original image as accounted in the metrics */
+
+	ngx_uint_t	result;             /* Result of the response, valid if result_set is set */
+	ngx_uint_t	result_set;         /* Whether the result of the response is known */
+	size_t		in_bytes;           /* Size of the buffered original image, 0 if unknown */
+	size_t		out_bytes;          /* Size of the processed image, 0 if unknown */
+	size_t		pixels;             /* Pixel of the processed image, 0 if unknown */
+	ngx_uint_t	usec[NGX_HTTP_JPEG_FILTER_STAGES];  /* Time spent in the stages in microseconds */
+	ngx_uint_t	timed;              /* Bit mask of the stages in usec that have been timed */
+
+	ngx_http_jpeg_filter_limit_t  *limit;   /* Resources in use for jpeg_filter_limit, NULL if disabled */
+	ngx_uint_t	limit_state;        /* State of the admission of this request */
+	size_t		limit_memory;       /* Memory that has been reserved for this request */
+	ngx_msec_t	limit_start;        /* Time when the request has been queued */
+	ngx_msec_t	limit_retry;        /* Time until the next try to get admitted */
+	ngx_queue_t	limit_queue;        /* Queued requests of this worker */
+	ngx_event_t	limit_event;        /* Timer for retrying the admission of a queued request */
+	ngx_chain_t    *limit_in;           /* Data that arrived while the request was queued */
+
+	u_char		cache_key[16];      /* MD5 of the cache key */
+	ngx_uint_t	cache_lookup;       /* Whether the image has been looked up in the cache */
+	ngx_uint_t	cache_hit;          /* Whether the processed image has been found in the cache */
+
+#if (NGX_HTTP_CACHE)
+	ngx_http_cache_t  *store;           /* Entry in the cache on disk, NULL if not looked up */
+	ngx_uint_t         store_state;     /* State of looking up the processed image in the cache on disk */
+#endif
+
+#if (NGX_THREADS)
+	ngx_thread_task_t  *task;           /* Task for processing the image in a thread pool */
+	ngx_uint_t          task_done;      /* Whether the task finished */
+
+	ngx_http_jpeg_filter_band_t  *bands;  /* Bands of the image that are transcoded in parallel, NULL if not split */
+	ngx_uint_t          nbands;         /* Number of bands */
+	ngx_uint_t          bands_pending;  /* Number of bands that are not done yet */
+	ngx_uint_t          bands_start;    /* Time when the image has been split in microseconds */
+#endif
 } ngx_http_jpeg_filter_ctx_t;
 
 /* The filter functions */
@@ -148,25 +595,194 @@ static ngx_int_t ngx_http_jpeg_body_filter(ngx_http_request_t *r, ngx_chain_t *i
 
 /* Helper for the filter functions */
 static ngx_int_t ngx_http_jpeg_filter_send(ngx_http_request_t *r, ngx_uint_t image);
-static ngx_uint_t ngx_http_jpeg_filter_test(ngx_http_request_t *r, ngx_chain_t *in);
+static ngx_uint_t ngx_http_jpeg_filter_test(ngx_http_request_t *r, ngx_http_jpeg_filter_ctx_t *ctx, ngx_chain_t *in);
+static ngx_int_t ngx_http_jpeg_filter_scan(ngx_http_jpeg_filter_ctx_t *ctx);
+static ngx_int_t ngx_http_jpeg_filter_reject(ngx_http_request_t *r, ngx_http_jpeg_filter_ctx_t *ctx, ngx_chain_t *in, ngx_uint_t last);
+static ngx_uint_t ngx_http_jpeg_filter_gone(ngx_http_request_t *r);
+static ngx_int_t ngx_http_jpeg_filter_watch(ngx_http_request_t *r);
+static void ngx_http_jpeg_filter_read_event_handler(ngx_http_request_t *r);
+static ngx_uint_t ngx_http_jpeg_filter_abandoned(ngx_http_jpeg_filter_ctx_t *ctx, const char *what);
+static ngx_int_t ngx_http_jpeg_filter_abort(ngx_http_request_t *r, ngx_http_jpeg_filter_ctx_t *ctx, ngx_chain_t *in, const char *what);
+static ngx_int_t ngx_http_jpeg_filter_borrow(ngx_http_request_t *r, ngx_http_jpeg_filter_ctx_t *ctx, ngx_chain_t *in);
 static ngx_int_t ngx_http_jpeg_filter_read(ngx_http_request_t *r, ngx_chain_t *in);
+static ngx_int_t ngx_http_jpeg_filter_grow(ngx_http_request_t *r, ngx_http_jpeg_filter_ctx_t *ctx, size_t len);
+static void ngx_http_jpeg_filter_discard(ngx_chain_t *in);
 static ngx_int_t ngx_http_jpeg_filter_process(ngx_http_request_t *r);
+static ngx_int_t ngx_http_jpeg_filter_finish(ngx_http_request_t *r, ngx_int_t rc);
+static ngx_int_t ngx_http_jpeg_filter_resolve(ngx_http_request_t *r, ngx_http_jpeg_filter_ctx_t *ctx);
+static ngx_uint_t ngx_http_jpeg_filter_noop(ngx_http_jpeg_filter_ctx_t *ctx);
+static ngx_int_t ngx_http_jpeg_filter_compile(ngx_uint_t type, ngx_str_t *val1, ngx_str_t *val2, ngx_http_jpeg_filter_op_t *op, ngx_str_t **invalid);
+static ngx_int_t ngx_http_jpeg_filter_transform(ngx_http_jpeg_filter_ctx_t *ctx);
 static void ngx_http_jpeg_filter_cleanup(void *data);
 
+/* Helper for conditional and range requests */
+static ngx_int_t ngx_http_jpeg_filter_etag(ngx_http_request_t *r, ngx_http_jpeg_filter_ctx_t *ctx);
+static ngx_uint_t ngx_http_jpeg_filter_etag_match(ngx_str_t *list, ngx_str_t *etag, ngx_uint_t weak);
+static ngx_int_t ngx_http_jpeg_filter_set_etag(ngx_http_request_t *r, ngx_http_jpeg_filter_ctx_t *ctx);
+static ngx_int_t ngx_http_jpeg_filter_precondition(ngx_http_request_t *r, ngx_http_jpeg_filter_ctx_t *ctx, ngx_uint_t image);
+static ngx_table_elt_t *ngx_http_jpeg_filter_hidden(ngx_http_request_t *r, u_char *name, size_t len);
+static ngx_int_t ngx_http_jpeg_filter_precondition_handler(ngx_http_request_t *r);
+static ngx_int_t ngx_http_jpeg_filter_range(ngx_http_request_t *r, ngx_http_jpeg_filter_ctx_t *ctx, ngx_buf_t *b);
+
+/* Helper for the metrics */
+static ngx_http_jpeg_filter_metrics_t *ngx_http_jpeg_filter_get_metrics(ngx_http_request_t *r, ngx_http_jpeg_filter_conf_t *conf);
+static void ngx_http_jpeg_filter_count(ngx_http_jpeg_filter_ctx_t *ctx, ngx_uint_t result);
+static void ngx_http_jpeg_filter_observe(ngx_http_jpeg_filter_ctx_t *ctx, ngx_uint_t stage, ngx_uint_t usec);
+static ngx_uint_t ngx_http_jpeg_filter_usec(void);
+
+/* Helper for jpeg_filter_time_budget */
+static ngx_uint_t ngx_http_jpeg_filter_estimate(ngx_http_jpeg_filter_ctx_t *ctx);
+static void ngx_http_jpeg_filter_learn(ngx_http_jpeg_filter_ctx_t *ctx, ngx_uint_t usec);
+static ngx_uint_t ngx_http_jpeg_filter_over_budget(ngx_http_jpeg_filter_ctx_t *ctx, ngx_uint_t start, const char *what);
+
+/* Helper for jpeg_filter_max_memory */
+static size_t ngx_http_jpeg_filter_memory(ngx_http_jpeg_filter_ctx_t *ctx, ngx_uint_t decode);
+
+/* Helper for the automatic codings */
+static void ngx_http_jpeg_filter_coding(ngx_http_jpeg_filter_ctx_t *ctx);
+static void ngx_http_jpeg_filter_payoff(ngx_http_jpeg_filter_ctx_t *ctx);
+static void ngx_http_jpeg_filter_unbuffer(void *data);
+
+/* Helper for jpeg_filter_transcode */
+static ngx_int_t ngx_http_jpeg_filter_transcodable(ngx_http_request_t *r, ngx_http_jpeg_filter_ctx_t *ctx);
+static ngx_int_t ngx_http_jpeg_filter_transcode(ngx_http_jpeg_filter_ctx_t *ctx);
+static ngx_int_t ngx_http_jpeg_filter_transcode_dht(ngx_http_jpeg_filter_transcoder_t *t, u_char *p, size_t len);
+static ngx_int_t ngx_http_jpeg_filter_transcode_sof(ngx_http_jpeg_filter_transcoder_t *t, u_char *p, size_t len);
+static ngx_int_t ngx_http_jpeg_filter_transcode_dqt(ngx_http_jpeg_filter_transcoder_t *t, u_char *p, size_t len);
+static ngx_int_t ngx_http_jpeg_filter_transcode_shift(ngx_http_jpeg_filter_transcoder_t *t);
+static ngx_int_t ngx_http_jpeg_filter_transcode_segments(ngx_http_jpeg_filter_transcoder_t *t);
+static ngx_int_t ngx_http_jpeg_filter_transcode_sos(ngx_http_jpeg_filter_transcoder_t *t, u_char *p, size_t len);
+static ngx_int_t ngx_http_jpeg_filter_transcode_mcus(ngx_http_jpeg_filter_transcoder_t *t, ngx_uint_t rst, ngx_uint_t mcus);
+static ngx_int_t ngx_http_jpeg_filter_transcode_block(ngx_http_jpeg_filter_transcoder_t *t, ngx_http_jpeg_filter_huffman_t *dc, ngx_http_jpeg_filter_huffman_t *ac, ngx_int_t shift, ngx_int_t *pred, ngx_int_t *npred);
+static ngx_int_t ngx_http_jpeg_filter_transcode_restart(ngx_http_jpeg_filter_transcoder_t *t, ngx_uint_t n);
+static u_char *ngx_http_jpeg_filter_transcode_marker(u_char *p, u_char *last);
+static void ngx_http_jpeg_filter_transcode_fill(ngx_http_jpeg_filter_transcoder_t *t);
+static ngx_int_t ngx_http_jpeg_filter_transcode_decode(ngx_http_jpeg_filter_transcoder_t *t, ngx_http_jpeg_filter_huffman_t *h);
+static ngx_uint_t ngx_http_jpeg_filter_transcode_receive(ngx_http_jpeg_filter_transcoder_t *t, ngx_uint_t n);
+static void ngx_http_jpeg_filter_transcode_put(ngx_http_jpeg_filter_transcoder_t *t, ngx_uint_t bits, ngx_uint_t n);
+static void ngx_http_jpeg_filter_transcode_flush(ngx_http_jpeg_filter_transcoder_t *t);
+static void ngx_http_jpeg_filter_transcode_copy(ngx_http_jpeg_filter_transcoder_t *t, u_char *p, size_t len);
+
+static ngx_int_t ngx_http_jpeg_filter_status_handler(ngx_http_request_t *r);
+static u_char *ngx_http_jpeg_filter_status_escape(u_char *p, ngx_str_t *value);
+static ngx_int_t ngx_http_jpeg_filter_status_init_zone(ngx_shm_zone_t *shm_zone, void *data);
+
+/* Variables */
+static ngx_int_t ngx_http_jpeg_filter_add_variables(ngx_conf_t *cf);
+static ngx_int_t ngx_http_jpeg_filter_result_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_jpeg_filter_size_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_jpeg_filter_msec_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data);
+
+/* Helper for jpeg_filter_limit */
+static ngx_int_t ngx_http_jpeg_filter_admit(ngx_http_request_t *r, ngx_http_jpeg_filter_ctx_t *ctx);
+static ngx_int_t ngx_http_jpeg_filter_reserve(ngx_http_jpeg_filter_ctx_t *ctx, ngx_uint_t concurrent, size_t memory);
+static void ngx_http_jpeg_filter_limit_handler(ngx_event_t *ev);
+static ngx_int_t ngx_http_jpeg_filter_shed(ngx_http_request_t *r, ngx_http_jpeg_filter_ctx_t *ctx, ngx_chain_t *in);
+static void ngx_http_jpeg_filter_release(void *data);
+static ngx_int_t ngx_http_jpeg_filter_limit_init_zone(ngx_shm_zone_t *shm_zone, void *data);
+
+/* Helper for the cache for processed images */
+static ngx_int_t ngx_http_jpeg_filter_cache_key(ngx_http_request_t *r, ngx_http_jpeg_filter_ctx_t *ctx);
+static void ngx_http_jpeg_filter_hash(ngx_http_request_t *r, ngx_http_jpeg_filter_ctx_t *ctx, ngx_md5_t *md5);
+static ngx_int_t ngx_http_jpeg_filter_cache_lookup(ngx_http_request_t *r, ngx_http_jpeg_filter_ctx_t *ctx);
+static void ngx_http_jpeg_filter_cache_store(ngx_http_request_t *r, ngx_http_jpeg_filter_ctx_t *ctx);
+static ngx_http_jpeg_filter_cache_node_t *ngx_http_jpeg_filter_cache_find(ngx_http_jpeg_filter_cache_t *cache, u_char *key);
+static ngx_rbtree_node_t *ngx_http_jpeg_filter_cache_rbtree_lookup(ngx_rbtree_t *rbtree, u_char *key);
+static void ngx_http_jpeg_filter_cache_rbtree_insert_value(ngx_rbtree_node_t *temp, ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+static ngx_int_t ngx_http_jpeg_filter_cache_init_zone(ngx_shm_zone_t *shm_zone, void *data);
+
+#if (NGX_HTTP_CACHE)
+/* Helper for the cache on disk */
+static ngx_int_t ngx_http_jpeg_filter_store_lookup(ngx_http_request_t *r, ngx_http_jpeg_filter_ctx_t *ctx);
+static void ngx_http_jpeg_filter_store_update(ngx_http_request_t *r, ngx_http_jpeg_filter_ctx_t *ctx);
+static ngx_int_t ngx_http_jpeg_filter_store_check(ngx_conf_t *cf, ngx_shm_zone_t *zone, ngx_uint_t file_cache);
+static void ngx_http_jpeg_filter_store_cleanup(void *data);
+#endif
+
+/* Helper for loading and caching dynamic dropons */
+static ngx_int_t ngx_http_jpeg_filter_dropon_load(mj_dropon_t *d, ngx_uint_t type, ngx_str_t *val1, ngx_str_t *val2, ngx_log_t *log);
+static ngx_int_t ngx_http_jpeg_filter_dropon_cache_key(u_char *key, ngx_uint_t type, ngx_str_t *val1, ngx_str_t *val2, ngx_log_t *log);
+static ngx_http_jpeg_filter_dropon_node_t *ngx_http_jpeg_filter_dropon_cache_get(ngx_uint_t type, ngx_str_t *val1, ngx_str_t *val2, ngx_log_t *log);
+static void ngx_http_jpeg_filter_dropon_cache_release(ngx_http_jpeg_filter_dropon_node_t *dn, ngx_log_t *log);
+static void ngx_http_jpeg_filter_dropon_cache_lock(ngx_log_t *log);
+static void ngx_http_jpeg_filter_dropon_cache_unlock(ngx_log_t *log);
+
+/* Helper for the image buffers of a worker */
+static void *ngx_http_jpeg_filter_arena_alloc(ngx_http_request_t *r, size_t size);
+static void ngx_http_jpeg_filter_arena_free(ngx_http_request_t *r, void *p);
+static void ngx_http_jpeg_filter_arena_release(void *data);
+static void ngx_http_jpeg_filter_arena_unmap(ngx_http_jpeg_filter_block_t *block, ngx_log_t *log);
+
+#if (NGX_THREADS)
+/* Helper for processing the image in a thread pool */
+static ngx_int_t ngx_http_jpeg_filter_thread_post(ngx_http_request_t *r, ngx_http_jpeg_filter_ctx_t *ctx);
+static void ngx_http_jpeg_filter_thread_handler(void *data, ngx_log_t *log);
+static void ngx_http_jpeg_filter_thread_event_handler(ngx_event_t *ev);
+static ngx_int_t ngx_http_jpeg_filter_thread_split(ngx_http_request_t *r, ngx_http_jpeg_filter_ctx_t *ctx);
+static void ngx_http_jpeg_filter_band_handler(void *data, ngx_log_t *log);
+static void ngx_http_jpeg_filter_band_event_handler(ngx_event_t *ev);
+static ngx_int_t ngx_http_jpeg_filter_band_join(ngx_http_jpeg_filter_ctx_t *ctx);
+#endif
+
 /* Handling the configuration directives for the effects and dropon */
 static char *ngx_conf_jpeg_filter_effect(ngx_conf_t *cf, ngx_command_t *cmd, void *c);
 static char *ngx_conf_jpeg_filter_dropon(ngx_conf_t *cf, ngx_command_t *cmd, void *c);
+static char *ngx_conf_jpeg_filter_compile(ngx_conf_t *cf, ngx_http_jpeg_filter_conf_t *conf, ngx_http_jpeg_filter_element_t *fe);
+
+/* Handling the configuration directive for the thread pool */
+static char *ngx_conf_jpeg_filter_thread_pool(ngx_conf_t *cf, ngx_command_t *cmd, void *c);
+
+/* Handling the configuration directive for the cache */
+static char *ngx_conf_jpeg_filter_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *c);
+
+#if (NGX_HTTP_CACHE)
+/* Handling the configuration directive for the cache on disk */
+static char *ngx_conf_jpeg_filter_store(ngx_conf_t *cf, ngx_command_t *cmd, void *c);
+#endif
+
+/* Handling the configuration directive for the arena */
+static char *ngx_conf_jpeg_filter_arena(ngx_conf_t *cf, ngx_command_t *cmd, void *c);
+
+/* Handling the configuration directive for the status */
+static char *ngx_conf_jpeg_filter_status(ngx_conf_t *cf, ngx_command_t *cmd, void *c);
+
+/* Handling the configuration directive for the limits */
+static char *ngx_conf_jpeg_filter_limit(ngx_conf_t *cf, ngx_command_t *cmd, void *c);
+
+/* Handling the configuration directive for the automatic codings */
+static char *ngx_conf_jpeg_filter_auto(ngx_conf_t *cf, ngx_command_t *cmd, void *c);
 
 /* Configuration functions */
+static void *ngx_http_jpeg_filter_create_main_conf(ngx_conf_t *cf);
+static char *ngx_http_jpeg_filter_init_main_conf(ngx_conf_t *cf, void *c);
 static void *ngx_http_jpeg_filter_create_conf(ngx_conf_t *cf);
 static char *ngx_http_jpeg_filter_merge_conf(ngx_conf_t *cf, void *parent, void *child);
 static ngx_int_t ngx_http_jpeg_filter_init(ngx_conf_t *cf);
+static ngx_int_t ngx_http_jpeg_filter_init_process(ngx_cycle_t *cycle);
+static void ngx_http_jpeg_filter_exit_process(ngx_cycle_t *cycle);
 static void ngx_http_jpeg_filter_conf_cleanup(void *data);
 
 /* Helper functions for complex values */
-static ngx_int_t ngx_http_jpeg_filter_get_int_value(ngx_http_request_t *r, ngx_http_complex_value_t *cv, ngx_int_t defval);
+static ngx_int_t ngx_http_jpeg_filter_get_int_value(ngx_str_t *val, ngx_int_t defval);
+static ngx_uint_t ngx_http_jpeg_filter_is_int_value(ngx_str_t *val);
 static ngx_int_t ngx_http_jpeg_filter_get_string_value(ngx_http_request_t *r, ngx_http_complex_value_t *cv, ngx_str_t *val);
 
+/* The module is the tag of the zones of jpeg_filter_cache_path */
+extern ngx_module_t  ngx_http_jpeg_filter_module;
+
+/* Values of jpeg_filter_optimize and jpeg_filter_progressive */
+static ngx_conf_enum_t ngx_http_jpeg_filter_codings[] = {
+	{ ngx_string("off"), 0 },
+	{ ngx_string("on"), 1 },
+	{ ngx_string("auto"), NGX_HTTP_JPEG_FILTER_AUTO },
+	{ ngx_null_string, 0 }
+};
+
+/* Bounds of jpeg_filter_bands */
+static ngx_conf_num_bounds_t ngx_http_jpeg_filter_bands_bounds = {
+	ngx_conf_check_num_bounds, 1, 64
+};
+
 /* Configuration directives */
 static ngx_command_t ngx_http_jpeg_filter_commands[] = {
 	{ ngx_string("jpeg_filter"),
@@ -183,18 +799,39 @@ static ngx_command_t ngx_http_jpeg_filter_commands[] = {
 	  offsetof(ngx_http_jpeg_filter_conf_t, max_pixel),
 	  NULL },
 
+	{ ngx_string("jpeg_filter_time_budget"),
+	  NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+	  ngx_conf_set_msec_slot,
+	  NGX_HTTP_LOC_CONF_OFFSET,
+	  offsetof(ngx_http_jpeg_filter_conf_t, time_budget),
+	  NULL },
+
+	{ ngx_string("jpeg_filter_max_memory"),
+	  NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+	  ngx_conf_set_size_slot,
+	  NGX_HTTP_LOC_CONF_OFFSET,
+	  offsetof(ngx_http_jpeg_filter_conf_t, max_memory),
+	  NULL },
+
 	{ ngx_string("jpeg_filter_optimize"),
-	  NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
-	  ngx_conf_set_flag_slot,
+	  NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+	  ngx_conf_set_enum_slot,
 	  NGX_HTTP_LOC_CONF_OFFSET,
 	  offsetof(ngx_http_jpeg_filter_conf_t, optimize),
-	  NULL },
+	  &ngx_http_jpeg_filter_codings },
 
 	{ ngx_string("jpeg_filter_progressive"),
-	  NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
-	  ngx_conf_set_flag_slot,
+	  NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+	  ngx_conf_set_enum_slot,
 	  NGX_HTTP_LOC_CONF_OFFSET,
 	  offsetof(ngx_http_jpeg_filter_conf_t, progressive),
+	  &ngx_http_jpeg_filter_codings },
+
+	{ ngx_string("jpeg_filter_auto"),
+	  NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE123,
+	  ngx_conf_jpeg_filter_auto,
+	  NGX_HTTP_LOC_CONF_OFFSET,
+	  0,
 	  NULL },
 
 	{ ngx_string("jpeg_filter_arithmetric"),
@@ -204,6 +841,13 @@ static ngx_command_t ngx_http_jpeg_filter_commands[] = {
 	  offsetof(ngx_http_jpeg_filter_conf_t, arithmetric),
 	  NULL },
 
+	{ ngx_string("jpeg_filter_transcode"),
+	  NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+	  ngx_conf_set_flag_slot,
+	  NGX_HTTP_LOC_CONF_OFFSET,
+	  offsetof(ngx_http_jpeg_filter_conf_t, transcode),
+	  NULL },
+
 	{ ngx_string("jpeg_filter_graceful"),
 	  NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
 	  ngx_conf_set_flag_slot,
@@ -218,6 +862,78 @@ static ngx_command_t ngx_http_jpeg_filter_commands[] = {
 	  offsetof(ngx_http_jpeg_filter_conf_t, buffer_size),
 	  NULL },
 
+	{ ngx_string("jpeg_filter_thread_pool"),
+	  NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+	  ngx_conf_jpeg_filter_thread_pool,
+	  NGX_HTTP_LOC_CONF_OFFSET,
+	  0,
+	  NULL },
+
+	{ ngx_string("jpeg_filter_bands"),
+	  NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+	  ngx_conf_set_num_slot,
+	  NGX_HTTP_LOC_CONF_OFFSET,
+	  offsetof(ngx_http_jpeg_filter_conf_t, bands),
+	  &ngx_http_jpeg_filter_bands_bounds },
+
+	{ ngx_string("jpeg_filter_cache"),
+	  NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE123,
+	  ngx_conf_jpeg_filter_cache,
+	  NGX_HTTP_LOC_CONF_OFFSET,
+	  0,
+	  NULL },
+
+	{ ngx_string("jpeg_filter_dropon_cache"),
+	  NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+	  ngx_conf_set_size_slot,
+	  NGX_HTTP_MAIN_CONF_OFFSET,
+	  offsetof(ngx_http_jpeg_filter_main_conf_t, dropon_cache_size),
+	  NULL },
+
+	{ ngx_string("jpeg_filter_arena"),
+	  NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE12,
+	  ngx_conf_jpeg_filter_arena,
+	  NGX_HTTP_MAIN_CONF_OFFSET,
+	  0,
+	  NULL },
+
+#if (NGX_HTTP_CACHE)
+	{ ngx_string("jpeg_filter_cache_path"),
+	  NGX_HTTP_MAIN_CONF|NGX_CONF_2MORE,
+	  ngx_http_file_cache_set_slot,
+	  NGX_HTTP_MAIN_CONF_OFFSET,
+	  offsetof(ngx_http_jpeg_filter_main_conf_t, caches),
+	  &ngx_http_jpeg_filter_module },
+
+	{ ngx_string("jpeg_filter_store"),
+	  NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE123,
+	  ngx_conf_jpeg_filter_store,
+	  NGX_HTTP_LOC_CONF_OFFSET,
+	  0,
+	  NULL },
+#endif
+
+	{ ngx_string("jpeg_filter_limit"),
+	  NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE123,
+	  ngx_conf_jpeg_filter_limit,
+	  NGX_HTTP_MAIN_CONF_OFFSET,
+	  0,
+	  NULL },
+
+	{ ngx_string("jpeg_filter_bypass"),
+	  NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
+	  ngx_http_set_predicate_slot,
+	  NGX_HTTP_LOC_CONF_OFFSET,
+	  offsetof(ngx_http_jpeg_filter_conf_t, bypass),
+	  NULL },
+
+	{ ngx_string("jpeg_filter_status"),
+	  NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+	  ngx_conf_jpeg_filter_status,
+	  NGX_HTTP_LOC_CONF_OFFSET,
+	  0,
+	  NULL },
+
 	{ ngx_string("jpeg_filter_effect"),
 	  NGX_HTTP_LOC_CONF|NGX_CONF_TAKE12,
 	  ngx_conf_jpeg_filter_effect,
@@ -257,11 +973,11 @@ static ngx_command_t ngx_http_jpeg_filter_commands[] = {
 };
 
 static ngx_http_module_t ngx_http_jpeg_filter_module_ctx = {
-    NULL,                                  /* preconfiguration */
+    ngx_http_jpeg_filter_add_variables,    /* preconfiguration */
     ngx_http_jpeg_filter_init,             /* postconfiguration */
 
-    NULL,                                  /* create main configuration */
-    NULL,                                  /* init main configuration */
+    ngx_http_jpeg_filter_create_main_conf, /* create main configuration */
+    ngx_http_jpeg_filter_init_main_conf,   /* init main configuration */
 
     NULL,                                  /* create server configuration */
     NULL,                                  /* merge server configuration */
@@ -277,20 +993,96 @@ ngx_module_t  ngx_http_jpeg_filter_module = {
 	NGX_HTTP_MODULE,                   /* module type */
 	NULL,                              /* init master */
 	NULL,                              /* init module */
-	NULL,                              /* init process */
+	ngx_http_jpeg_filter_init_process, /* init process */
 	NULL,                              /* init thread */
 	NULL,                              /* exit thread */
-	NULL,                              /* exit process */
+	ngx_http_jpeg_filter_exit_process, /* exit process */
 	NULL,                              /* exit master */
 	NGX_MODULE_V1_PADDING
 };
 
+static ngx_http_variable_t ngx_http_jpeg_filter_vars[] = {
+	{ ngx_string("jpeg_filter_status"), NULL,
+	  ngx_http_jpeg_filter_result_variable, 0,
+	  NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+	{ ngx_string("jpeg_filter_in_bytes"), NULL,
+	  ngx_http_jpeg_filter_size_variable, offsetof(ngx_http_jpeg_filter_ctx_t, in_bytes),
+	  NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+	{ ngx_string("jpeg_filter_out_bytes"), NULL,
+	  ngx_http_jpeg_filter_size_variable, offsetof(ngx_http_jpeg_filter_ctx_t, out_bytes),
+	  NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+	{ ngx_string("jpeg_filter_pixels"), NULL,
+	  ngx_http_jpeg_filter_size_variable, offsetof(ngx_http_jpeg_filter_ctx_t, pixels),
+	  NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+	{ ngx_string("jpeg_filter_buffered_ms"), NULL,
+	  ngx_http_jpeg_filter_msec_variable, NGX_HTTP_JPEG_FILTER_STAGE_READ,
+	  NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+	{ ngx_string("jpeg_filter_decode_ms"), NULL,
+	  ngx_http_jpeg_filter_msec_variable, NGX_HTTP_JPEG_FILTER_STAGE_DECODE,
+	  NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+	{ ngx_string("jpeg_filter_chain_ms"), NULL,
+	  ngx_http_jpeg_filter_msec_variable, NGX_HTTP_JPEG_FILTER_STAGE_CHAIN,
+	  NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+	{ ngx_string("jpeg_filter_encode_ms"), NULL,
+	  ngx_http_jpeg_filter_msec_variable, NGX_HTTP_JPEG_FILTER_STAGE_ENCODE,
+	  NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+	ngx_http_null_variable
+};
+
 static ngx_http_output_header_filter_pt  ngx_http_next_header_filter;
 static ngx_http_output_body_filter_pt    ngx_http_next_body_filter;
 
+/* The cache for dynamic dropons of this worker, NULL if disabled */
+static ngx_http_jpeg_filter_dropon_cache_t  *ngx_http_jpeg_filter_dropon_cache;
+
+/* The image buffers of this worker, NULL if disabled */
+static ngx_http_jpeg_filter_arena_t  *ngx_http_jpeg_filter_arena;
+
+/* Cost model of this worker, NGX_HTTP_JPEG_FILTER_COST_CLASSES per location in microseconds per million samples, 0 if not yet measured */
+static ngx_uint_t  *ngx_http_jpeg_filter_cost;
+
+/* Payoff of the automatic codings of this worker, NGX_HTTP_JPEG_FILTER_CODINGS per location */
+static ngx_http_jpeg_filter_coding_t  *ngx_http_jpeg_filter_codings_payoff;
+
+/* Requests of this worker that wait for jpeg_filter_limit */
+static ngx_queue_t  ngx_http_jpeg_filter_waiting;
+
+/* Number of images this worker dropped because the client has gone away */
+static ngx_uint_t  ngx_http_jpeg_filter_aborts;
+
+/* Names for the metrics */
+static char *ngx_http_jpeg_filter_result_names[NGX_HTTP_JPEG_FILTER_RESULTS] = {
+	"processed", "cached", "not_modified", "skipped", "graceful", "rejected", "limited", "aborted"
+};
+
+static char *ngx_http_jpeg_filter_stage_names[NGX_HTTP_JPEG_FILTER_STAGES] = {
+	"read", "decode", "chain", "encode"
+};
+
+static char *ngx_http_jpeg_filter_op_names[NGX_HTTP_JPEG_FILTER_OPS] = {
+	"none", "grayscale", "pixelate", "luminance", "tint", "align", "offset", "dropon", "dropon_dynamic"
+};
+
+/* Upper bounds of the buckets of the latency histograms in microseconds and as printed */
+static ngx_uint_t ngx_http_jpeg_filter_bucket_usec[NGX_HTTP_JPEG_FILTER_BUCKETS] = {
+	1000, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000, 5000000
+};
+
+static char *ngx_http_jpeg_filter_bucket_names[NGX_HTTP_JPEG_FILTER_BUCKETS + 1] = {
+	"0.001", "0.005", "0.01", "0.025", "0.05", "0.1", "0.25", "0.5", "1", "2.5", "5", "+Inf"
+};
+
 static ngx_int_t ngx_http_jpeg_header_filter(ngx_http_request_t *r) {
 	off_t                         len;
-	ngx_http_jpeg_filter_ctx_t   *ctx;
+	ngx_http_jpeg_filter_ctx_t   *ctx, *prev;
 	ngx_http_jpeg_filter_conf_t  *conf;
 
 	ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "jpeg_filter: ngx_http_jpeg_header_filter");
@@ -302,8 +1094,30 @@ static ngx_int_t ngx_http_jpeg_header_filter(ngx_http_request_t *r) {
 	/* Check if we already have a context for this request and our module */
 	ctx = ngx_http_get_module_ctx(r, ngx_http_jpeg_filter_module);
 	if(ctx) {
-		/* There is already a context for this filter? Remove it, next! */
-		ngx_http_set_ctx(r, NULL, ngx_http_jpeg_filter_module);
+		/*
+		 * There is already a context for this filter? Replace it, next! Only the result
+		 * is carried over for the variables that might be logged for this request.
+		 */
+		prev = ctx;
+
+		ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_jpeg_filter_ctx_t));
+		if(ctx == NULL) {
+			return NGX_ERROR;
+		}
+
+		ctx->result = prev->result;
+		ctx->result_set = prev->result_set;
+		ctx->in_bytes = prev->in_bytes;
+		ctx->out_bytes = prev->out_bytes;
+		ctx->pixels = prev->pixels;
+		ngx_memcpy(ctx->usec, prev->usec, sizeof(ctx->usec));
+		ctx->timed = prev->timed;
+
+		/* Leave the body of this response alone */
+		ctx->skip = 1;
+
+		ngx_http_set_ctx(r, ctx, ngx_http_jpeg_filter_module);
+
 		return ngx_http_next_header_filter(r);
 	}
 
@@ -337,6 +1151,50 @@ static ngx_int_t ngx_http_jpeg_header_filter(ngx_http_request_t *r) {
 	/* Associate our context struct with the request and module context */
 	ngx_http_set_ctx(r, ctx, ngx_http_jpeg_filter_module);
 
+	ctx->conf = conf;
+	ctx->log = r->connection->log;
+	ctx->metrics = ngx_http_jpeg_filter_get_metrics(r, conf);
+
+	/* The response should not be touched for this request. Next! */
+	if(conf->bypass != NULL) {
+		switch(ngx_http_test_predicates(r, conf->bypass)) {
+		case NGX_ERROR:
+			return NGX_ERROR;
+		case NGX_DECLINED:
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "jpeg_filter: bypassed");
+			ngx_http_jpeg_filter_count(ctx, NGX_HTTP_JPEG_FILTER_RESULT_SKIPPED);
+
+			if(ngx_http_jpeg_filter_precondition(r, ctx, NGX_HTTP_JPEG_FILTER_UNMODIFIED) != NGX_OK) {
+				return ngx_http_filter_finalize_request(r, NULL, NGX_HTTP_PRECONDITION_FAILED);
+			}
+
+			ctx->skip = 1;
+			return ngx_http_next_header_filter(r);
+		default:
+			break;
+		}
+	}
+
+	/*
+	 * Evaluate the processing chain already now. If it turns out that it wouldn't change
+	 * the image, the response can be passed on without buffering it.
+	 */
+	if(ngx_http_jpeg_filter_resolve(r, ctx) != NGX_OK) {
+		return NGX_ERROR;
+	}
+
+	if(ngx_http_jpeg_filter_noop(ctx) == 1) {
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "jpeg_filter: nothing to do");
+		ngx_http_jpeg_filter_count(ctx, NGX_HTTP_JPEG_FILTER_RESULT_SKIPPED);
+
+		if(ngx_http_jpeg_filter_precondition(r, ctx, NGX_HTTP_JPEG_FILTER_UNMODIFIED) != NGX_OK) {
+			return ngx_http_filter_finalize_request(r, NULL, NGX_HTTP_PRECONDITION_FAILED);
+		}
+
+		ctx->skip = 1;
+		return ngx_http_next_header_filter(r);
+	}
+
 	/*
 	 * Check for the body length and if we support this. We need to buffer
 	 * the whole body and we have an upper limit for how much memory we are
@@ -348,19 +1206,28 @@ static ngx_int_t ngx_http_jpeg_header_filter(ngx_http_request_t *r) {
 		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "jpeg_filter: too big response: %O", len);
 
 		if(conf->graceful == 1) {
+			ngx_http_jpeg_filter_count(ctx, NGX_HTTP_JPEG_FILTER_RESULT_GRACEFUL);
+
+			if(ngx_http_jpeg_filter_precondition(r, ctx, NGX_HTTP_JPEG_FILTER_UNMODIFIED) != NGX_OK) {
+				return ngx_http_filter_finalize_request(r, NULL, NGX_HTTP_PRECONDITION_FAILED);
+			}
+
 			ctx->skip = 1;
 			return ngx_http_next_header_filter(r);
 		}
 
+		ngx_http_jpeg_filter_count(ctx, NGX_HTTP_JPEG_FILTER_RESULT_REJECTED);
+
 		return NGX_HTTP_UNSUPPORTED_MEDIA_TYPE;
 	}
 
 	/*
 	 * In our context for this request, set the length of the body. We need this later
 	 * in the body filter to allocate the memory for the buffer that we're going to buffer.
+	 * If the length is not known, the buffer will grow with the body.
 	 */
 	if(len == -1) {
-		ctx->length = conf->buffer_size;
+		ctx->length = 0;
 	} else {
 		ctx->length = (size_t)len;
 	}
@@ -370,10 +1237,63 @@ static ngx_int_t ngx_http_jpeg_header_filter(ngx_http_request_t *r) {
 		r->headers_out.refresh->hash = 0;
 	}
 
-	/* Copied from image_filter. No clue what these are doing */
-	r->main_filter_need_in_memory = 1;
+	/* Ranges of the processed image are handled by ourselves when it is sent */
 	r->allow_ranges = 0;
 
+	if(r->headers_out.status == NGX_HTTP_OK) {
+		if(ngx_http_jpeg_filter_etag(r, ctx) != NGX_OK) {
+			return NGX_ERROR;
+		}
+
+		/* The client expects a different image */
+		if(ngx_http_jpeg_filter_precondition(r, ctx, NGX_HTTP_JPEG_FILTER_MODIFIED) != NGX_OK) {
+			return ngx_http_filter_finalize_request(r, NULL, NGX_HTTP_PRECONDITION_FAILED);
+		}
+
+		/* The client already has the processed image. Don't even look at the body */
+		if(
+			ctx->etag.len != 0 &&
+			r == r->main &&
+			!r->disable_not_modified &&
+			r->headers_in.if_none_match != NULL &&
+			ngx_http_jpeg_filter_etag_match(&r->headers_in.if_none_match->value, &ctx->etag, 1) == 1
+		) {
+			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "jpeg_filter: not modified %V", &ctx->etag);
+
+			if(ngx_http_jpeg_filter_set_etag(r, ctx) != NGX_OK) {
+				return NGX_ERROR;
+			}
+
+			r->headers_out.status = NGX_HTTP_NOT_MODIFIED;
+			r->headers_out.status_line.len = 0;
+			r->headers_out.content_type.len = 0;
+			ngx_http_clear_content_length(r);
+			ngx_http_clear_accept_ranges(r);
+			ngx_http_clear_last_modified(r);
+
+			ngx_http_jpeg_filter_count(ctx, NGX_HTTP_JPEG_FILTER_RESULT_NOT_MODIFIED);
+
+			ctx->skip = 1;
+			return ngx_http_next_header_filter(r);
+		}
+	}
+
+	/* Check if we already processed this image */
+	if(conf->cache_zone != NULL && r->headers_out.status == NGX_HTTP_OK) {
+		if(ngx_http_jpeg_filter_cache_lookup(r, ctx) == NGX_OK) {
+			/* We don't need the body, so there's no need to have it in memory */
+			return NGX_OK;
+		}
+	}
+
+	/*
+	 * Let the copy filter read files into memory, like image_filter does. It doesn't
+	 * block the worker if aio or a thread pool is configured for the location. The
+	 * chunks are copied into our buffer unless the file fits into one chunk, see
+	 * ngx_http_jpeg_filter_borrow().
+	 */
+	r->main_filter_need_in_memory = 1;
+
 	/*
 	 * Do not call the next header filter because we don't know yet
 	 * the length of the modified body or if we like the original body.
@@ -389,11 +1309,6 @@ static ngx_int_t ngx_http_jpeg_body_filter(ngx_http_request_t *r, ngx_chain_t *i
 	/* Now it's our turn */
 	ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "jpeg_filter: ngx_http_jpeg_body_filter");
 
-	/* Bail out to the next body filter if there's no data */
-	if(in == NULL) {
-		return ngx_http_next_body_filter(r, in);
-	}
-
 	/* Get the configuration for our filter */
 	conf = ngx_http_get_module_loc_conf(r, ngx_http_jpeg_filter_module);
 	if(conf->enable == 0) {
@@ -414,7 +1329,16 @@ static ngx_int_t ngx_http_jpeg_body_filter(ngx_http_request_t *r, ngx_chain_t *i
 	}
 
 	/*
-	 * Because the body data it most probably split into several chains and this
+	 * Bail out to the next body filter if there's no data. Except if we are waiting
+	 * for a thread to finish processing the image. Then we will be called without data
+	 * once the thread is done.
+	 */
+	if(in == NULL && ctx->phase != NGX_HTTP_JPEG_FILTER_PHASE_THREAD && ctx->phase != NGX_HTTP_JPEG_FILTER_PHASE_QUEUE) {
+		return ngx_http_next_body_filter(r, in);
+	}
+
+	/*
+	 * Because the body data it most probably split into several chains and this
 	 * function will be called more than once, we have to keep track in what "phase" we're in
 	 */
 	switch(ctx->phase) {
@@ -422,14 +1346,90 @@ static ngx_int_t ngx_http_jpeg_body_filter(ngx_http_request_t *r, ngx_chain_t *i
 		/* This is the first time we see some data for our filter */
 		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "jpeg_filter: phase START");
 
+		if(ctx->cache_hit == 1) {
+			/* The processed image is from the cache. Throw away the body and send the cached image */
+			ctx->phase = NGX_HTTP_JPEG_FILTER_PHASE_DISCARD;
+
+			ngx_http_jpeg_filter_discard(in);
+
+			ngx_http_jpeg_filter_count(ctx, NGX_HTTP_JPEG_FILTER_RESULT_CACHED);
+
+			return ngx_http_jpeg_filter_send(r, NGX_HTTP_JPEG_FILTER_MODIFIED);
+		}
+
+#if (NGX_HTTP_CACHE)
+		if(conf->store_zone != NULL && r->headers_out.status == NGX_HTTP_OK) {
+			switch(ngx_http_jpeg_filter_store_lookup(r, ctx)) {
+			case NGX_OK:
+				/* The processed image is in the cache on disk. Throw away the body and send the file */
+				ctx->phase = NGX_HTTP_JPEG_FILTER_PHASE_DISCARD;
+
+				ngx_http_jpeg_filter_discard(in);
+
+				ngx_http_jpeg_filter_count(ctx, NGX_HTTP_JPEG_FILTER_RESULT_CACHED);
+
+				return ngx_http_jpeg_filter_send(r, NGX_HTTP_JPEG_FILTER_STORED);
+			case NGX_AGAIN:
+				/* Hold back the data until the cache file has been read, same as in the queue */
+				ctx->phase = NGX_HTTP_JPEG_FILTER_PHASE_QUEUE;
+
+				if(ngx_chain_add_copy(r->pool, &ctx->limit_in, in) != NGX_OK) {
+					return ngx_http_filter_finalize_request(r, &ngx_http_jpeg_filter_module, NGX_HTTP_INTERNAL_SERVER_ERROR);
+				}
+
+				/*
+				 * Otherwise the request is finalized as if it was done and the write event of the
+				 * finished read finds nothing to do, i.e. the request is stuck and never freed.
+				 */
+				r->connection->buffered |= NGX_HTTP_IMAGE_BUFFERED;
+
+				return NGX_AGAIN;
+			default:
+				break;
+			}
+		}
+#endif
+
+		if(ngx_http_jpeg_filter_gone(r)) {
+			return ngx_http_jpeg_filter_abort(r, ctx, in, "buffering");
+		}
+
+		/* From now on the read event tells if the client goes away */
+		if(ngx_http_jpeg_filter_watch(r) != NGX_OK) {
+			return ngx_http_filter_finalize_request(r, &ngx_http_jpeg_filter_module, NGX_HTTP_INTERNAL_SERVER_ERROR);
+		}
+
+		/* Only so many images may be buffered and processed at the same time */
+		switch(ngx_http_jpeg_filter_admit(r, ctx)) {
+		case NGX_OK:
+			break;
+		case NGX_AGAIN:
+			/* Hold back the data until the request gets admitted or gives up waiting */
+			ctx->phase = NGX_HTTP_JPEG_FILTER_PHASE_QUEUE;
+
+			if(ngx_chain_add_copy(r->pool, &ctx->limit_in, in) != NGX_OK) {
+				return ngx_http_filter_finalize_request(r, &ngx_http_jpeg_filter_module, NGX_HTTP_INTERNAL_SERVER_ERROR);
+			}
+
+			return NGX_AGAIN;
+		case NGX_DECLINED:
+			return ngx_http_jpeg_filter_shed(r, ctx, in);
+		default:
+			return ngx_http_filter_finalize_request(r, &ngx_http_jpeg_filter_module, NGX_HTTP_INTERNAL_SERVER_ERROR);
+		}
+
+		ctx->read_start = ngx_current_msec;
+
 		/*
 		 * Have a taste of the first bytes of data in order to find out
 		 * if this actually something we should care about and can handle.
 		 */
-		if(ngx_http_jpeg_filter_test(r, in) == NGX_HTTP_IMAGE_NONE) {
+		if(ngx_http_jpeg_filter_test(r, ctx, in) == NGX_HTTP_IMAGE_NONE) {
 			/* No image data. Send the header and pass on the data */
 			ctx->phase = NGX_HTTP_JPEG_FILTER_PHASE_PASS;
 
+			ngx_http_jpeg_filter_count(ctx, NGX_HTTP_JPEG_FILTER_RESULT_SKIPPED);
+
 			/* Proceed to the next header filter as well because
 			 * we were holding it back so far.
 			 */
@@ -437,6 +1437,17 @@ static ngx_int_t ngx_http_jpeg_body_filter(ngx_http_request_t *r, ngx_chain_t *i
 			return ngx_http_next_body_filter(r, in);
 		}
 
+		if(ngx_http_jpeg_filter_borrow(r, ctx, in) == NGX_OK) {
+			/* The buffer of the body already holds the complete image. Nothing left to read */
+			if(ngx_http_jpeg_filter_scan(ctx) != NGX_OK) {
+				return ngx_http_jpeg_filter_reject(r, ctx, in, 1);
+			}
+
+			ngx_http_jpeg_filter_discard(in);
+
+			goto process;
+		}
+
         	/* Following calls of this function go directly to the reading phase */
 		ctx->phase = NGX_HTTP_JPEG_FILTER_PHASE_READ;
 
@@ -446,46 +1457,135 @@ static ngx_int_t ngx_http_jpeg_body_filter(ngx_http_request_t *r, ngx_chain_t *i
 		/* Here we want to read all the data into our buffer */
 		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "jpeg_filter: phase READ");
 
-		rc = ngx_http_jpeg_filter_read(r, in);
-
-		/* If there is more data, return nicely but don't call the next filter, so we will get more data! */
-		if(rc == NGX_AGAIN) {
-			return NGX_OK;
+		/* Don't buffer the rest of the image for nobody */
+		if(ctx->gone) {
+			return ngx_http_jpeg_filter_abort(r, ctx, in, "buffering");
 		}
 
+		rc = ngx_http_jpeg_filter_read(r, in);
+
 		/* If there was an error, abort and send some error code */
 		if(rc == NGX_ERROR) {
 			return ngx_http_filter_finalize_request(r, &ngx_http_jpeg_filter_module, NGX_HTTP_INTERNAL_SERVER_ERROR);
 		}
 
+		/*
+		 * Look at the frame header as soon as it arrived in order to find out
+		 * whether we should process the image before buffering all of it.
+		 */
+		if(ctx->frame == 0) {
+			switch(ngx_http_jpeg_filter_scan(ctx)) {
+			case NGX_OK:
+				break;
+			case NGX_AGAIN:
+				if(rc == NGX_AGAIN) {
+					break;
+				}
+
+				ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "jpeg_filter: image is truncated before the frame header");
+
+				/* Fall through */
+			default:
+				return ngx_http_jpeg_filter_reject(r, ctx, NULL, (rc == NGX_OK));
+			}
+		}
+
+		/* If there is more data, return nicely but don't call the next filter, so we will get more data! */
+		if(rc == NGX_AGAIN) {
+			return NGX_OK;
+		}
+
 		/* fall through */
 
 	case NGX_HTTP_JPEG_FILTER_PHASE_PROCESS:
+	process:
 		/* Now that we have all the bytes from the image, we can go on an process it */
 		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "jpeg_filter: phase PROCESS");
 
+		if(ctx->gone || ngx_http_jpeg_filter_gone(r)) {
+			return ngx_http_jpeg_filter_abort(r, ctx, in, "buffering");
+		}
+
+		ngx_http_jpeg_filter_observe(ctx, NGX_HTTP_JPEG_FILTER_STAGE_READ, (ngx_current_msec - ctx->read_start) * 1000);
+		ctx->in_bytes = ctx->in_last - ctx->in_image;
+
+		/* Account for the decoded image, estimated with 2 bytes per sample for the DCT coefficients */
+		(void) ngx_http_jpeg_filter_reserve(ctx, 0, ctx->samples * 2);
+
 		/* What ever comes after will be passed through */
 		ctx->phase = NGX_HTTP_JPEG_FILTER_PHASE_PASS;
 
 		rc = ngx_http_jpeg_filter_process(r);
-		if(rc == NGX_ERROR) {
-			/* There was a problem processing the image. Either send the original image or an error */
+		if(rc == NGX_AGAIN) {
+			/* The image is processed in a thread. We will be called again when it is done */
+			ctx->phase = NGX_HTTP_JPEG_FILTER_PHASE_THREAD;
+			return NGX_AGAIN;
+		}
 
-			if(conf->graceful == 1) {
-				/* Send the original image */
-				return ngx_http_jpeg_filter_send(r, NGX_HTTP_JPEG_FILTER_UNMODIFIED);
-			}
-			else {
-				return ngx_http_filter_finalize_request(r, &ngx_http_jpeg_filter_module, NGX_HTTP_UNSUPPORTED_MEDIA_TYPE);
-			}
+		return ngx_http_jpeg_filter_finish(r, rc);
+
+#if (NGX_THREADS)
+	case NGX_HTTP_JPEG_FILTER_PHASE_THREAD:
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "jpeg_filter: phase THREAD");
+
+		if(ctx->task_done == 0) {
+			/* The thread is still busy with the image */
+			return NGX_AGAIN;
+		}
+
+		ctx->phase = NGX_HTTP_JPEG_FILTER_PHASE_PASS;
+
+		r->connection->buffered &= ~NGX_HTTP_IMAGE_BUFFERED;
+
+		return ngx_http_jpeg_filter_finish(r, ctx->rc);
+#endif
+
+	case NGX_HTTP_JPEG_FILTER_PHASE_QUEUE:
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "jpeg_filter: phase QUEUE");
+
+		if(in != NULL && ngx_chain_add_copy(r->pool, &ctx->limit_in, in) != NGX_OK) {
+			return ngx_http_filter_finalize_request(r, &ngx_http_jpeg_filter_module, NGX_HTTP_INTERNAL_SERVER_ERROR);
+		}
+
+		if(ctx->limit_state == NGX_HTTP_JPEG_FILTER_LIMIT_QUEUED) {
+			return NGX_AGAIN;
+		}
+
+		if(ctx->gone || ngx_http_jpeg_filter_gone(r)) {
+			/* The request is not waiting anymore and nobody is going to buffer this */
+			in = ctx->limit_in;
+			ctx->limit_in = NULL;
+
+			return ngx_http_jpeg_filter_abort(r, ctx, in, "queueing");
 		}
 
-		/* Send the modified image */
-		return ngx_http_jpeg_filter_send(r, NGX_HTTP_JPEG_FILTER_MODIFIED);
+#if (NGX_HTTP_CACHE)
+		/* Reading the cache file in a thread or with AIO is not done yet */
+		if(ctx->store_state == NGX_HTTP_JPEG_FILTER_STORE_READING && r->aio) {
+			return NGX_AGAIN;
+		}
+#endif
+
+		/* Nothing is held back anymore, neither for the queue nor for the cache file */
+		r->connection->buffered &= ~NGX_HTTP_IMAGE_BUFFERED;
+
+		/* Start over with all the data that has been held back */
+		ctx->phase = NGX_HTTP_JPEG_FILTER_PHASE_START;
+
+		in = ctx->limit_in;
+		ctx->limit_in = NULL;
+
+		return ngx_http_jpeg_body_filter(r, in);
 
 	case NGX_HTTP_JPEG_FILTER_PHASE_PASS:
 		return ngx_http_next_body_filter(r, in);
 
+	case NGX_HTTP_JPEG_FILTER_PHASE_DISCARD:
+		/* The image has already been sent. Throw away the rest of the body */
+		ngx_http_jpeg_filter_discard(in);
+
+		return ngx_http_next_body_filter(r, NULL);
+
 	case NGX_HTTP_JPEG_FILTER_PHASE_DONE:
 	default:
 		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "jpeg_filter: phase default (DONE)");
@@ -499,6 +1599,83 @@ static ngx_int_t ngx_http_jpeg_body_filter(ngx_http_request_t *r, ngx_chain_t *i
 	return NGX_OK;
 }
 
+/* Send the processed image, the original image, or an error, depending on the result of processing the image */
+static ngx_int_t ngx_http_jpeg_filter_finish(ngx_http_request_t *r, ngx_int_t rc) {
+	ngx_http_jpeg_filter_ctx_t   *ctx;
+	ngx_http_jpeg_filter_conf_t  *conf;
+
+	ctx = ngx_http_get_module_ctx(r, ngx_http_jpeg_filter_module);
+	conf = ngx_http_get_module_loc_conf(r, ngx_http_jpeg_filter_module);
+
+	if(ctx->out_buffer != NULL && ctx->out_buffer != ctx->out_image) {
+		/* The encoder didn't use the buffer from the pool. Give it back */
+		ngx_http_jpeg_filter_arena_free(r, ctx->out_buffer);
+		ctx->out_buffer = NULL;
+	}
+
+	if(rc == NGX_ERROR && ctx->aborted == 1) {
+		/* Processing has been stopped because the client is gone */
+		return ngx_http_jpeg_filter_abort(r, ctx, NULL, "processing");
+	}
+
+	if(rc == NGX_ERROR) {
+		/* There was a problem processing the image. Either send the original image or an error */
+
+		if(ctx->over_budget != 0) {
+			/* It would have taken at least that long. Don't let the next one like it run into the budget as well */
+			ngx_http_jpeg_filter_learn(ctx, ctx->over_budget);
+		}
+
+		if(conf->graceful == 1) {
+			/* Send the original image */
+			ngx_http_jpeg_filter_count(ctx, NGX_HTTP_JPEG_FILTER_RESULT_GRACEFUL);
+			return ngx_http_jpeg_filter_send(r, NGX_HTTP_JPEG_FILTER_UNMODIFIED);
+		}
+		else {
+			ngx_http_jpeg_filter_count(ctx, NGX_HTTP_JPEG_FILTER_RESULT_REJECTED);
+			return ngx_http_filter_finalize_request(r, &ngx_http_jpeg_filter_module, NGX_HTTP_UNSUPPORTED_MEDIA_TYPE);
+		}
+	}
+
+	if(rc == NGX_DECLINED) {
+		/* Processing wouldn't have changed the image */
+		ngx_http_jpeg_filter_count(ctx, NGX_HTTP_JPEG_FILTER_RESULT_SKIPPED);
+		return ngx_http_jpeg_filter_send(r, NGX_HTTP_JPEG_FILTER_UNMODIFIED);
+	}
+
+	ctx->out_bytes = ctx->out_last - ctx->out_image;
+	ctx->pixels = ctx->width * ctx->height;
+
+	ngx_http_jpeg_filter_count(ctx, NGX_HTTP_JPEG_FILTER_RESULT_PROCESSED);
+
+	/* Transcoding is much cheaper than what the cost model is about */
+	if(ctx->transcoded == 0) {
+		ngx_http_jpeg_filter_learn(ctx, ctx->usec[NGX_HTTP_JPEG_FILTER_STAGE_DECODE] + ctx->usec[NGX_HTTP_JPEG_FILTER_STAGE_CHAIN] + ctx->usec[NGX_HTTP_JPEG_FILTER_STAGE_ENCODE]);
+	}
+
+	ngx_http_jpeg_filter_payoff(ctx);
+
+	if(ctx->metrics != NULL) {
+		(void) ngx_atomic_fetch_add(&ctx->metrics->in_bytes, ctx->in_bytes);
+		(void) ngx_atomic_fetch_add(&ctx->metrics->out_bytes, ctx->out_bytes);
+		(void) ngx_atomic_fetch_add(&ctx->metrics->pixels, ctx->pixels);
+	}
+
+	/* Remember the modified image for the next requests */
+	if(conf->cache_zone != NULL) {
+		ngx_http_jpeg_filter_cache_store(r, ctx);
+	}
+
+#if (NGX_HTTP_CACHE)
+	if(ctx->store_state == NGX_HTTP_JPEG_FILTER_STORE_MISS) {
+		ngx_http_jpeg_filter_store_update(r, ctx);
+	}
+#endif
+
+	/* Send the modified image */
+	return ngx_http_jpeg_filter_send(r, NGX_HTTP_JPEG_FILTER_MODIFIED);
+}
+
 /* Send the data to the next header and body filter */
 static ngx_int_t ngx_http_jpeg_filter_send(ngx_http_request_t *r, ngx_uint_t image) {
 	ngx_buf_t                   *b;
@@ -519,24 +1696,46 @@ static ngx_int_t ngx_http_jpeg_filter_send(ngx_http_request_t *r, ngx_uint_t ima
 	if(image == NGX_HTTP_JPEG_FILTER_MODIFIED) {
 		b->pos = ctx->out_image;
 		b->last = ctx->out_last;
+		b->memory = 1;
+	}
+#if (NGX_HTTP_CACHE)
+	else if(image == NGX_HTTP_JPEG_FILTER_STORED) {
+		/* The cache file after its header, such that it can be sent with sendfile */
+		b->file = &ctx->store->file;
+		b->file_pos = ctx->store->body_start;
+		b->file_last = ctx->store->length;
+		b->in_file = 1;
 	}
+#endif
 	else {
 		b->pos = ctx->in_image;
 		b->last = ctx->in_last;
+		b->memory = 1;
 	}
 
-	b->memory = 1;
 	b->last_buf = 1;
 
 	out.buf = b;
 	out.next = NULL;
 
+	/*
+	 * The original image keeps its validators. The processed image gets its own. Its Last-Modified would still
+	 * be the one of the original image, although the processed image changes with the configuration as well.
+	 */
+	if(image != NGX_HTTP_JPEG_FILTER_UNMODIFIED) {
+		if(ctx->etag.len != 0 && ngx_http_jpeg_filter_set_etag(r, ctx) != NGX_OK) {
+			return NGX_ERROR;
+		}
+
+		ngx_http_clear_last_modified(r);
+	}
+
 	/* Set the content type. However, this should be already the case, but better be sure */
 	r->headers_out.content_type.len = sizeof("image/jpeg") - 1;
 	r->headers_out.content_type.data = (u_char *) "image/jpeg";
 
 	/* The content length must be adjusted */
-	r->headers_out.content_length_n = b->last - b->pos;
+	r->headers_out.content_length_n = ngx_buf_size(b);
 
 	/* No clue what is happening here. Copied from image filter module */
 	if(r->headers_out.content_length) {
@@ -545,6 +1744,13 @@ static ngx_int_t ngx_http_jpeg_filter_send(ngx_http_request_t *r, ngx_uint_t ima
 
 	r->headers_out.content_length = NULL;
 
+	/* Only send the requested range of the processed image */
+	if(image != NGX_HTTP_JPEG_FILTER_UNMODIFIED) {
+		if(ngx_http_jpeg_filter_range(r, ctx, b) != NGX_OK) {
+			return NGX_ERROR;
+		}
+	}
+
 	/*
 	 * Now that we are done and we know the final size of the modified body
 	 * we can proceed to the next header filter.
@@ -560,512 +1766,4843 @@ static ngx_int_t ngx_http_jpeg_filter_send(ngx_http_request_t *r, ngx_uint_t ima
 	return ngx_http_next_body_filter(r, &out);
 }
 
-/* Test the incoming data if we can and should handle it */
-static ngx_uint_t ngx_http_jpeg_filter_test(ngx_http_request_t *r, ngx_chain_t *in) {
-	u_char  *p;
+/*
+ * Derive a strong ETag for the processed image from the validators of the original image and everything
+ * else that determines the processed image. Without validators, the processed image doesn't get an ETag.
+ */
+static ngx_int_t ngx_http_jpeg_filter_etag(ngx_http_request_t *r, ngx_http_jpeg_filter_ctx_t *ctx) {
+	u_char     *p, hash[16];
+	ngx_md5_t   md5;
 
-	ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "jpeg_filter: ngx_http_jpeg_filter_test");
+	if(r->headers_out.etag == NULL && r->headers_out.last_modified_time == -1) {
+		return NGX_OK;
+	}
+
+	ngx_md5_init(&md5);
+	ngx_http_jpeg_filter_hash(r, ctx, &md5);
+	ngx_md5_final(hash, &md5);
+
+	p = ngx_pnalloc(r->pool, sizeof(hash) * 2 + 4);
+	if(p == NULL) {
+		return NGX_ERROR;
+	}
 
 	/*
-	 * Checking if we have enough data available such that we can
-	 * decide if we can and should handle it.
+	 * With an automatic coding the processed image is not always byte for byte the same. Its ETag
+	 * is weak then. The "W/" is in front of the ETag in memory and is only added by ngx_http_jpeg_filter_set_etag().
 	 */
-	p = in->buf->pos;
+	if(ctx->conf->optimize == NGX_HTTP_JPEG_FILTER_AUTO || ctx->conf->progressive == NGX_HTTP_JPEG_FILTER_AUTO) {
+		*p++ = 'W';
+		*p++ = '/';
 
-	if(in->buf->last - p < 16) {
-		return NGX_HTTP_IMAGE_NONE;
+		ctx->etag_weak = 1;
 	}
 
-	ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "jpeg_filter: \"%02xd%02xd\"", p[0], p[1]);
+	ctx->etag.data = p;
 
-	/* Check for JPEG signature */
-	if(p[0] == 0xff && p[1] == 0xd8) { /* JPEG */
-		return NGX_HTTP_IMAGE_JPEG;
-	}
+	*p++ = '"';
+	p = ngx_hex_dump(p, hash, sizeof(hash));
+	*p++ = '"';
 
-	return NGX_HTTP_IMAGE_NONE;
+	ctx->etag.len = p - ctx->etag.data;
+
+	return NGX_OK;
 }
 
-/* Read several buffer chains and store the data in a buffer */
-static ngx_int_t ngx_http_jpeg_filter_read(ngx_http_request_t *r, ngx_chain_t *in) {
-	u_char				*p;
-	size_t				size, rest;
-	ngx_buf_t			*b;
-	ngx_chain_t			*cl;
-	ngx_http_jpeg_filter_ctx_t	*ctx;
+/* Check whether the ETag is in the list of ETags of an If-None-Match, If-Match, or If-Range header */
+static ngx_uint_t ngx_http_jpeg_filter_etag_match(ngx_str_t *list, ngx_str_t *etag, ngx_uint_t weak) {
+	u_char  *p, *last;
 
-	ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "jpeg_filter: ngx_http_jpeg_filter_read");
+	p = list->data;
+	last = list->data + list->len;
 
-	/* Get our context for this request */
-	ctx = ngx_http_get_module_ctx(r, ngx_http_jpeg_filter_module);
+	if(list->len == 1 && *p == '*') {
+		return weak;
+	}
 
-	/* If we didn't allocate yet memory for the image, we do it now */
-	if(ctx->in_image == NULL) {
-		/* We found out the size of the buffer in the header filter */
-		ctx->in_image = ngx_palloc(r->pool, ctx->length);
-		if (ctx->in_image == NULL) {
-			return NGX_ERROR;
+	while(p < last) {
+		while(p < last && (*p == ' ' || *p == '\t' || *p == ',')) {
+			p++;
 		}
 
-		ctx->in_last = ctx->in_image;
-	}
+		/* A weak ETag matches only in a weak comparison */
+		if(weak == 1 && last - p > 2 && p[0] == 'W' && p[1] == '/') {
+			p += 2;
+		}
 
-	p = ctx->in_last;
+		if((size_t)(last - p) >= etag->len && ngx_strncmp(p, etag->data, etag->len) == 0) {
+			p += etag->len;
 
-	/* Copying the data from the buffer chain into out buffer */
-	for(cl = in; cl; cl = cl->next) {
-		b = cl->buf;
-		size = b->last - b->pos;
+			if(p == last || *p == ' ' || *p == '\t' || *p == ',') {
+				return 1;
+			}
+		}
 
-		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "jpeg_filter buf: %uz", size);
+		while(p < last && *p != ',') {
+			p++;
+		}
+	}
 
-		rest = ctx->in_image + ctx->length - p;
+	return 0;
+}
 
-		if(size > rest) {
-			ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "jpeg_filter: too big response");
+/* Replace the ETag of the original image by the ETag of the processed image */
+static ngx_int_t ngx_http_jpeg_filter_set_etag(ngx_http_request_t *r, ngx_http_jpeg_filter_ctx_t *ctx) {
+	ngx_table_elt_t  *h;
+
+	h = r->headers_out.etag;
+
+	if(h == NULL) {
+		h = ngx_list_push(&r->headers_out.headers);
+		if(h == NULL) {
 			return NGX_ERROR;
 		}
 
-		p = ngx_cpymem(p, b->pos, size);
-		b->pos += size;
-
-		if (b->last_buf) {
-			ctx->in_last = p;
+		h->next = NULL;
+		ngx_str_set(&h->key, "ETag");
 
-			/* If this was the last buffer chain, we're done */
-			return NGX_OK;
-		}
+		r->headers_out.etag = h;
 	}
 
-	ctx->in_last = p;
+	h->hash = 1;
+	h->value = ctx->etag;
 
-	/* This should be probably done, but no clue what it actually means */
-	r->connection->buffered |= NGX_HTTP_IMAGE_BUFFERED;
+	if(ctx->etag_weak == 1) {
+		h->value.data -= 2;
+		h->value.len += 2;
+	}
 
-	/* This wasn't the las buffer chain. Tell the caller that we're expecting more */
-	return NGX_AGAIN;
+	return NGX_OK;
 }
 
-/* Process the image */
-static ngx_int_t ngx_http_jpeg_filter_process(ngx_http_request_t *r) {
-	ngx_http_jpeg_filter_ctx_t   *ctx;
-	ngx_http_jpeg_filter_conf_t  *conf;
-	ngx_pool_cleanup_t           *cln;
+/*
+ * Evaluate If-Match and If-Unmodified-Since with the validators of the response that is going to be sent, i.e. the
+ * ETag of the processed image or the validators of the original image. The not modified filter can't do this, because
+ * it comes before the jpeg filter and only knows the original image. Both headers are hidden from it by
+ * ngx_http_jpeg_filter_precondition_handler(). A processed image has no Last-Modified, therefore
+ * If-Unmodified-Since is ignored for it.
+ */
+static ngx_int_t ngx_http_jpeg_filter_precondition(ngx_http_request_t *r, ngx_http_jpeg_filter_ctx_t *ctx, ngx_uint_t image) {
+	time_t            since, modified;
+	ngx_str_t        *etag;
+	ngx_table_elt_t  *h;
 
-	ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "jpeg_filter: ngx_http_jpeg_filter_process");
+	if(r != r->main || r->headers_out.status != NGX_HTTP_OK || r->disable_not_modified) {
+		return NGX_OK;
+	}
 
-	/* No clue that this actually does. Copied from image filter module */
-	r->connection->buffered &= ~NGX_HTTP_IMAGE_BUFFERED;
+	/* Only a strong ETag matches */
+	etag = NULL;
 
-	/* Get our context for this request */
-	ctx = ngx_http_get_module_ctx(r, ngx_http_jpeg_filter_module);
-	if(ctx->in_image == NULL) {
-		/* No data available. Bail out */
-		return NGX_ERROR;
+	if(image != NGX_HTTP_JPEG_FILTER_UNMODIFIED) {
+		if(ctx->etag.len != 0 && ctx->etag_weak == 0) {
+			etag = &ctx->etag;
+		}
+
+		modified = -1;
 	}
+	else {
+		if(r->headers_out.etag != NULL && !(r->headers_out.etag->value.len > 2 && r->headers_out.etag->value.data[0] == 'W' && r->headers_out.etag->value.data[1] == '/')) {
+			etag = &r->headers_out.etag->value;
+		}
 
-	/* Get out module configuration so we know what we actually have to do */
-	conf = ngx_http_get_module_loc_conf(r, ngx_http_jpeg_filter_module);
+		modified = r->headers_out.last_modified_time;
+	}
 
-	/* Read the image */
-	mj_jpeg_t m;
-	mj_init_jpeg(&m);
+	h = ngx_http_jpeg_filter_hidden(r, (u_char *) "If-Match", sizeof("If-Match") - 1);
+	if(h != NULL) {
+		if(h->value.len == 1 && h->value.data[0] == '*') {
+			return NGX_OK;
+		}
 
-	if(mj_read_jpeg_from_memory(&m, ctx->in_image, ctx->length, conf->max_pixel) != MJ_OK) {
-		mj_free_jpeg(&m);
-		return NGX_ERROR;
+		if(etag == NULL || ngx_http_jpeg_filter_etag_match(&h->value, etag, 0) == 0) {
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "jpeg_filter: If-Match failed");
+			return NGX_HTTP_PRECONDITION_FAILED;
+		}
+
+		/* If-Unmodified-Since doesn't count with If-Match */
+		return NGX_OK;
 	}
 
-	ngx_http_jpeg_filter_element_t *felts = conf->filter_elements->elts;
-	ngx_uint_t i;
-	ngx_int_t n, align = 0, offset_x = 0, offset_y = 0;
-	ngx_str_t val1, val2;
-	mj_dropon_t d;
+	h = ngx_http_jpeg_filter_hidden(r, (u_char *) "If-Unmodified-Since", sizeof("If-Unmodified-Since") - 1);
+	if(h != NULL && modified != -1) {
+		since = ngx_parse_http_time(h->value.data, h->value.len);
 
-	/* Go through the processing chain */
-	for(i = 0; i < conf->filter_elements->nelts; i++) {
-		switch(felts[i].type) {
-			case NGX_HTTP_JPEG_FILTER_TYPE_EFFECT1:
-				ngx_http_jpeg_filter_get_string_value(r, &felts[i].cv1, &val1);
+		if(since != NGX_ERROR && since < modified) {
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "jpeg_filter: If-Unmodified-Since failed");
+			return NGX_HTTP_PRECONDITION_FAILED;
+		}
+	}
 
-				ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "jpeg_filter: applying effect '%s'", val1.data);
+	return NGX_OK;
+}
 
-				if(ngx_strcmp(val1.data, "grayscale") == 0) {
-					mj_effect_grayscale(&m);
-				}
-				else if(ngx_strcmp(val1.data, "pixelate") == 0) {
-					mj_effect_pixelate(&m);
-				}
-				else {
-					ngx_log_error(NGX_LOG_NOTICE, r->connection->log, 0, "jpeg_filter: invalid effect \"%s\"", val1.data);
-				}
+/* Find a request header that has been hidden by ngx_http_jpeg_filter_precondition_handler() */
+static ngx_table_elt_t *ngx_http_jpeg_filter_hidden(ngx_http_request_t *r, u_char *name, size_t len) {
+	ngx_uint_t        i;
+	ngx_list_part_t  *part;
+	ngx_table_elt_t  *h;
 
+	part = &r->headers_in.headers.part;
+	h = part->elts;
+
+	for(i = 0; /* void */; i++) {
+		if(i >= part->nelts) {
+			if(part->next == NULL) {
 				break;
-			case NGX_HTTP_JPEG_FILTER_TYPE_EFFECT2:
-				ngx_http_jpeg_filter_get_string_value(r, &felts[i].cv1, &val1);
+			}
 
-				n = ngx_http_jpeg_filter_get_int_value(r, &felts[i].cv2, 0);
-				if(n < 0) {
-					n = 0;
-				}
+			part = part->next;
+			h = part->elts;
+			i = 0;
+		}
 
-				ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "jpeg_filter: applying effect '%s(%d)'", val1.data, n);
+		if(h[i].key.len == len && ngx_strncasecmp(h[i].key.data, name, len) == 0) {
+			return &h[i];
+		}
+	}
 
-				if(ngx_strcmp(val1.data, "brighten") == 0) {
-					mj_effect_luminance(&m, n);
-				}
-				else if(ngx_strcmp(val1.data, "darken") == 0) {
-					mj_effect_luminance(&m, -n);
-				}
-				else if(ngx_strcmp(val1.data, "tintblue") == 0) {
-					mj_effect_tint(&m, n, 0);
-				}
-				else if(ngx_strcmp(val1.data, "tintyellow") == 0) {
-					mj_effect_tint(&m, -n, 0);
-				}
-				else if(ngx_strcmp(val1.data, "tintred") == 0) {
-					mj_effect_tint(&m, 0, n);
-				}
-				else if(ngx_strcmp(val1.data, "tintgreen") == 0) {
-					mj_effect_tint(&m, 0, -n);
-				}
-				else {
-					ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "jpeg_filter: invalid effect \"%s\"", val1.data);
-				}
+	return NULL;
+}
 
-				break;
-			case NGX_HTTP_JPEG_FILTER_TYPE_DROPON_ALIGN:
-				align = 0;
+/*
+ * Hide If-Match and If-Unmodified-Since from the not modified filter in the locations with the jpeg filter.
+ * They are evaluated by ngx_http_jpeg_filter_precondition() instead.
+ */
+static ngx_int_t ngx_http_jpeg_filter_precondition_handler(ngx_http_request_t *r) {
+	ngx_http_jpeg_filter_conf_t  *conf;
 
-				ngx_http_jpeg_filter_get_string_value(r, &felts[i].cv1, &val1);
+	conf = ngx_http_get_module_loc_conf(r, ngx_http_jpeg_filter_module);
 
-				ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "jpeg_filter: applying dropon align '%s'", val1.data);
+	if(conf->enable == 1 && r == r->main) {
+		r->headers_in.if_match = NULL;
+		r->headers_in.if_unmodified_since = NULL;
+	}
 
-				if(ngx_strcmp(val1.data, "top") == 0) {
-					align |= MJ_ALIGN_TOP;
-				}
-				else if(ngx_strcmp(val1.data, "bottom") == 0) {
-					align |= MJ_ALIGN_BOTTOM;
-				}
-				else if(ngx_strcmp(val1.data, "center") == 0) {
-					align |= MJ_ALIGN_CENTER;
-				}
-				else {
-					ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "jpeg_filter: invalid alignment \"%s\"", val1.data);
-				}
+	return NGX_DECLINED;
+}
 
-				ngx_http_jpeg_filter_get_string_value(r, &felts[i].cv2, &val1);
+/*
+ * Answer a request for a single range of the processed image with that range. Multiple ranges,
+ * unsatisfiable ranges, and ranges with an If-Range that doesn't match are answered with the whole image.
+ */
+static ngx_int_t ngx_http_jpeg_filter_range(ngx_http_request_t *r, ngx_http_jpeg_filter_ctx_t *ctx, ngx_buf_t *b) {
+	u_char           *p, *last;
+	off_t             start, end, size;
+	ngx_uint_t        suffix;
+	ngx_table_elt_t  *h;
 
-				ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "jpeg_filter: applying dropon align '%s'", val1.data);
+	size = ngx_buf_size(b);
 
-				if(ngx_strcmp(val1.data, "left") == 0) {
-					align |= MJ_ALIGN_LEFT;
-				}
-				else if(ngx_strcmp(val1.data, "right") == 0) {
-					align |= MJ_ALIGN_RIGHT;
-				}
-				else if(ngx_strcmp(val1.data, "center") == 0) {
-					align |= MJ_ALIGN_CENTER;
-				}
-				else {
-					ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "jpeg_filter: invalid alignment \"%s\"", val1.data);
-				}
+	/* Ranges of an image that isn't always the same could be put together from different images */
+	if(r != r->main || r->headers_out.status != NGX_HTTP_OK || size == 0 || ctx->etag_weak == 1) {
+		return NGX_OK;
+	}
 
-				break;
-			case NGX_HTTP_JPEG_FILTER_TYPE_DROPON_OFFSET:
-				offset_y = ngx_http_jpeg_filter_get_int_value(r, &felts[i].cv1, offset_y);
-				offset_x = ngx_http_jpeg_filter_get_int_value(r, &felts[i].cv2, offset_x);
+	if(r->headers_out.accept_ranges == NULL) {
+		h = ngx_list_push(&r->headers_out.headers);
+		if(h == NULL) {
+			return NGX_ERROR;
+		}
 
-				ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "jpeg_filter: applying dropon offset (%dpx,%dpx)", offset_y, offset_x);
+		h->hash = 1;
+		h->next = NULL;
+		ngx_str_set(&h->key, "Accept-Ranges");
+		ngx_str_set(&h->value, "bytes");
 
-				break;
-			case NGX_HTTP_JPEG_FILTER_TYPE_DROPON:
-				ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "jpeg_filter: applying preloaded dropon");
-				mj_compose(&m, felts[i].dropon, align, offset_x, offset_y);
+		r->headers_out.accept_ranges = h;
+	}
 
-				break;
-			case NGX_HTTP_JPEG_FILTER_TYPE_DROPON_FILE1:
-			case NGX_HTTP_JPEG_FILTER_TYPE_DROPON_FILE2:
-				ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "jpeg_filter: applying dynamic dropon");
+	if(r->headers_in.range == NULL) {
+		return NGX_OK;
+	}
 
-				mj_init_dropon(&d);
+	/* If-Range requires a strong comparison */
+	if(r->headers_in.if_range != NULL) {
+		if(ctx->etag.len == 0 || ngx_http_jpeg_filter_etag_match(&r->headers_in.if_range->value, &ctx->etag, 0) == 0) {
+			return NGX_OK;
+		}
+	}
 
-				if(felts[i].type == NGX_HTTP_JPEG_FILTER_TYPE_DROPON_FILE1) {
-					ngx_http_jpeg_filter_get_string_value(r, &felts[i].cv1, &val1);
+	p = r->headers_in.range->value.data;
+	last = p + r->headers_in.range->value.len;
 
-					if(mj_read_dropon_from_file(&d, (char *)val1.data, NULL, MJ_BLEND_FULL) != MJ_OK) {
-						ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "jpeg_filter: dropon could not load the file \"%s\"", val1.data);
-					}
-				}
-				else {
-					ngx_http_jpeg_filter_get_string_value(r, &felts[i].cv1, &val1);
-					ngx_http_jpeg_filter_get_string_value(r, &felts[i].cv2, &val2);
+	if(last - p < 7 || ngx_strncasecmp(p, (u_char *) "bytes=", 6) != 0) {
+		return NGX_OK;
+	}
 
-					if(mj_read_dropon_from_file(&d, (char *)val1.data, (char *)val2.data, MJ_BLEND_FULL) != MJ_OK) {
-						ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "jpeg_filter: dropon could not load the file \"%s\" or \"%s\"", val1.data, val2.data);
-					}
-				}
+	p += 6;
 
-				mj_compose(&m, &d, align, offset_x, offset_y);
+	while(p < last && *p == ' ') {
+		p++;
+	}
 
-				mj_free_dropon(&d);
+	start = 0;
+	end = 0;
+	suffix = 0;
 
-				break;
-			case NGX_HTTP_JPEG_FILTER_TYPE_DROPON_MEMORY1:
-			case NGX_HTTP_JPEG_FILTER_TYPE_DROPON_MEMORY2:
-				ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "jpeg_filter: applying dynamic dropon");
+	if(p < last && *p == '-') {
+		suffix = 1;
+		p++;
+	}
+	else {
+		if(p == last || *p < '0' || *p > '9') {
+			return NGX_OK;
+		}
 
-				mj_init_dropon(&d);
+		while(p < last && *p >= '0' && *p <= '9') {
+			if(start >= size) {
+				return NGX_OK;
+			}
 
-				if(felts[i].type == NGX_HTTP_JPEG_FILTER_TYPE_DROPON_MEMORY1) {
-					ngx_http_jpeg_filter_get_string_value(r, &felts[i].cv1, &val1);
+			start = start * 10 + (*p++ - '0');
+		}
 
-					if(mj_read_dropon_from_memory(&d, val1.data, val1.len, NULL, 0, MJ_BLEND_FULL) != MJ_OK) {
-						ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "jpeg_filter: dropon could not load the bitstream");
-					}
-				}
-				else {
-					ngx_http_jpeg_filter_get_string_value(r, &felts[i].cv1, &val1);
-					ngx_http_jpeg_filter_get_string_value(r, &felts[i].cv2, &val2);
+		if(p == last || *p++ != '-') {
+			return NGX_OK;
+		}
+	}
 
-					if(mj_read_dropon_from_memory(&d, val1.data, val1.len, val2.data, val2.len, MJ_BLEND_FULL) != MJ_OK) {
-						ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "jpeg_filter: dropon could not load the bitstream");
-					}
-				}
+	if(p < last && *p >= '0' && *p <= '9') {
+		while(p < last && *p >= '0' && *p <= '9') {
+			if(end >= size) {
+				end = size;
+				p++;
+				continue;
+			}
 
-				mj_compose(&m, &d, align, offset_x, offset_y);
+			end = end * 10 + (*p++ - '0');
+		}
+	}
+	else if(suffix == 1) {
+		return NGX_OK;
+	}
+	else {
+		end = size - 1;
+	}
 
-				mj_free_dropon(&d);
+	while(p < last && *p == ' ') {
+		p++;
+	}
 
-				break;
-			default:
-				break;
+	/* Multiple ranges */
+	if(p != last) {
+		return NGX_OK;
+	}
+
+	if(suffix == 1) {
+		if(end == 0) {
+			return NGX_OK;
 		}
+
+		start = (end > size) ? 0 : size - end;
+		end = size - 1;
 	}
-	
-	/* Apply the options */
-	int options = 0;
 
-	if(conf->optimize) {
-		options |= MJ_OPTION_OPTIMIZE;
+	if(end >= size) {
+		end = size - 1;
 	}
 
-	if(conf->progressive) {
-		options |= MJ_OPTION_PROGRESSIVE;
+	if(start >= size || start > end) {
+		return NGX_OK;
 	}
 
-	if(conf->arithmetric) {
-		options |= MJ_OPTION_ARITHMETRIC;
+	h = ngx_list_push(&r->headers_out.headers);
+	if(h == NULL) {
+		return NGX_ERROR;
 	}
 
-	ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "jpeg_filter: JPEG output options %d", options);
+	h->value.data = ngx_pnalloc(r->pool, sizeof("bytes -/") - 1 + 3 * NGX_OFF_T_LEN);
+	if(h->value.data == NULL) {
+		return NGX_ERROR;
+	}
 
-	/* Write the modified image to a new buffer */
+	h->hash = 1;
+	h->next = NULL;
+	ngx_str_set(&h->key, "Content-Range");
+	h->value.len = ngx_sprintf(h->value.data, "bytes %O-%O/%O", start, end, size) - h->value.data;
 
-	size_t len;
+	r->headers_out.content_range = h;
+	r->headers_out.status = NGX_HTTP_PARTIAL_CONTENT;
+	r->headers_out.status_line.len = 0;
+	r->headers_out.content_length_n = end - start + 1;
 
-	if(mj_write_jpeg_to_memory(&m, &ctx->out_image, &len, options) != 0) {
-		mj_free_jpeg(&m);
-		return NGX_ERROR;
+	if(b->in_file) {
+		b->file_pos += start;
+		b->file_last = b->file_pos + (end - start + 1);
+	}
+	else {
+		b->pos += start;
+		b->last = b->pos + (end - start + 1);
 	}
 
-	ctx->out_last = ctx->out_image + len;
+	ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "jpeg_filter: range %O-%O/%O", start, end, size);
 
-	/* Destroy the modified image */
-	mj_free_jpeg(&m);
+	return NGX_OK;
+}
+
+/*
+ * Admit the request to buffer and process the image if the limits of jpeg_filter_limit allow it.
+ * Returns NGX_OK if the request is admitted, NGX_DECLINED if not, and NGX_AGAIN if the request
+ * has been queued. A queued request is resumed by ngx_http_jpeg_filter_limit_handler().
+ */
+static ngx_int_t ngx_http_jpeg_filter_admit(ngx_http_request_t *r, ngx_http_jpeg_filter_ctx_t *ctx) {
+	size_t                             memory;
+	ngx_pool_cleanup_t                *cln;
+	ngx_http_jpeg_filter_main_conf_t  *mcf;
+
+	switch(ctx->limit_state) {
+	case NGX_HTTP_JPEG_FILTER_LIMIT_ADMITTED:
+		return NGX_OK;
+	case NGX_HTTP_JPEG_FILTER_LIMIT_REFUSED:
+		return NGX_DECLINED;
+	default:
+		break;
+	}
+
+	mcf = ngx_http_get_module_main_conf(r, ngx_http_jpeg_filter_module);
+
+	if(mcf->limit_zone == NULL) {
+		ctx->limit_state = NGX_HTTP_JPEG_FILTER_LIMIT_ADMITTED;
+		return NGX_OK;
+	}
+
+	ctx->limit = mcf->limit_zone->data;
 
-	/*
-	 * Add a cleanup routine for the allocated buffer that holds
-	 * the modified image. We can only destroy it safely after it has been send.
-	 */
 	cln = ngx_pool_cleanup_add(r->pool, 0);
 	if(cln == NULL) {
 		return NGX_ERROR;
 	}
 
-	cln->handler = ngx_http_jpeg_filter_cleanup;
+	cln->handler = ngx_http_jpeg_filter_release;
 	cln->data = ctx;
 
-	return NGX_OK;
-}
+	/*
+	 * The first buffer for the original image and its share of the processed image as allocated by
+	 * ngx_http_jpeg_filter_process(). If the length is not known, the buffer starts small and every
+	 * time it grows, the difference is added, see ngx_http_jpeg_filter_grow().
+	 */
+	memory = (ctx->length != 0) ? ctx->length : NGX_HTTP_JPEG_FILTER_BUFFER_INITIAL;
+	memory += memory / 4 + NGX_HTTP_JPEG_FILTER_OUTPUT_SLACK;
 
-/* A function similar to ngx_atoi that can handle negative numbers */
-static ngx_int_t ngx_atois(u_char *line, size_t n) {
-	ngx_int_t  value, sign, cutoff, cutlim;
+	if(ngx_http_jpeg_filter_reserve(ctx, 1, memory) == NGX_OK) {
+		ctx->limit_state = NGX_HTTP_JPEG_FILTER_LIMIT_ADMITTED;
+		return NGX_OK;
+	}
 
-	if(n == 0) {
-		return NGX_ERROR;
+	if(mcf->limit_queue == 0) {
+		ctx->limit_state = NGX_HTTP_JPEG_FILTER_LIMIT_REFUSED;
+		return NGX_DECLINED;
 	}
 
-	cutoff = NGX_MAX_INT_T_VALUE / 10;
-	cutlim = NGX_MAX_INT_T_VALUE % 10;
+	ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "jpeg_filter: queued");
 
-	sign = 1;
-	if(*line == '-') {
-		sign = -1;
-		line++;
-		n--;
-	}
+	/* The reservation is retried until the request gets admitted or the queue time is over */
+	ctx->limit_state = NGX_HTTP_JPEG_FILTER_LIMIT_QUEUED;
+	ctx->limit_memory = memory;
+	ctx->limit_start = ngx_current_msec;
+	ctx->limit_retry = NGX_HTTP_JPEG_FILTER_LIMIT_RETRY;
 
-	for(value = 0; n--; line++) {
-		if(*line < '0' || *line > '9') {
-			return NGX_ERROR;
-		}
+	ctx->limit_event.handler = ngx_http_jpeg_filter_limit_handler;
+	ctx->limit_event.data = r;
+	ctx->limit_event.log = r->connection->log;
 
-		if(value >= cutoff && (value > cutoff || *line - '0' > cutlim)) {
-			return NGX_ERROR;
-		}
+	ngx_add_timer(&ctx->limit_event, ngx_min(mcf->limit_queue, ctx->limit_retry));
 
-		value = value * 10 + (*line - '0');
-	}
+	ngx_queue_insert_tail(&ngx_http_jpeg_filter_waiting, &ctx->limit_queue);
 
-	return (sign * value);
+	/* Park the request like for a thread */
+	r->main->blocked++;
+	r->aio = 1;
+
+	r->connection->buffered |= NGX_HTTP_IMAGE_BUFFERED;
+
+	return NGX_AGAIN;
 }
 
-/* Interpret a complex value as an int */
-static ngx_int_t ngx_http_jpeg_filter_get_int_value(ngx_http_request_t *r, ngx_http_complex_value_t *cv, ngx_int_t defval) {
-	ngx_str_t val;
-	ngx_int_t n;
+/*
+ * Reserve a slot and memory in the limits. The memory is added to the reservation of an
+ * admitted request without checking the limit if no slot is requested.
+ */
+static ngx_int_t ngx_http_jpeg_filter_reserve(ngx_http_jpeg_filter_ctx_t *ctx, ngx_uint_t concurrent, size_t memory) {
+	ngx_atomic_uint_t                  n;
+	ngx_http_jpeg_filter_limit_t      *limit = ctx->limit;
+	ngx_http_jpeg_filter_main_conf_t  *mcf;
 
-	if(cv->lengths == NULL) {
-		n = ngx_atois(cv->value.data, cv->value.len);
+	if(limit == NULL) {
+		return NGX_OK;
 	}
-	else {
-		if(ngx_http_complex_value(r, cv, &val) != NGX_OK) {
-			return defval;
+
+	if(concurrent == 0) {
+		if(ctx->limit_state == NGX_HTTP_JPEG_FILTER_LIMIT_ADMITTED) {
+			(void) ngx_atomic_fetch_add(&limit->memory, memory);
+			ctx->limit_memory += memory;
 		}
 
-		/* Subtract 1 from the length because we compiled the complex value with 'zero=1' */
-		n = ngx_atois(val.data, val.len - 1);
+		return NGX_OK;
 	}
 
-	return n;
-}
+	mcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, ngx_http_jpeg_filter_module);
 
-/* Get the complex value as a string */
-static ngx_int_t ngx_http_jpeg_filter_get_string_value(ngx_http_request_t *r, ngx_http_complex_value_t *cv, ngx_str_t *val) {
-	return ngx_http_complex_value(r, cv, val);
-}
+	n = ngx_atomic_fetch_add(&limit->concurrent, 1);
 
-/* Cleanup after the request finished */
-static void ngx_http_jpeg_filter_cleanup(void *data) {
-	ngx_http_jpeg_filter_ctx_t *ctx = data;
+	if(mcf->limit_concurrent != 0 && n >= mcf->limit_concurrent) {
+		(void) ngx_atomic_fetch_add(&limit->concurrent, -1);
+		return NGX_DECLINED;
+	}
 
-	if(ctx->out_image != NULL) {
-		free(ctx->out_image);
+	n = ngx_atomic_fetch_add(&limit->memory, memory);
+
+	if(mcf->limit_memory != 0 && n + memory > mcf->limit_memory) {
+		(void) ngx_atomic_fetch_add(&limit->memory, -(ngx_atomic_int_t)memory);
+		(void) ngx_atomic_fetch_add(&limit->concurrent, -1);
+		return NGX_DECLINED;
 	}
 
-	return;
+	ctx->limit_memory = memory;
+
+	return NGX_OK;
 }
 
-/* Process the "jpeg_filter_effect" configuration directives */
-static char *ngx_conf_jpeg_filter_effect(ngx_conf_t *cf, ngx_command_t *cmd, void *c) {
-	ngx_http_jpeg_filter_conf_t *conf = c;
+/* Retry the admission of a queued request */
+static void ngx_http_jpeg_filter_limit_handler(ngx_event_t *ev) {
+	ngx_connection_t                  *c;
+	ngx_http_request_t                *r;
+	ngx_http_jpeg_filter_ctx_t        *ctx;
+	ngx_http_jpeg_filter_main_conf_t  *mcf;
 
-	ngx_str_t                         *value;
-	ngx_http_compile_complex_value_t   ccv;
-	ngx_http_jpeg_filter_element_t    *fe;
+	r = ev->data;
+	c = r->connection;
 
-	ngx_log_debug0(NGX_LOG_DEBUG_CORE, cf->log, 0, "jpeg_filter: ngx_conf_jpeg_filter_effect");
+	ngx_http_set_log_request(c->log, r);
 
-	value = cf->args->elts;
+	ctx = ngx_http_get_module_ctx(r, ngx_http_jpeg_filter_module);
+	mcf = ngx_http_get_module_main_conf(r, ngx_http_jpeg_filter_module);
 
-	/* Initialize the processing chain */
-	if(conf->filter_elements == NULL) {
-		conf->filter_elements = ngx_array_create(cf->pool, 10, sizeof(ngx_http_jpeg_filter_element_t));
-		if(conf->filter_elements == NULL) {
-			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "jpeg_filter: failed to create filter chain");
-			return NGX_CONF_ERROR;
+	if(ngx_http_jpeg_filter_reserve(ctx, 1, ctx->limit_memory) == NGX_OK) {
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0, "jpeg_filter: admitted after %M ms", ngx_current_msec - ctx->limit_start);
+
+		ctx->limit_state = NGX_HTTP_JPEG_FILTER_LIMIT_ADMITTED;
+	}
+	else if(ctx->gone || ngx_current_msec - ctx->limit_start >= mcf->limit_queue) {
+		/* The client is gone, as told by the read event, or the request waited long enough */
+		ctx->limit_state = NGX_HTTP_JPEG_FILTER_LIMIT_REFUSED;
+	}
+	else {
+		/* Woken up too early, or the timer is up. Wait longer with every try */
+		if(ev->timer_set) {
+			return;
 		}
+
+		ctx->limit_retry = ngx_min(ctx->limit_retry * 2, NGX_HTTP_JPEG_FILTER_LIMIT_RETRY_MAX);
+
+		ngx_add_timer(ev, ngx_min(ctx->limit_retry, mcf->limit_queue - (ngx_current_msec - ctx->limit_start)));
+		return;
 	}
 
-	/* Add a new element to the processing chain */
-	fe = (ngx_http_jpeg_filter_element_t *)ngx_array_push(conf->filter_elements);
-	if(fe == NULL) {
-		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "jpeg_filter: failed to add new filter to filter chain for \"%s\"", value[0].data);
-		return NGX_CONF_ERROR;
+	ngx_queue_remove(&ctx->limit_queue);
+
+	if(ev->timer_set) {
+		ngx_del_timer(ev);
 	}
 
-	ngx_memzero(fe, sizeof(ngx_http_jpeg_filter_element_t));
+	r->main->blocked--;
+	r->aio = 0;
 
-	if(cf->args->nelts == 2) {
-		fe->type = NGX_HTTP_JPEG_FILTER_TYPE_EFFECT1;
+	r->connection->buffered &= ~NGX_HTTP_IMAGE_BUFFERED;
 
-		/* Get the effect name as complex value */
-		ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+	/* This will call the body filter again without any data */
+	r->write_event_handler(r);
 
-		ccv.cf = cf;
-		ccv.value = &value[1];
-		ccv.complex_value = &fe->cv1;
-		ccv.zero = 1;
+	ngx_http_run_posted_requests(c);
+}
 
-		if(ngx_http_compile_complex_value(&ccv) != NGX_OK) {
-			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "jpeg_filter: failed to compile complex value \"%s %s\"", value[0].data, value[1].data);
-			return NGX_CONF_ERROR;
-		}
-	}
-	else if(cf->args->nelts == 3) {
-		fe->type = NGX_HTTP_JPEG_FILTER_TYPE_EFFECT2;
+/* The request has not been admitted. Pass on the original image or respond with 503 */
+static ngx_int_t ngx_http_jpeg_filter_shed(ngx_http_request_t *r, ngx_http_jpeg_filter_ctx_t *ctx, ngx_chain_t *in) {
+	ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "jpeg_filter: limit exceeded");
 
-		/* Get the effect name as complex value */
-		ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+	ngx_http_jpeg_filter_count(ctx, NGX_HTTP_JPEG_FILTER_RESULT_LIMITED);
 
-		ccv.cf = cf;
-		ccv.value = &value[1];
-		ccv.complex_value = &fe->cv1;
-		ccv.zero = 1;
+	if(ctx->conf->graceful == 0) {
+		return ngx_http_filter_finalize_request(r, &ngx_http_jpeg_filter_module, NGX_HTTP_SERVICE_UNAVAILABLE);
+	}
 
-		if(ngx_http_compile_complex_value(&ccv) != NGX_OK) {
-			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "jpeg_filter: failed to compile complex value for \"%s %s %s\"", value[0].data, value[1].data, value[2].data);
-			return NGX_CONF_ERROR;
-		}
+	/* Nothing has been buffered yet. Send the header and pass on the data */
+	ctx->phase = NGX_HTTP_JPEG_FILTER_PHASE_PASS;
 
-		/* Get the effect value as complex value */
-		ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+	ngx_http_next_header_filter(r);
+	return ngx_http_next_body_filter(r, in);
+}
 
-		ccv.cf = cf;
-		ccv.value = &value[2];
-		ccv.complex_value = &fe->cv2;
-		ccv.zero = 1;
+/* Give back what an admitted request has reserved and let the queued requests of this worker try again */
+static void ngx_http_jpeg_filter_release(void *data) {
+	ngx_queue_t                 *q;
+	ngx_http_jpeg_filter_ctx_t  *ctx = data, *waiting;
 
-		if(ngx_http_compile_complex_value(&ccv) != NGX_OK) {
-			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "jpeg_filter: failed to compile complex value for \"%s %s %s\"", value[0].data, value[1].data, value[2].data);
-			return NGX_CONF_ERROR;
-		}
+	if(ctx->limit_event.timer_set) {
+		ngx_del_timer(&ctx->limit_event);
 	}
 
-	return NGX_CONF_OK;
-}
+	if(ctx->limit_event.posted) {
+		ngx_delete_posted_event(&ctx->limit_event);
+	}
 
-/* Process the "jpeg_filter_dropon*" configuration directives */
-static char *ngx_conf_jpeg_filter_dropon(ngx_conf_t *cf, ngx_command_t *cmd, void *c) {
-	ngx_http_jpeg_filter_conf_t *conf = c;
+	if(ctx->limit_state == NGX_HTTP_JPEG_FILTER_LIMIT_QUEUED) {
+		ngx_queue_remove(&ctx->limit_queue);
+	}
 
-	ngx_str_t                         *value;
-	ngx_http_compile_complex_value_t   ccv;
-	ngx_http_jpeg_filter_element_t    *fe;
+	if(ctx->limit_state != NGX_HTTP_JPEG_FILTER_LIMIT_ADMITTED) {
+		return;
+	}
 
-	ngx_log_debug0(NGX_LOG_DEBUG_CORE, cf->log, 0, "jpeg_filter: ngx_conf_jpeg_filter_dropon");
+	(void) ngx_atomic_fetch_add(&ctx->limit->memory, -(ngx_atomic_int_t)ctx->limit_memory);
+	(void) ngx_atomic_fetch_add(&ctx->limit->concurrent, -1);
 
-	value = cf->args->elts;
+	ctx->limit_state = NGX_HTTP_JPEG_FILTER_LIMIT_NONE;
 
-	/* Initialize the processing chain */
-	if(conf->filter_elements == NULL) {
-		conf->filter_elements = ngx_array_create(cf->pool, 10, sizeof(ngx_http_jpeg_filter_element_t));
-		if(conf->filter_elements == NULL) {
-			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "jpeg_filter: failed to create filter chain");
-			return NGX_CONF_ERROR;
+	/* The queued requests of other workers only find out with their timers */
+	for(q = ngx_queue_head(&ngx_http_jpeg_filter_waiting); q != ngx_queue_sentinel(&ngx_http_jpeg_filter_waiting); q = ngx_queue_next(q)) {
+		waiting = ngx_queue_data(q, ngx_http_jpeg_filter_ctx_t, limit_queue);
+
+		if(!waiting->limit_event.posted) {
+			ngx_post_event(&waiting->limit_event, &ngx_posted_events);
 		}
 	}
 
-	/* Add a new element to the processing chain */
-	fe = (ngx_http_jpeg_filter_element_t *)ngx_array_push(conf->filter_elements);
-	if(fe == NULL) {
-		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "jpeg_filter: failed to add new filter to filter chain (%s)", value[0].data);
-		return NGX_CONF_ERROR;
+	return;
+}
+
+/*
+ * Initialize the shared memory zone for jpeg_filter_limit. The counters are kept if the
+ * configuration is reloaded, because the requests of the old workers still hold their reservations.
+ */
+static ngx_int_t ngx_http_jpeg_filter_limit_init_zone(ngx_shm_zone_t *shm_zone, void *data) {
+	ngx_slab_pool_t  *shpool;
+
+	if(data != NULL) {
+		shm_zone->data = data;
+		return NGX_OK;
 	}
 
-	ngx_memzero(fe, sizeof(ngx_http_jpeg_filter_element_t));
+	shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+	if(shm_zone->shm.exists) {
+		shm_zone->data = shpool->data;
+		return NGX_OK;
+	}
+
+	shm_zone->data = ngx_slab_calloc(shpool, sizeof(ngx_http_jpeg_filter_limit_t));
+	if(shm_zone->data == NULL) {
+		return NGX_ERROR;
+	}
+
+	shpool->data = shm_zone->data;
+
+	return NGX_OK;
+}
+
+/* Get the metrics of the location, NULL if metrics are not collected */
+static ngx_http_jpeg_filter_metrics_t *ngx_http_jpeg_filter_get_metrics(ngx_http_request_t *r, ngx_http_jpeg_filter_conf_t *conf) {
+	ngx_http_jpeg_filter_main_conf_t  *mcf;
+
+	mcf = ngx_http_get_module_main_conf(r, ngx_http_jpeg_filter_module);
+
+	if(mcf->status_zone == NULL || mcf->status_zone->data == NULL || conf->metrics == NGX_CONF_UNSET_UINT) {
+		return NULL;
+	}
+
+	return (ngx_http_jpeg_filter_metrics_t *)mcf->status_zone->data + conf->metrics;
+}
+
+/* Remember the result of the response and count it */
+static void ngx_http_jpeg_filter_count(ngx_http_jpeg_filter_ctx_t *ctx, ngx_uint_t result) {
+	ctx->result = result;
+	ctx->result_set = 1;
+
+	if(ctx->metrics != NULL) {
+		(void) ngx_atomic_fetch_add(&ctx->metrics->responses[result], 1);
+	}
+
+	return;
+}
+
+/* Remember the time spent in a stage and add it to the histogram of the stage. This may be called from a thread */
+static void ngx_http_jpeg_filter_observe(ngx_http_jpeg_filter_ctx_t *ctx, ngx_uint_t stage, ngx_uint_t usec) {
+	ngx_uint_t                       i;
+	ngx_http_jpeg_filter_metrics_t  *m;
+
+	ctx->usec[stage] = usec;
+	ctx->timed |= (1 << stage);
+
+	m = ctx->metrics;
+	if(m == NULL) {
+		return;
+	}
+
+	for(i = 0; i < NGX_HTTP_JPEG_FILTER_BUCKETS; i++) {
+		if(usec <= ngx_http_jpeg_filter_bucket_usec[i]) {
+			break;
+		}
+	}
+
+	(void) ngx_atomic_fetch_add(&m->stage_buckets[stage][i], 1);
+	(void) ngx_atomic_fetch_add(&m->stage_usec[stage], usec);
+
+	return;
+}
+
+/* Monotonic time in microseconds. ngx_current_msec is too coarse and isn't updated in threads */
+static ngx_uint_t ngx_http_jpeg_filter_usec(void) {
+	struct timespec  ts;
+
+	if(clock_gettime(CLOCK_MONOTONIC, &ts) == -1) {
+		return 0;
+	}
+
+	return (ngx_uint_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Estimate the time for processing the image in microseconds from the number of samples found in
+ * the frame header. The cost per million samples is learned for each location and kind of image
+ * from the images processed so far by this worker. Until then it is a rough guess.
+ */
+static ngx_uint_t ngx_http_jpeg_filter_estimate(ngx_http_jpeg_filter_ctx_t *ctx) {
+	ngx_uint_t  class, cost = 0;
+
+	class = ctx->progressive | (ctx->arithmetic << 1);
+
+	if(ngx_http_jpeg_filter_cost != NULL && ctx->conf->metrics != NGX_CONF_UNSET_UINT) {
+		cost = ngx_http_jpeg_filter_cost[ctx->conf->metrics * NGX_HTTP_JPEG_FILTER_COST_CLASSES + class];
+	}
+
+	if(cost == 0) {
+		/* Decoding progressive scans and arithmetic coding are considerably more expensive */
+		cost = NGX_HTTP_JPEG_FILTER_COST_SEED * (ctx->progressive ? 3 : 1) * (ctx->arithmetic ? 2 : 1);
+	}
+
+	return (ngx_uint_t)((uint64_t)cost * ctx->samples / 1000000);
+}
+
+/* Feed the time in microseconds it took to process the image back into the cost model */
+static void ngx_http_jpeg_filter_learn(ngx_http_jpeg_filter_ctx_t *ctx, ngx_uint_t usec) {
+	ngx_uint_t  *cost, measured;
+
+	if(ngx_http_jpeg_filter_cost == NULL || ctx->conf->metrics == NGX_CONF_UNSET_UINT || ctx->samples == 0) {
+		return;
+	}
+
+	measured = (ngx_uint_t)((uint64_t)usec * 1000000 / ctx->samples);
+	if(measured == 0) {
+		measured = 1;
+	}
+
+	cost = &ngx_http_jpeg_filter_cost[ctx->conf->metrics * NGX_HTTP_JPEG_FILTER_COST_CLASSES + (ctx->progressive | (ctx->arithmetic << 1))];
+
+	if(*cost == 0) {
+		*cost = measured;
+	}
+	else {
+		*cost = (*cost * (NGX_HTTP_JPEG_FILTER_COST_WEIGHT - 1) + measured) / NGX_HTTP_JPEG_FILTER_COST_WEIGHT;
+	}
+
+	ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ctx->log, 0, "jpeg_filter: measured %uius per million samples, cost of location %ui is now %ui", measured, ctx->conf->metrics, *cost);
+
+	return;
+}
+
+/*
+ * Whether processing the image since start took longer than the time budget. libmodjpeg can't be
+ * interrupted, so this is checked between the stages and the elements of the processing chain.
+ * This may be called from a thread.
+ */
+static ngx_uint_t ngx_http_jpeg_filter_over_budget(ngx_http_jpeg_filter_ctx_t *ctx, ngx_uint_t start, const char *what) {
+	ngx_uint_t  elapsed;
+
+	if(ctx->conf->time_budget == 0) {
+		return 0;
+	}
+
+	elapsed = ngx_http_jpeg_filter_usec() - start;
+
+	if(elapsed <= ctx->conf->time_budget * 1000) {
+		return 0;
+	}
+
+	ngx_log_error(NGX_LOG_WARN, ctx->log, 0, "jpeg_filter: time budget of %Mms exceeded after %uims before %s", ctx->conf->time_budget, elapsed / 1000, what);
+
+	ctx->over_budget = elapsed;
+
+	return 1;
+}
+
+/*
+ * Estimate the memory for processing the image: the buffer for the original image, the buffer for the processed
+ * image, and, unless the image is transcoded, the coefficients of the decoded image with 2 bytes per sample.
+ * This may be called from a thread.
+ */
+static size_t ngx_http_jpeg_filter_memory(ngx_http_jpeg_filter_ctx_t *ctx, ngx_uint_t decode) {
+	size_t  size, memory;
+
+	size = (ctx->length != 0) ? ctx->length : (size_t)(ctx->in_last - ctx->in_image);
+
+	memory = size + size + size / 4 + NGX_HTTP_JPEG_FILTER_OUTPUT_SLACK;
+
+	if(decode == 1) {
+		memory += ctx->samples * 2;
+	}
+
+	return memory;
+}
+
+/*
+ * Choose the options for encoding the processed image. An automatic coding is used for images with
+ * at least auto_pixel pixel and auto_size bytes as long as it pays off. Some of the images are encoded
+ * with and without it in order to find out whether it does.
+ */
+static void ngx_http_jpeg_filter_coding(ngx_http_jpeg_filter_ctx_t *ctx) {
+	int                            option;
+	ngx_uint_t                     i, mode;
+	ngx_http_jpeg_filter_conf_t   *conf = ctx->conf;
+	ngx_http_jpeg_filter_coding_t *c;
+
+	ctx->options = 0;
+	ctx->probe = 0;
+	ctx->coded = 1;
+
+	if(conf->arithmetric == 1) {
+		ctx->options |= MJ_OPTION_ARITHMETRIC;
+	}
+
+	/* Progressive comes first because libjpeg always optimizes the Huffman tables of progressive images */
+	for(i = NGX_HTTP_JPEG_FILTER_CODINGS; i-- > 0; /* void */) {
+		if(i == NGX_HTTP_JPEG_FILTER_CODING_PROGRESSIVE) {
+			mode = conf->progressive;
+			option = MJ_OPTION_PROGRESSIVE;
+		}
+		else {
+			mode = conf->optimize;
+			option = MJ_OPTION_OPTIMIZE;
+		}
+
+		if(mode == 1) {
+			ctx->options |= option;
+			continue;
+		}
+
+		if(mode != NGX_HTTP_JPEG_FILTER_AUTO) {
+			continue;
+		}
+
+		/* There are no Huffman tables to optimize */
+		if(option == MJ_OPTION_OPTIMIZE && (ctx->options & (MJ_OPTION_PROGRESSIVE|MJ_OPTION_ARITHMETRIC)) != 0) {
+			continue;
+		}
+
+		if(ctx->width * ctx->height < conf->auto_pixel || (size_t)(ctx->in_last - ctx->in_image) < conf->auto_size) {
+			continue;
+		}
+
+		if(ngx_http_jpeg_filter_codings_payoff == NULL || conf->metrics == NGX_CONF_UNSET_UINT) {
+			ctx->options |= option;
+			continue;
+		}
+
+		c = &ngx_http_jpeg_filter_codings_payoff[conf->metrics * NGX_HTTP_JPEG_FILTER_CODINGS + i];
+
+		c->images++;
+
+		if(ctx->probe == 0 && (c->probes < NGX_HTTP_JPEG_FILTER_CODING_WARMUP || c->images % NGX_HTTP_JPEG_FILTER_CODING_PROBE == 0)) {
+			ctx->probe = option;
+		}
+
+		if(c->off == 0 || ctx->probe == option) {
+			ctx->options |= option;
+		}
+	}
+
+	ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ctx->log, 0, "jpeg_filter: coding options %d, probing %d", ctx->options, ctx->probe);
+
+	return;
+}
+
+/* Feed the result of a probe back into the payoff of the coding */
+static void ngx_http_jpeg_filter_payoff(ngx_http_jpeg_filter_ctx_t *ctx) {
+	ngx_uint_t                     off;
+	ngx_http_jpeg_filter_conf_t   *conf = ctx->conf;
+	ngx_http_jpeg_filter_coding_t *c;
+
+	if(ctx->probed == 0 || ngx_http_jpeg_filter_codings_payoff == NULL || conf->metrics == NGX_CONF_UNSET_UINT) {
+		return;
+	}
+
+	c = &ngx_http_jpeg_filter_codings_payoff[conf->metrics * NGX_HTTP_JPEG_FILTER_CODINGS + ((ctx->probe == MJ_OPTION_PROGRESSIVE) ? NGX_HTTP_JPEG_FILTER_CODING_PROGRESSIVE : NGX_HTTP_JPEG_FILTER_CODING_OPTIMIZE)];
+
+	if(c->probes == 0) {
+		c->saved = ctx->probe_saved;
+		c->usec = ctx->probe_usec;
+	}
+	else {
+		c->saved = (c->saved * (NGX_HTTP_JPEG_FILTER_COST_WEIGHT - 1) + ctx->probe_saved) / NGX_HTTP_JPEG_FILTER_COST_WEIGHT;
+		c->usec = (c->usec * (NGX_HTTP_JPEG_FILTER_COST_WEIGHT - 1) + ctx->probe_usec) / NGX_HTTP_JPEG_FILTER_COST_WEIGHT;
+	}
+
+	c->probes++;
+
+	if(c->probes < NGX_HTTP_JPEG_FILTER_CODING_WARMUP) {
+		return;
+	}
+
+	/* It doesn't pay off if it doesn't save enough bytes per millisecond it costs */
+	off = (c->saved <= 0 || (c->usec > 0 && (ngx_uint_t)c->saved * 1000 < conf->auto_gain * (ngx_uint_t)c->usec)) ? 1 : 0;
+
+	if(off != c->off) {
+		ngx_log_error(NGX_LOG_INFO, ctx->log, 0, "jpeg_filter: turning %s %s, saving %i bytes for %ius of encoding", off ? "off" : "on", (ctx->probe == MJ_OPTION_PROGRESSIVE) ? "progressive" : "optimize", c->saved, c->usec);
+	}
+
+	c->off = off;
+
+	return;
+}
+
+static void ngx_http_jpeg_filter_unbuffer(void *data) {
+	ngx_http_jpeg_filter_ctx_t *ctx = data;
+
+	(void) ngx_atomic_fetch_add(&ctx->metrics->buffered, -(ngx_atomic_int_t)ctx->buffered);
+
+	return;
+}
+
+/* Test the incoming data if we can and should handle it */
+static ngx_uint_t ngx_http_jpeg_filter_test(ngx_http_request_t *r, ngx_http_jpeg_filter_ctx_t *ctx, ngx_chain_t *in) {
+	u_char     *p;
+	ngx_buf_t  *b;
+
+	ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "jpeg_filter: ngx_http_jpeg_filter_test");
+
+	/*
+	 * Checking if we have enough data available such that we can
+	 * decide if we can and should handle it.
+	 */
+	b = in->buf;
+
+	/* The copy filter has read files into memory */
+	if(!ngx_buf_in_memory(b)) {
+		return NGX_HTTP_IMAGE_NONE;
+	}
+
+	p = b->pos;
+
+	if(b->last - p < 16) {
+		return NGX_HTTP_IMAGE_NONE;
+	}
+
+	ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "jpeg_filter: \"%02xd%02xd\"", p[0], p[1]);
+
+	/* Check for JPEG signature */
+	if(p[0] == 0xff && p[1] == 0xd8) { /* JPEG */
+		return NGX_HTTP_IMAGE_JPEG;
+	}
+
+	return NGX_HTTP_IMAGE_NONE;
+}
+
+/*
+ * Scan the markers of the buffered original image up to the frame header (SOFn) in order to
+ * learn about the image before it has been read completely. Scanning continues where it stopped
+ * the last time. Returns NGX_AGAIN if more data is needed and NGX_DECLINED if the image should
+ * not be processed because it is garbage, it is too big, or libjpeg can't decode it.
+ */
+static ngx_int_t ngx_http_jpeg_filter_scan(ngx_http_jpeg_filter_ctx_t *ctx) {
+	u_char      *p, marker;
+	size_t       offset, size, len, memory;
+	ngx_uint_t   precision, i, h[4], v[4], hmax = 1, vmax = 1, estimate, decode;
+
+	size = ctx->in_last - ctx->in_image;
+
+	/* The SOI marker has been checked already */
+	offset = (ctx->scan_offset != 0) ? ctx->scan_offset : 2;
+
+	for(;;) {
+		ctx->scan_offset = offset;
+
+		if(offset + 2 > size) {
+			return NGX_AGAIN;
+		}
+
+		p = ctx->in_image + offset;
+
+		if(p[0] != 0xff) {
+			ngx_log_error(NGX_LOG_ERR, ctx->log, 0, "jpeg_filter: invalid marker at offset %uz", offset);
+			return NGX_DECLINED;
+		}
+
+		marker = p[1];
+
+		/* Any marker may be preceded by fill bytes */
+		if(marker == 0xff) {
+			offset++;
+			continue;
+		}
+
+		/* Markers without a segment */
+		if(marker == 0x01) {
+			offset += 2;
+			continue;
+		}
+
+		if(marker == 0x00 || (marker >= 0xd0 && marker <= 0xda)) {
+			/* Stuffed byte, RSTn, SOI, EOI, or SOS before the frame header */
+			ngx_log_error(NGX_LOG_ERR, ctx->log, 0, "jpeg_filter: unexpected marker 0x%02xd at offset %uz", marker, offset);
+			return NGX_DECLINED;
+		}
+
+		if(offset + 4 > size) {
+			return NGX_AGAIN;
+		}
+
+		len = (p[2] << 8) | p[3];
+
+		if(len < 2) {
+			ngx_log_error(NGX_LOG_ERR, ctx->log, 0, "jpeg_filter: invalid segment length at offset %uz", offset);
+			return NGX_DECLINED;
+		}
+
+		/* DHT, JPG, and DAC share the range of the SOFn markers */
+		if(marker < 0xc0 || marker > 0xcf || marker == 0xc4 || marker == 0xc8 || marker == 0xcc) {
+			offset += 2 + len;
+			continue;
+		}
+
+		/* The frame header: precision, height, width, and number of components */
+		if(len < 8) {
+			ngx_log_error(NGX_LOG_ERR, ctx->log, 0, "jpeg_filter: invalid frame header at offset %uz", offset);
+			return NGX_DECLINED;
+		}
+
+		if(offset + 10 > size) {
+			return NGX_AGAIN;
+		}
+
+		/* Followed by the id, the sampling factors, and the quantization table of each component */
+		if(len < 8 + 3 * (size_t)p[9]) {
+			ngx_log_error(NGX_LOG_ERR, ctx->log, 0, "jpeg_filter: invalid frame header at offset %uz", offset);
+			return NGX_DECLINED;
+		}
+
+		if(offset + 10 + 3 * (size_t)p[9] > size) {
+			return NGX_AGAIN;
+		}
+
+		precision = p[4];
+		ctx->height = (p[5] << 8) | p[6];
+		ctx->width = (p[7] << 8) | p[8];
+		ctx->components = p[9];
+		ctx->progressive = (marker == 0xc2 || marker == 0xca) ? 1 : 0;
+		ctx->arithmetic = (marker >= 0xc9) ? 1 : 0;
+		ctx->frame = 1;
+
+		ngx_log_debug5(NGX_LOG_DEBUG_HTTP, ctx->log, 0, "jpeg_filter: SOF%ui %uix%ui, %ui components, %ui bit", (ngx_uint_t)(marker - 0xc0), ctx->width, ctx->height, ctx->components, precision);
+
+		/* Only baseline, extended, and progressive DCT are supported by libjpeg, lossless and hierarchical are not */
+		if(marker != 0xc0 && marker != 0xc1 && marker != 0xc2 && marker != 0xc9 && marker != 0xca) {
+			ngx_log_error(NGX_LOG_ERR, ctx->log, 0, "jpeg_filter: unsupported coding process (SOF%ui)", (ngx_uint_t)(marker - 0xc0));
+			return NGX_DECLINED;
+		}
+
+		if(precision != 8) {
+			ngx_log_error(NGX_LOG_ERR, ctx->log, 0, "jpeg_filter: unsupported precision of %ui bit", precision);
+			return NGX_DECLINED;
+		}
+
+		/* A height of 0 means that it is defined later with a DNL marker, which libjpeg doesn't support */
+		if(ctx->width == 0 || ctx->height == 0 || ctx->components == 0 || ctx->components > 4) {
+			ngx_log_error(NGX_LOG_ERR, ctx->log, 0, "jpeg_filter: invalid frame header (%uix%ui, %ui components)", ctx->width, ctx->height, ctx->components);
+			return NGX_DECLINED;
+		}
+
+		if(ctx->conf->max_pixel != 0 && ctx->width * ctx->height > ctx->conf->max_pixel) {
+			ngx_log_error(NGX_LOG_ERR, ctx->log, 0, "jpeg_filter: image has too many pixel (%uix%ui)", ctx->width, ctx->height);
+			return NGX_DECLINED;
+		}
+
+		/* Components with lower sampling factors than the maximum are subsampled, e.g. the chroma of 4:2:0 */
+		for(i = 0; i < ctx->components; i++) {
+			h[i] = p[11 + 3 * i] >> 4;
+			v[i] = p[11 + 3 * i] & 0x0f;
+
+			if(h[i] < 1 || h[i] > 4 || v[i] < 1 || v[i] > 4) {
+				ngx_log_error(NGX_LOG_ERR, ctx->log, 0, "jpeg_filter: invalid sampling factors %uix%ui of component %ui", h[i], v[i], i);
+				return NGX_DECLINED;
+			}
+
+			hmax = ngx_max(hmax, h[i]);
+			vmax = ngx_max(vmax, v[i]);
+		}
+
+		ctx->samples = 0;
+
+		for(i = 0; i < ctx->components; i++) {
+			ctx->samples += ((ctx->width * h[i] + hmax - 1) / hmax) * ((ctx->height * v[i] + vmax - 1) / vmax);
+		}
+
+		if(ctx->conf->time_budget != 0) {
+			estimate = ngx_http_jpeg_filter_estimate(ctx);
+
+			if(estimate > ctx->conf->time_budget * 1000) {
+				ngx_log_error(NGX_LOG_WARN, ctx->log, 0, "jpeg_filter: processing the image (%uix%ui, %uz samples) is estimated to take %uims, exceeding the time budget of %Mms", ctx->width, ctx->height, ctx->samples, estimate / 1000, ctx->conf->time_budget);
+				return NGX_DECLINED;
+			}
+		}
+
+		if(ctx->conf->max_memory != 0) {
+			/* Whether the image will be transcoded is known only after the processing chain has been resolved */
+			decode = (ctx->conf->transcode == 0 || ctx->progressive == 1 || ctx->arithmetic == 1 || (ctx->components != 1 && ctx->components != 3));
+
+			if(ctx->length != 0) {
+				memory = ngx_http_jpeg_filter_memory(ctx, decode);
+			}
+			else {
+				/*
+				 * Only the beginning of the image has been received so far. The buffers are checked once
+				 * the image is complete, until then only the decoded image counts.
+				 */
+				memory = (decode == 1) ? ctx->samples * 2 : 0;
+			}
+
+			if(memory > ctx->conf->max_memory) {
+				ngx_log_error(NGX_LOG_WARN, ctx->log, 0, "jpeg_filter: processing the image (%uix%ui, %uz samples) needs about %uz bytes of memory, exceeding the limit of %uz bytes", ctx->width, ctx->height, ctx->samples, memory, ctx->conf->max_memory);
+				return NGX_DECLINED;
+			}
+		}
+
+		return NGX_OK;
+	}
+}
+
+/*
+ * Don't process the image. Either pass on the original image or send an error. The original image is
+ * either still in the chain in or it has been buffered already. In the latter case, last tells whether
+ * the buffer holds the whole body.
+ */
+static ngx_int_t ngx_http_jpeg_filter_reject(ngx_http_request_t *r, ngx_http_jpeg_filter_ctx_t *ctx, ngx_chain_t *in, ngx_uint_t last) {
+	ngx_int_t     rc;
+	ngx_buf_t    *b;
+	ngx_chain_t   out;
+
+	if(ctx->conf->graceful == 0) {
+		ngx_http_jpeg_filter_count(ctx, NGX_HTTP_JPEG_FILTER_RESULT_REJECTED);
+		return ngx_http_filter_finalize_request(r, &ngx_http_jpeg_filter_module, NGX_HTTP_UNSUPPORTED_MEDIA_TYPE);
+	}
+
+	ngx_http_jpeg_filter_count(ctx, NGX_HTTP_JPEG_FILTER_RESULT_GRACEFUL);
+
+	/* Whatever comes after will be passed through */
+	ctx->phase = NGX_HTTP_JPEG_FILTER_PHASE_PASS;
+
+	r->connection->buffered &= ~NGX_HTTP_IMAGE_BUFFERED;
+
+	rc = ngx_http_next_header_filter(r);
+
+	if(rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+		return NGX_ERROR;
+	}
+
+	if(in != NULL) {
+		return ngx_http_next_body_filter(r, in);
+	}
+
+	/* Send what we have buffered so far */
+	b = ngx_pcalloc(r->pool, sizeof(ngx_buf_t));
+	if(b == NULL) {
+		return NGX_ERROR;
+	}
+
+	b->pos = ctx->in_image;
+	b->last = ctx->in_last;
+	b->memory = 1;
+	b->last_buf = last;
+
+	out.buf = b;
+	out.next = NULL;
+
+	return ngx_http_next_body_filter(r, &out);
+}
+
+/*
+ * Whether the client has closed the connection. Nothing is sent to the client while the image is buffered or
+ * processed, i.e. a closed connection is only noticed by looking at the socket, the same way as
+ * ngx_http_upstream_check_broken_connection() does. This is only called by the worker, when the phase changes
+ * and from the read event.
+ */
+static ngx_uint_t ngx_http_jpeg_filter_gone(ngx_http_request_t *r) {
+	int                n;
+	char               buf[1];
+	ngx_err_t          err;
+	ngx_connection_t  *c = r->connection;
+
+	if(c->error) {
+		return 1;
+	}
+
+#if (NGX_HTTP_V2)
+	if(r->stream) {
+		/*
+		 * The socket belongs to all streams. A stream that is reset by the client, or a connection that is
+		 * closed, sets the error of the connection of the stream and calls its read event.
+		 */
+		return 0;
+	}
+#endif
+
+#if (NGX_HTTP_V3)
+	if(c->quic) {
+		/* A stream that is reset by the client has an error on its read event */
+		return c->read->error;
+	}
+#endif
+
+#if (NGX_HAVE_EPOLLRDHUP)
+	if((ngx_event_flags & NGX_USE_EPOLL_EVENT) && ngx_use_epoll_rdhup) {
+		return c->read->pending_eof;
+	}
+#endif
+
+	n = recv(c->fd, buf, 1, MSG_PEEK);
+
+	if(n > 0) {
+		/* A pipelined request */
+		return 0;
+	}
+
+	if(n == -1) {
+		err = ngx_socket_errno;
+
+		if(err == NGX_EAGAIN || err == NGX_EINTR) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/*
+ * Watch the read event of the connection while the image is buffered and processed. Only a request that doesn't
+ * read from the client anymore is watched, e.g. not while proxying, where the upstream module does the same.
+ */
+static ngx_int_t ngx_http_jpeg_filter_watch(ngx_http_request_t *r) {
+	if(r != r->main || r->read_event_handler != ngx_http_block_reading) {
+		return NGX_OK;
+	}
+
+	r->read_event_handler = ngx_http_jpeg_filter_read_event_handler;
+
+#if (NGX_HTTP_V2)
+	if(r->stream) {
+		return NGX_OK;
+	}
+#endif
+
+#if (NGX_HTTP_V3)
+	if(r->connection->quic) {
+		return NGX_OK;
+	}
+#endif
+
+	return ngx_handle_read_event(r->connection->read, 0);
+}
+
+/* Remember that the client is gone. A thread that processes the image only looks at the flag */
+static void ngx_http_jpeg_filter_read_event_handler(ngx_http_request_t *r) {
+	ngx_event_t                 *rev;
+	ngx_http_jpeg_filter_ctx_t  *ctx;
+
+	ctx = ngx_http_get_module_ctx(r, ngx_http_jpeg_filter_module);
+
+	if(ctx == NULL || ctx->skip == 1 || ctx->phase == NGX_HTTP_JPEG_FILTER_PHASE_PASS || ctx->phase == NGX_HTTP_JPEG_FILTER_PHASE_DISCARD || ctx->phase == NGX_HTTP_JPEG_FILTER_PHASE_DONE) {
+		/* Nothing to watch anymore */
+		r->read_event_handler = ngx_http_block_reading;
+		ngx_http_block_reading(r);
+		return;
+	}
+
+	if(ctx->gone == 0 && ngx_http_jpeg_filter_gone(r)) {
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "jpeg_filter: client is gone");
+
+		ctx->gone = 1;
+	}
+
+	/* A level triggered event would fire over and over again for a pipelined request or a closed connection */
+	rev = r->connection->read;
+
+	if((ngx_event_flags & NGX_USE_LEVEL_EVENT) && rev->active) {
+		if(ngx_del_event(rev, NGX_READ_EVENT, 0) != NGX_OK) {
+			ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+		}
+	}
+}
+
+/*
+ * Whether the client has gone away, such that processing the image can stop before the next stage or element of
+ * the processing chain. libmodjpeg can't be interrupted, so this is checked in between, like the time budget.
+ * This may run in a thread, so it only reads the flag that the worker sets.
+ */
+static ngx_uint_t ngx_http_jpeg_filter_abandoned(ngx_http_jpeg_filter_ctx_t *ctx, const char *what) {
+	if(ctx->gone == 0) {
+		return 0;
+	}
+
+	ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->log, 0, "jpeg_filter: client is gone before %s", what);
+
+	ctx->aborted = 1;
+
+	return 1;
+}
+
+/*
+ * The client is gone while the image is buffered, queued, or processed. Throw away the rest of the body and give back the buffers right away
+ * instead of when the request is done. The request is finalized with 499 like the upstream module does.
+ */
+static ngx_int_t ngx_http_jpeg_filter_abort(ngx_http_request_t *r, ngx_http_jpeg_filter_ctx_t *ctx, ngx_chain_t *in, const char *what) {
+	ngx_http_jpeg_filter_aborts++;
+
+	ngx_log_error(NGX_LOG_INFO, r->connection->log, 0, "jpeg_filter: client closed connection while %s the image, dropped it (%ui images dropped by this worker)", what, ngx_http_jpeg_filter_aborts);
+
+	ngx_http_jpeg_filter_count(ctx, NGX_HTTP_JPEG_FILTER_RESULT_ABORTED);
+
+	ngx_http_jpeg_filter_discard(in);
+
+	ctx->phase = NGX_HTTP_JPEG_FILTER_PHASE_DONE;
+
+	r->connection->buffered &= ~NGX_HTTP_IMAGE_BUFFERED;
+
+	/* Only an image that didn't fit into the buffer from the pool has been allocated by the encoder */
+	if(ctx->out_image != NULL && ctx->out_image != ctx->out_buffer) {
+		free(ctx->out_image);
+	}
+
+	ctx->out_image = NULL;
+	ctx->out_last = NULL;
+
+	if(ctx->out_buffer != NULL) {
+		ngx_http_jpeg_filter_arena_free(r, ctx->out_buffer);
+		ctx->out_buffer = NULL;
+	}
+
+	/* A borrowed buffer belongs to the body */
+	if(ctx->in_image != NULL && ctx->in_borrowed == 0) {
+		ngx_http_jpeg_filter_arena_free(r, ctx->in_image);
+
+		ctx->in_image = NULL;
+		ctx->in_last = NULL;
+		ctx->in_end = NULL;
+	}
+
+	r->headers_out.status = NGX_HTTP_CLIENT_CLOSED_REQUEST;
+
+	/* NGX_ERROR finalizes the request */
+	return NGX_ERROR;
+}
+
+/* Read several buffer chains and store the data in a buffer */
+static ngx_int_t ngx_http_jpeg_filter_read(ngx_http_request_t *r, ngx_chain_t *in) {
+	u_char				*p;
+	size_t				size, rest;
+	ngx_buf_t			*b;
+	ngx_chain_t			*cl;
+	ngx_http_jpeg_filter_ctx_t	*ctx;
+
+	ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "jpeg_filter: ngx_http_jpeg_filter_read");
+
+	/* Get our context for this request */
+	ctx = ngx_http_get_module_ctx(r, ngx_http_jpeg_filter_module);
+
+	/* If we didn't allocate yet memory for the image, we do it now */
+	if(ctx->in_image == NULL) {
+		/* We found out the size of the buffer in the header filter */
+		if(ngx_http_jpeg_filter_grow(r, ctx, ctx->length) != NGX_OK) {
+			return NGX_ERROR;
+		}
+	}
+
+	p = ctx->in_last;
+
+	/* Copying the data from the buffer chain into out buffer */
+	for(cl = in; cl; cl = cl->next) {
+		b = cl->buf;
+		size = ngx_buf_size(b);
+
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "jpeg_filter buf: %uz", size);
+
+		rest = ctx->in_end - p;
+
+		if(size > rest) {
+			ctx->in_last = p;
+
+			if(ngx_http_jpeg_filter_grow(r, ctx, (p - ctx->in_image) + size) != NGX_OK) {
+				return NGX_ERROR;
+			}
+
+			p = ctx->in_last;
+		}
+
+		p = ngx_cpymem(p, b->pos, size);
+		b->pos += size;
+
+		if (b->last_buf) {
+			ctx->in_last = p;
+
+			/* If this was the last buffer chain, we're done */
+			return NGX_OK;
+		}
+	}
+
+	ctx->in_last = p;
+
+	/* This should be probably done, but no clue what it actually means */
+	r->connection->buffered |= NGX_HTTP_IMAGE_BUFFERED;
+
+	/* This wasn't the las buffer chain. Tell the caller that we're expecting more */
+	return NGX_AGAIN;
+}
+
+/* Make room for at least len bytes of the original image. The buffer grows by doubling its size up to jpeg_filter_buffer */
+static ngx_int_t ngx_http_jpeg_filter_grow(ngx_http_request_t *r, ngx_http_jpeg_filter_ctx_t *ctx, size_t len) {
+	u_char  *p;
+	size_t   size, reserved;
+
+	if(len > ctx->conf->buffer_size) {
+		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "jpeg_filter: too big response");
+		return NGX_ERROR;
+	}
+
+	size = ctx->in_end - ctx->in_image;
+
+	if(size == 0) {
+		/* Start with the announced length or with a small buffer if the length is not known */
+		size = (ctx->length != 0) ? ctx->length : NGX_HTTP_JPEG_FILTER_BUFFER_INITIAL;
+	}
+
+	/* The first buffer has been reserved for jpeg_filter_limit on admission, see ngx_http_jpeg_filter_admit() */
+	reserved = size;
+
+	while(size < len) {
+		size *= 2;
+	}
+
+	if(size > ctx->conf->buffer_size) {
+		size = ctx->conf->buffer_size;
+	}
+
+	if(size > reserved) {
+		/* Add the growth and its share of the processed image */
+		(void) ngx_http_jpeg_filter_reserve(ctx, 0, (size - reserved) + (size - reserved) / 4);
+	}
+
+	ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "jpeg_filter: growing buffer from %uz to %uz bytes", ctx->in_end - ctx->in_image, size);
+
+	p = ngx_http_jpeg_filter_arena_alloc(r, size);
+	if(p == NULL) {
+		return NGX_ERROR;
+	}
+
+	if(ctx->metrics != NULL) {
+		if(ctx->buffered == 0) {
+			/* The buffer is accounted for until the request is done */
+			ngx_pool_cleanup_t  *cln;
+
+			cln = ngx_pool_cleanup_add(r->pool, 0);
+			if(cln == NULL) {
+				return NGX_ERROR;
+			}
+
+			cln->handler = ngx_http_jpeg_filter_unbuffer;
+			cln->data = ctx;
+		}
+
+		(void) ngx_atomic_fetch_add(&ctx->metrics->buffered, (ngx_atomic_int_t)(size - ctx->buffered));
+		ctx->buffered = size;
+	}
+
+	if(ctx->in_image != NULL) {
+		ngx_memcpy(p, ctx->in_image, ctx->in_last - ctx->in_image);
+
+		/* Large allocations are given back to the system or to the arena */
+		ngx_http_jpeg_filter_arena_free(r, ctx->in_image);
+	}
+
+	ctx->in_last = p + (ctx->in_last - ctx->in_image);
+	ctx->in_image = p;
+	ctx->in_end = p + size;
+
+	return NGX_OK;
+}
+
+/*
+ * Use the buffer of the body as it is if it holds the whole body, e.g. a static file that the copy filter
+ * has read into a single buffer. This saves copying the image into a buffer of our own. The buffer lives
+ * as long as the request. NGX_DECLINED means that the body has to be read.
+ */
+static ngx_int_t ngx_http_jpeg_filter_borrow(ngx_http_request_t *r, ngx_http_jpeg_filter_ctx_t *ctx, ngx_chain_t *in) {
+	size_t      size;
+	ngx_buf_t  *b;
+
+	b = in->buf;
+
+	if(in->next != NULL || !b->last_buf || !ngx_buf_in_memory(b)) {
+		return NGX_DECLINED;
+	}
+
+	size = b->last - b->pos;
+
+	/* Let the reading phase complain about too big responses */
+	if(size > ctx->conf->buffer_size) {
+		return NGX_DECLINED;
+	}
+
+	ctx->in_image = b->pos;
+	ctx->in_last = b->last;
+	ctx->in_end = b->last;
+	ctx->in_borrowed = 1;
+
+	ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "jpeg_filter: using the buffer of the body (%uz bytes)", size);
+
+	return NGX_OK;
+}
+
+/* Mark all data in the buffer chains as consumed */
+static void ngx_http_jpeg_filter_discard(ngx_chain_t *in) {
+	ngx_chain_t  *cl;
+
+	for(cl = in; cl; cl = cl->next) {
+		cl->buf->pos = cl->buf->last;
+		cl->buf->file_pos = cl->buf->file_last;
+	}
+
+	return;
+}
+
+/* Process the image */
+static ngx_int_t ngx_http_jpeg_filter_process(ngx_http_request_t *r) {
+	ngx_http_jpeg_filter_ctx_t   *ctx;
+	ngx_pool_cleanup_t           *cln;
+#if (NGX_THREADS)
+	ngx_int_t                     rc;
+#endif
+
+	ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "jpeg_filter: ngx_http_jpeg_filter_process");
+
+	/* No clue that this actually does. Copied from image filter module */
+	r->connection->buffered &= ~NGX_HTTP_IMAGE_BUFFERED;
+
+	/* Get our context for this request */
+	ctx = ngx_http_get_module_ctx(r, ngx_http_jpeg_filter_module);
+	if(ctx->in_image == NULL) {
+		/* No data available. Bail out */
+		return NGX_ERROR;
+	}
+
+	/*
+	 * Add a cleanup routine for the allocated buffer that holds
+	 * the modified image. We can only destroy it safely after it has been send.
+	 */
+	cln = ngx_pool_cleanup_add(r->pool, 0);
+	if(cln == NULL) {
+		return NGX_ERROR;
+	}
+
+	cln->handler = ngx_http_jpeg_filter_cleanup;
+	cln->data = ctx;
+
+	/*
+	 * Offer the encoder a buffer from the pool that is most probably large enough for
+	 * the processed image. libjpeg's memory destination only resorts to malloc() and
+	 * copying if the image doesn't fit. This has to happen here because the pool
+	 * can't be used in a thread.
+	 */
+	ctx->out_size = (ctx->in_last - ctx->in_image) + (ctx->in_last - ctx->in_image) / 4 + NGX_HTTP_JPEG_FILTER_OUTPUT_SLACK;
+
+	ctx->out_buffer = ngx_http_jpeg_filter_arena_alloc(r, ctx->out_size);
+	if(ctx->out_buffer == NULL) {
+		return NGX_ERROR;
+	}
+
+	/*
+	 * Evaluate the complex values of the processing chain. This has to happen here
+	 * because the variables can't be evaluated in a thread.
+	 */
+	if(ngx_http_jpeg_filter_resolve(r, ctx) != NGX_OK) {
+		return NGX_ERROR;
+	}
+
+	/* The automatic codings depend on the image and on the state of this worker, so it is decided here */
+	ngx_http_jpeg_filter_coding(ctx);
+
+	if(ngx_http_jpeg_filter_noop(ctx) == 1) {
+		/* None of the automatic codings has been chosen and there is nothing else to do */
+		return NGX_DECLINED;
+	}
+
+	if(ngx_http_jpeg_filter_transcodable(r, ctx) != NGX_OK) {
+		return NGX_ERROR;
+	}
+
+	/* Now the image is complete and the size of the buffers is known, even without a Content-Length */
+	if(ctx->conf->max_memory != 0 && ngx_http_jpeg_filter_memory(ctx, ctx->transcoder == NULL) > ctx->conf->max_memory) {
+		ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "jpeg_filter: processing the image (%uix%ui, %uz samples) needs about %uz bytes of memory, exceeding the limit of %uz bytes", ctx->width, ctx->height, ctx->samples, ngx_http_jpeg_filter_memory(ctx, ctx->transcoder == NULL), ctx->conf->max_memory);
+		return NGX_ERROR;
+	}
+
+#if (NGX_THREADS)
+	if(ctx->conf->thread_pool != NULL) {
+		/* Large images may be transcoded by several threads */
+		rc = ngx_http_jpeg_filter_thread_split(r, ctx);
+		if(rc != NGX_DECLINED) {
+			return rc;
+		}
+
+		/* Hand the image over to a thread and don't block the worker */
+		return ngx_http_jpeg_filter_thread_post(r, ctx);
+	}
+#endif
+
+	return ngx_http_jpeg_filter_transform(ctx);
+}
+
+/* Evaluate the complex values of all elements in the processing chain */
+static ngx_int_t ngx_http_jpeg_filter_resolve(ngx_http_request_t *r, ngx_http_jpeg_filter_ctx_t *ctx) {
+	ngx_str_t                       *invalid;
+	ngx_uint_t                       i;
+	ngx_http_jpeg_filter_op_t       *ops;
+	ngx_http_jpeg_filter_element_t  *felts;
+	ngx_http_jpeg_filter_value_t    *values;
+
+	if(ctx->conf->filter_elements == NULL || ctx->conf->variables == 0 || ctx->ops != NULL) {
+		/* Nothing to evaluate, already resolved at configuration time, or already evaluated */
+		return NGX_OK;
+	}
+
+	values = ngx_pcalloc(r->pool, ctx->conf->filter_elements->nelts * sizeof(ngx_http_jpeg_filter_value_t));
+	if(values == NULL) {
+		return NGX_ERROR;
+	}
+
+	/* Start with the chain as resolved at configuration time and fill in the elements with variables */
+	ops = ngx_pnalloc(r->pool, ctx->conf->filter_elements->nelts * sizeof(ngx_http_jpeg_filter_op_t));
+	if(ops == NULL) {
+		return NGX_ERROR;
+	}
+
+	ngx_memcpy(ops, ctx->conf->ops, ctx->conf->filter_elements->nelts * sizeof(ngx_http_jpeg_filter_op_t));
+
+	felts = ctx->conf->filter_elements->elts;
+
+	for(i = 0; i < ctx->conf->filter_elements->nelts; i++) {
+		if(felts[i].variable == 0) {
+			/* Only the elements with variables need to be evaluated */
+			continue;
+		}
+
+		if(ngx_http_jpeg_filter_get_string_value(r, &felts[i].cv1, &values[i].val1) != NGX_OK) {
+			values[i].val1.data = NULL;
+		}
+
+		if(ngx_http_jpeg_filter_get_string_value(r, &felts[i].cv2, &values[i].val2) != NGX_OK) {
+			values[i].val2.data = NULL;
+		}
+
+		if(values[i].val1.data == NULL) {
+			ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "jpeg_filter: failed to evaluate value for filter element");
+			ops[i].op = NGX_HTTP_JPEG_FILTER_OP_NONE;
+			continue;
+		}
+
+		/* An empty value disables the element for this request */
+		if(values[i].val1.len == 0) {
+			ops[i].op = NGX_HTTP_JPEG_FILTER_OP_NONE;
+			continue;
+		}
+
+		/* Invalid values are ignored, but the valid parts of the element are still applied */
+		if(ngx_http_jpeg_filter_compile(felts[i].type, &values[i].val1, &values[i].val2, &ops[i], &invalid) != NGX_OK) {
+			ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "jpeg_filter: invalid value \"%V\" for filter element", invalid);
+		}
+	}
+
+	ngx_http_jpeg_filter_optimize(ops, ctx->conf->filter_elements->nelts);
+
+	ctx->values = values;
+	ctx->ops = ops;
+
+	return NGX_OK;
+}
+
+/*
+ * Check whether processing the image would not change it, i.e. the resolved processing chain doesn't
+ * contain any effects or dropons and the image would be encoded with the default options.
+ */
+static ngx_uint_t ngx_http_jpeg_filter_noop(ngx_http_jpeg_filter_ctx_t *ctx) {
+	ngx_uint_t                    i, nops;
+	ngx_http_jpeg_filter_op_t    *ops;
+	ngx_http_jpeg_filter_conf_t  *conf = ctx->conf;
+
+	if(ctx->coded == 1) {
+		/* The options have been chosen for the image */
+		if(ctx->options != 0) {
+			return 0;
+		}
+	}
+	else if(conf->optimize != 0 || conf->progressive != 0 || conf->arithmetric == 1) {
+		return 0;
+	}
+
+	if(conf->filter_elements == NULL) {
+		return 1;
+	}
+
+	ops = (ctx->ops != NULL) ? ctx->ops : conf->ops;
+	nops = conf->filter_elements->nelts;
+
+	for(i = 0; i < nops; i++) {
+		switch(ops[i].op) {
+			case NGX_HTTP_JPEG_FILTER_OP_NONE:
+			case NGX_HTTP_JPEG_FILTER_OP_ALIGN:
+			case NGX_HTTP_JPEG_FILTER_OP_OFFSET:
+				/* Alignment and offset alone don't change anything */
+				break;
+			default:
+				return 0;
+		}
+	}
+
+	return 1;
+}
+
+/*
+ * Resolve an element of the processing chain with the given values into an operation. A value with data
+ * NULL is not known yet and is not checked. Returns NGX_DECLINED and the offending value in invalid if a
+ * value is not valid for the element. The operation is filled in as far as possible anyways.
+ */
+static ngx_int_t ngx_http_jpeg_filter_compile(ngx_uint_t type, ngx_str_t *val1, ngx_str_t *val2, ngx_http_jpeg_filter_op_t *op, ngx_str_t **invalid) {
+	ngx_int_t  n, rc = NGX_OK;
+
+	ngx_memzero(op, sizeof(ngx_http_jpeg_filter_op_t));
+
+	switch(type) {
+		case NGX_HTTP_JPEG_FILTER_TYPE_EFFECT1:
+			if(val1->data == NULL) {
+				break;
+			}
+
+			if(ngx_strcmp(val1->data, "grayscale") == 0) {
+				op->op = NGX_HTTP_JPEG_FILTER_OP_GRAYSCALE;
+			}
+			else if(ngx_strcmp(val1->data, "pixelate") == 0) {
+				op->op = NGX_HTTP_JPEG_FILTER_OP_PIXELATE;
+			}
+			else {
+				*invalid = val1;
+				rc = NGX_DECLINED;
+			}
+
+			break;
+		case NGX_HTTP_JPEG_FILTER_TYPE_EFFECT2:
+			if(!ngx_http_jpeg_filter_is_int_value(val2)) {
+				*invalid = val2;
+				rc = NGX_DECLINED;
+			}
+
+			n = ngx_http_jpeg_filter_get_int_value(val2, 0);
+			if(n < 0) {
+				n = 0;
+			}
+
+			if(val1->data == NULL) {
+				break;
+			}
+
+			if(ngx_strcmp(val1->data, "brighten") == 0) {
+				op->op = NGX_HTTP_JPEG_FILTER_OP_LUMINANCE;
+				op->arg1 = n;
+			}
+			else if(ngx_strcmp(val1->data, "darken") == 0) {
+				op->op = NGX_HTTP_JPEG_FILTER_OP_LUMINANCE;
+				op->arg1 = -n;
+			}
+			else if(ngx_strcmp(val1->data, "tintblue") == 0) {
+				op->op = NGX_HTTP_JPEG_FILTER_OP_TINT;
+				op->arg1 = n;
+			}
+			else if(ngx_strcmp(val1->data, "tintyellow") == 0) {
+				op->op = NGX_HTTP_JPEG_FILTER_OP_TINT;
+				op->arg1 = -n;
+			}
+			else if(ngx_strcmp(val1->data, "tintred") == 0) {
+				op->op = NGX_HTTP_JPEG_FILTER_OP_TINT;
+				op->arg2 = n;
+			}
+			else if(ngx_strcmp(val1->data, "tintgreen") == 0) {
+				op->op = NGX_HTTP_JPEG_FILTER_OP_TINT;
+				op->arg2 = -n;
+			}
+			else {
+				op->op = NGX_HTTP_JPEG_FILTER_OP_NONE;
+				*invalid = val1;
+				rc = NGX_DECLINED;
+			}
+
+			break;
+		case NGX_HTTP_JPEG_FILTER_TYPE_DROPON_ALIGN:
+			op->op = NGX_HTTP_JPEG_FILTER_OP_ALIGN;
+
+			if(val1->data != NULL) {
+				if(ngx_strcmp(val1->data, "top") == 0) {
+					op->arg1 |= MJ_ALIGN_TOP;
+				}
+				else if(ngx_strcmp(val1->data, "bottom") == 0) {
+					op->arg1 |= MJ_ALIGN_BOTTOM;
+				}
+				else if(ngx_strcmp(val1->data, "center") == 0) {
+					op->arg1 |= MJ_ALIGN_CENTER;
+				}
+				else {
+					*invalid = val1;
+					rc = NGX_DECLINED;
+				}
+			}
+
+			if(val2->data != NULL) {
+				if(ngx_strcmp(val2->data, "left") == 0) {
+					op->arg1 |= MJ_ALIGN_LEFT;
+				}
+				else if(ngx_strcmp(val2->data, "right") == 0) {
+					op->arg1 |= MJ_ALIGN_RIGHT;
+				}
+				else if(ngx_strcmp(val2->data, "center") == 0) {
+					op->arg1 |= MJ_ALIGN_CENTER;
+				}
+				else {
+					*invalid = val2;
+					rc = NGX_DECLINED;
+				}
+			}
+
+			break;
+		case NGX_HTTP_JPEG_FILTER_TYPE_DROPON_OFFSET:
+			op->op = NGX_HTTP_JPEG_FILTER_OP_OFFSET;
+
+			if(!ngx_http_jpeg_filter_is_int_value(val1)) {
+				*invalid = val1;
+				rc = NGX_DECLINED;
+			}
+
+			if(!ngx_http_jpeg_filter_is_int_value(val2)) {
+				*invalid = val2;
+				rc = NGX_DECLINED;
+			}
+
+			op->arg1 = ngx_http_jpeg_filter_get_int_value(val1, 0);
+			op->arg2 = ngx_http_jpeg_filter_get_int_value(val2, 0);
+
+			break;
+		case NGX_HTTP_JPEG_FILTER_TYPE_DROPON_FILE1:
+		case NGX_HTTP_JPEG_FILTER_TYPE_DROPON_FILE2:
+		case NGX_HTTP_JPEG_FILTER_TYPE_DROPON_MEMORY1:
+		case NGX_HTTP_JPEG_FILTER_TYPE_DROPON_MEMORY2:
+			/* The dropon is loaded when the image is processed */
+			op->op = NGX_HTTP_JPEG_FILTER_OP_DROPON_DYNAMIC;
+
+			break;
+		default:
+			break;
+	}
+
+	return rc;
+}
+
+/* Decode the image, apply the processing chain, and encode the image. This may run in a thread */
+static ngx_int_t ngx_http_jpeg_filter_transform(ngx_http_jpeg_filter_ctx_t *ctx) {
+	ngx_http_jpeg_filter_conf_t  *conf = ctx->conf;
+	ngx_log_t                    *log = ctx->log;
+
+	ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "jpeg_filter: ngx_http_jpeg_filter_transform");
+
+	/* The image may have been waiting for a thread for a while */
+	if(ngx_http_jpeg_filter_abandoned(ctx, "processing")) {
+		return NGX_ERROR;
+	}
+
+	if(ctx->transcoder != NULL) {
+		if(ngx_http_jpeg_filter_transcode(ctx) == NGX_OK) {
+			return NGX_OK;
+		}
+
+		if(conf->max_memory != 0 && ngx_http_jpeg_filter_memory(ctx, 1) > conf->max_memory) {
+			ngx_log_error(NGX_LOG_WARN, log, 0, "jpeg_filter: can't transcode the image and decoding it needs about %uz bytes of memory, exceeding the limit of %uz bytes", ngx_http_jpeg_filter_memory(ctx, 1), conf->max_memory);
+			return NGX_ERROR;
+		}
+
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "jpeg_filter: can't transcode the image, decoding it");
+	}
+
+	/* Read the image */
+	mj_jpeg_t m;
+	mj_init_jpeg(&m);
+
+	ngx_uint_t start = ngx_http_jpeg_filter_usec(), begin, t;
+
+	if(mj_read_jpeg_from_memory(&m, (char *)ctx->in_image, ctx->in_last - ctx->in_image, conf->max_pixel) != MJ_OK) {
+		mj_free_jpeg(&m);
+		return NGX_ERROR;
+	}
+
+	t = ngx_http_jpeg_filter_usec();
+	ngx_http_jpeg_filter_observe(ctx, NGX_HTTP_JPEG_FILTER_STAGE_DECODE, t - start);
+	begin = start;
+	start = t;
+
+	ngx_http_jpeg_filter_element_t *felts = NULL;
+	ngx_http_jpeg_filter_op_t *op;
+	ngx_uint_t i, nelts = 0;
+	ngx_int_t align = 0, offset_x = 0, offset_y = 0;
+	ngx_str_t *val1, *val2;
+	mj_dropon_t d;
+	ngx_http_jpeg_filter_dropon_node_t *dn;
+
+	if(conf->filter_elements != NULL) {
+		felts = conf->filter_elements->elts;
+		nelts = conf->filter_elements->nelts;
+	}
+
+	/* Go through the processing chain */
+	for(i = 0; i < nelts; i++) {
+		/* The chain has been resolved for this request if it has variables */
+		op = (ctx->ops != NULL) ? &ctx->ops[i] : &conf->ops[i];
+
+		if(op->op == NGX_HTTP_JPEG_FILTER_OP_NONE) {
+			continue;
+		}
+
+		if(ngx_http_jpeg_filter_over_budget(ctx, begin, "applying the processing chain") || ngx_http_jpeg_filter_abandoned(ctx, "applying the processing chain")) {
+			mj_free_jpeg(&m);
+			return NGX_ERROR;
+		}
+
+		t = ngx_http_jpeg_filter_usec();
+
+		switch(op->op) {
+			case NGX_HTTP_JPEG_FILTER_OP_GRAYSCALE:
+				ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "jpeg_filter: applying effect 'grayscale'");
+				mj_effect_grayscale(&m);
+
+				break;
+			case NGX_HTTP_JPEG_FILTER_OP_PIXELATE:
+				ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "jpeg_filter: applying effect 'pixelate'");
+				mj_effect_pixelate(&m);
+
+				break;
+			case NGX_HTTP_JPEG_FILTER_OP_LUMINANCE:
+				ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0, "jpeg_filter: applying effect 'luminance(%i)'", op->arg1);
+				mj_effect_luminance(&m, op->arg1);
+
+				break;
+			case NGX_HTTP_JPEG_FILTER_OP_TINT:
+				ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0, "jpeg_filter: applying effect 'tint(%i,%i)'", op->arg1, op->arg2);
+				mj_effect_tint(&m, op->arg1, op->arg2);
+
+				break;
+			case NGX_HTTP_JPEG_FILTER_OP_ALIGN:
+				ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0, "jpeg_filter: applying dropon align %i", op->arg1);
+				align = op->arg1;
+
+				break;
+			case NGX_HTTP_JPEG_FILTER_OP_OFFSET:
+				offset_y = op->arg1;
+				offset_x = op->arg2;
+
+				ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0, "jpeg_filter: applying dropon offset (%dpx,%dpx)", offset_y, offset_x);
+
+				break;
+			case NGX_HTTP_JPEG_FILTER_OP_DROPON:
+				ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "jpeg_filter: applying preloaded dropon");
+				mj_compose(&m, op->dropon, align, offset_x, offset_y);
+
+				break;
+			case NGX_HTTP_JPEG_FILTER_OP_DROPON_DYNAMIC:
+				ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "jpeg_filter: applying dynamic dropon");
+
+				val1 = &ctx->values[i].val1;
+				val2 = &ctx->values[i].val2;
+
+				if(ngx_http_jpeg_filter_dropon_cache != NULL) {
+					dn = ngx_http_jpeg_filter_dropon_cache_get(felts[i].type, val1, val2, log);
+					if(dn != NULL) {
+						mj_compose(&m, &dn->dropon, align, offset_x, offset_y);
+
+						ngx_http_jpeg_filter_dropon_cache_release(dn, log);
+					}
+
+					break;
+				}
+
+				mj_init_dropon(&d);
+
+				ngx_http_jpeg_filter_dropon_load(&d, felts[i].type, val1, val2, log);
+
+				mj_compose(&m, &d, align, offset_x, offset_y);
+
+				mj_free_dropon(&d);
+
+				break;
+			default:
+				break;
+		}
+
+		if(ctx->metrics != NULL) {
+			(void) ngx_atomic_fetch_add(&ctx->metrics->op_count[op->op], 1);
+			(void) ngx_atomic_fetch_add(&ctx->metrics->op_usec[op->op], ngx_http_jpeg_filter_usec() - t);
+		}
+	}
+
+	t = ngx_http_jpeg_filter_usec();
+	ngx_http_jpeg_filter_observe(ctx, NGX_HTTP_JPEG_FILTER_STAGE_CHAIN, t - start);
+	start = t;
+
+	/* The options have been chosen by ngx_http_jpeg_filter_coding() */
+	int options = ctx->options;
+
+	ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0, "jpeg_filter: JPEG output options %d", options);
+
+	if(ngx_http_jpeg_filter_over_budget(ctx, begin, "encoding") || ngx_http_jpeg_filter_abandoned(ctx, "encoding")) {
+		mj_free_jpeg(&m);
+		return NGX_ERROR;
+	}
+
+	/* Write the modified image into the buffer from the pool. If it is too small, a new buffer will be allocated */
+
+	size_t len = ctx->out_size;
+
+	ctx->out_image = ctx->out_buffer;
+
+	if(mj_write_jpeg_to_memory(&m, &ctx->out_image, &len, options) != 0) {
+		mj_free_jpeg(&m);
+		return NGX_ERROR;
+	}
+
+	ctx->out_last = ctx->out_image + len;
+
+	t = ngx_http_jpeg_filter_usec();
+	ngx_http_jpeg_filter_observe(ctx, NGX_HTTP_JPEG_FILTER_STAGE_ENCODE, t - start);
+
+	/* Find out what the probed option is worth by encoding the image without it */
+	if(ctx->probe != 0) {
+		unsigned char *probe = NULL;
+		size_t probe_len = 0;
+
+		start = t;
+
+		if(mj_write_jpeg_to_memory(&m, &probe, &probe_len, options & ~ctx->probe) == 0) {
+			t = ngx_http_jpeg_filter_usec();
+
+			ctx->probe_saved = (ngx_int_t)probe_len - (ngx_int_t)len;
+			ctx->probe_usec = (ngx_int_t)ctx->usec[NGX_HTTP_JPEG_FILTER_STAGE_ENCODE] - (ngx_int_t)(t - start);
+			ctx->probed = 1;
+
+			ngx_log_debug3(NGX_LOG_DEBUG_HTTP, log, 0, "jpeg_filter: option %d saved %i bytes for %ius", ctx->probe, ctx->probe_saved, ctx->probe_usec);
+		}
+
+		free(probe);
+	}
+
+	/* Destroy the modified image */
+	mj_free_jpeg(&m);
+
+	return NGX_OK;
+}
+
+/*
+ * Decide whether the image can be transcoded instead of being decoded, processed, and encoded by libmodjpeg.
+ * This is the case for baseline Huffman coded images that are encoded without any options and with a processing
+ * chain that only changes the DC coefficients (brighten, darken, tint) or drops the AC coefficients (pixelate).
+ * Whether the changes of the DC coefficients can be done exactly is only known from the quantization tables,
+ * see ngx_http_jpeg_filter_transcode_shift().
+ */
+static ngx_int_t ngx_http_jpeg_filter_transcodable(ngx_http_request_t *r, ngx_http_jpeg_filter_ctx_t *ctx) {
+	ngx_uint_t                          i, nops, pixelate = 0, shifted = 0;
+	ngx_http_jpeg_filter_op_t          *ops;
+	ngx_http_jpeg_filter_transcoder_t  *t;
+
+	if(ctx->conf->transcode == 0 || ctx->conf->filter_elements == NULL) {
+		return NGX_OK;
+	}
+
+	if(ctx->progressive == 1 || ctx->arithmetic == 1 || ctx->options != 0) {
+		return NGX_OK;
+	}
+
+	if(ctx->components != 1 && ctx->components != 3) {
+		return NGX_OK;
+	}
+
+	ops = (ctx->ops != NULL) ? ctx->ops : ctx->conf->ops;
+	nops = ctx->conf->filter_elements->nelts;
+
+	for(i = 0; i < nops; i++) {
+		switch(ops[i].op) {
+			case NGX_HTTP_JPEG_FILTER_OP_NONE:
+			case NGX_HTTP_JPEG_FILTER_OP_ALIGN:
+			case NGX_HTTP_JPEG_FILTER_OP_OFFSET:
+				break;
+			case NGX_HTTP_JPEG_FILTER_OP_PIXELATE:
+				pixelate = 1;
+				break;
+			case NGX_HTTP_JPEG_FILTER_OP_LUMINANCE:
+			case NGX_HTTP_JPEG_FILTER_OP_TINT:
+				shifted = 1;
+				break;
+			default:
+				/* Grayscale and dropons need the decoded image */
+				return NGX_OK;
+		}
+	}
+
+	t = ngx_pcalloc(r->pool, sizeof(ngx_http_jpeg_filter_transcoder_t));
+	if(t == NULL) {
+		return NGX_ERROR;
+	}
+
+	t->ops = ops;
+	t->nops = nops;
+	t->shifted = shifted;
+	t->pixelate = pixelate;
+
+	ctx->transcoder = t;
+
+	ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ctx->log, 0, "jpeg_filter: transcoding with DC changes %ui, pixelate %ui", shifted, pixelate);
+
+	return NGX_OK;
+}
+
+/*
+ * Apply the processing chain to the entropy coded data of the original image. The Huffman codes of each
+ * block are decoded and encoded again with the same tables while the DC differences are adjusted and the
+ * AC coefficients are dropped on the fly. All other segments are copied. No coefficients are kept in memory
+ * and the processed image is written into the buffer from the pool. Returns NGX_DECLINED if the image has
+ * to be decoded by libmodjpeg instead, e.g. because a required code is not in the Huffman tables, the image
+ * is damaged, or the processed image doesn't fit into the buffer. This may be called from a thread.
+ */
+static ngx_int_t ngx_http_jpeg_filter_transcode(ngx_http_jpeg_filter_ctx_t *ctx) {
+	ngx_int_t                           rc;
+	ngx_uint_t                          start;
+	ngx_http_jpeg_filter_transcoder_t  *t = ctx->transcoder;
+
+	start = ngx_http_jpeg_filter_usec();
+
+	t->in = ctx->in_image;
+	t->in_last = ctx->in_last;
+	t->out = ctx->out_buffer;
+	t->out_end = ctx->out_buffer + ctx->out_size;
+	t->overflow = 0;
+
+	/* The SOI marker has been checked already */
+	ngx_http_jpeg_filter_transcode_copy(t, t->in, 2);
+	t->in += 2;
+
+	for(;;) {
+		rc = ngx_http_jpeg_filter_transcode_segments(t);
+		if(rc == NGX_DONE) {
+			break;
+		}
+
+		if(rc != NGX_OK) {
+			return rc;
+		}
+
+		rc = ngx_http_jpeg_filter_transcode_mcus(t, 0, t->mcus);
+		if(rc != NGX_OK) {
+			return rc;
+		}
+
+		/* The next marker after the entropy coded data */
+		t->in = ngx_http_jpeg_filter_transcode_marker(t->in, t->in_last);
+		if(t->in == NULL) {
+			return NGX_DECLINED;
+		}
+	}
+
+	if(t->overflow == 1) {
+		return NGX_DECLINED;
+	}
+
+	ctx->out_image = ctx->out_buffer;
+	ctx->out_last = t->out;
+	ctx->transcoded = 1;
+
+	ngx_http_jpeg_filter_observe(ctx, NGX_HTTP_JPEG_FILTER_STAGE_CHAIN, ngx_http_jpeg_filter_usec() - start);
+
+	ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ctx->log, 0, "jpeg_filter: transcoded image of %uz bytes into %uz bytes", (size_t)(ctx->in_last - ctx->in_image), (size_t)(t->out - ctx->out_buffer));
+
+	return NGX_OK;
+}
+
+/*
+ * Copy the segments starting at t->in up to the next SOS or EOI segment and read the tables and headers that
+ * are needed for transcoding. Returns NGX_OK with t->in at the entropy coded data of the scan, NGX_DONE after
+ * the EOI marker, or NGX_DECLINED.
+ */
+static ngx_int_t ngx_http_jpeg_filter_transcode_segments(ngx_http_jpeg_filter_transcoder_t *t) {
+	u_char     *p, marker;
+	size_t      len;
+	ngx_int_t   rc;
+
+	p = t->in;
+
+	for(;;) {
+		if(t->in_last - p < 2 || p[0] != 0xff) {
+			return NGX_DECLINED;
+		}
+
+		marker = p[1];
+
+		/* Fill bytes are dropped */
+		if(marker == 0xff) {
+			p++;
+			continue;
+		}
+
+		if(marker == 0xd9) {
+			ngx_http_jpeg_filter_transcode_copy(t, p, 2);
+			t->in = p + 2;
+			return NGX_DONE;
+		}
+
+		if(marker == 0x01) {
+			ngx_http_jpeg_filter_transcode_copy(t, p, 2);
+			p += 2;
+			continue;
+		}
+
+		if(marker == 0x00 || (marker >= 0xd0 && marker <= 0xd8) || t->in_last - p < 4) {
+			return NGX_DECLINED;
+		}
+
+		len = (p[2] << 8) | p[3];
+
+		if(len < 2 || (size_t)(t->in_last - p) < 2 + len) {
+			return NGX_DECLINED;
+		}
+
+		rc = NGX_OK;
+
+		if(marker == 0xc4) {
+			rc = ngx_http_jpeg_filter_transcode_dht(t, p + 4, len - 2);
+		}
+		else if(marker == 0xc0 || marker == 0xc1) {
+			rc = ngx_http_jpeg_filter_transcode_sof(t, p + 4, len - 2);
+		}
+		else if(marker == 0xdb) {
+			rc = ngx_http_jpeg_filter_transcode_dqt(t, p + 4, len - 2);
+		}
+		else if(marker >= 0xc2 && marker <= 0xcf && marker != 0xc4 && marker != 0xc8 && marker != 0xcc) {
+			/* Any other coding process, or DAC */
+			rc = NGX_DECLINED;
+		}
+		else if(marker == 0xda) {
+			rc = ngx_http_jpeg_filter_transcode_sos(t, p + 4, len - 2);
+		}
+		else if(marker == 0xdd) {
+			if(len != 4) {
+				return NGX_DECLINED;
+			}
+
+			t->restart = (p[4] << 8) | p[5];
+		}
+		else if(marker == 0xee) {
+			/* The Adobe marker tells libjpeg whether the components are YCbCr */
+			if(len >= 14 && ngx_strncmp(p + 4, "Adobe", 5) == 0 && p[15] == 0) {
+				t->rgb = 1;
+			}
+		}
+
+		if(rc != NGX_OK) {
+			return rc;
+		}
+
+		ngx_http_jpeg_filter_transcode_copy(t, p, 2 + len);
+		p += 2 + len;
+
+		if(marker == 0xda) {
+			t->in = p;
+			return NGX_OK;
+		}
+	}
+}
+
+/* Read the Huffman tables from a DHT segment */
+static ngx_int_t ngx_http_jpeg_filter_transcode_dht(ngx_http_jpeg_filter_transcoder_t *t, u_char *p, size_t len) {
+	u_char                          *bits, *values, sym;
+	size_t                           count;
+	ngx_uint_t                       i, j, k, l, code;
+	ngx_http_jpeg_filter_huffman_t  *h;
+
+	while(len > 0) {
+		if(len < 17 || (p[0] >> 4) > 1 || (p[0] & 0x0f) > 3) {
+			return NGX_DECLINED;
+		}
+
+		h = ((p[0] >> 4) == 0) ? &t->dc[p[0] & 0x0f] : &t->ac[p[0] & 0x0f];
+
+		bits = p + 1;
+		values = p + 17;
+
+		for(count = 0, l = 0; l < 16; l++) {
+			count += bits[l];
+		}
+
+		if(count > 256 || len < 17 + count) {
+			return NGX_DECLINED;
+		}
+
+		ngx_memzero(h, sizeof(ngx_http_jpeg_filter_huffman_t));
+
+		/* The canonical codes as in Annex C of ITU T.81 */
+		code = 0;
+		k = 0;
+
+		for(l = 1; l <= 16; l++) {
+			h->valptr[l] = k;
+			h->mincode[l] = code;
+
+			for(i = 0; i < bits[l - 1]; i++) {
+				sym = values[k];
+
+				h->values[k] = sym;
+				h->code[sym] = code;
+				h->size[sym] = l;
+
+				/* Codes with up to 8 bits are decoded with a single lookup */
+				if(l <= 8) {
+					for(j = 0; j < (1U << (8 - l)); j++) {
+						h->look_len[(code << (8 - l)) | j] = l;
+						h->look_sym[(code << (8 - l)) | j] = sym;
+					}
+				}
+
+				code++;
+				k++;
+			}
+
+			h->maxcode[l] = (bits[l - 1] != 0) ? (ngx_int_t)code - 1 : -1;
+
+			if(code > (1U << l)) {
+				return NGX_DECLINED;
+			}
+
+			code <<= 1;
+		}
+
+		h->defined = 1;
+
+		p += 17 + count;
+		len -= 17 + count;
+	}
+
+	return NGX_OK;
+}
+
+/* Read the dimensions and the components from the frame header */
+static ngx_int_t ngx_http_jpeg_filter_transcode_sof(ngx_http_jpeg_filter_transcoder_t *t, u_char *p, size_t len) {
+	ngx_uint_t  i;
+
+	if(len < 6 || p[0] != 8 || p[5] < 1 || p[5] > 3 || len < 6 + 3 * (size_t)p[5]) {
+		return NGX_DECLINED;
+	}
+
+	t->height = (p[1] << 8) | p[2];
+	t->width = (p[3] << 8) | p[4];
+	t->components = p[5];
+	t->hmax = 1;
+	t->vmax = 1;
+
+	if(t->width == 0 || t->height == 0) {
+		return NGX_DECLINED;
+	}
+
+	for(i = 0; i < t->components; i++) {
+		t->id[i] = p[6 + 3 * i];
+		t->h[i] = p[7 + 3 * i] >> 4;
+		t->v[i] = p[7 + 3 * i] & 0x0f;
+		t->tq[i] = p[8 + 3 * i];
+
+		if(t->h[i] < 1 || t->h[i] > 4 || t->v[i] < 1 || t->v[i] > 4 || t->tq[i] > 3) {
+			return NGX_DECLINED;
+		}
+
+		t->hmax = ngx_max(t->hmax, t->h[i]);
+		t->vmax = ngx_max(t->vmax, t->v[i]);
+	}
+
+	/* libjpeg takes components with the ids R, G, and B for RGB as well */
+	if(t->components == 3 && t->id[0] == 'R' && t->id[1] == 'G' && t->id[2] == 'B') {
+		t->rgb = 1;
+	}
+
+	return NGX_OK;
+}
+
+/* Read the DC quantizer of the quantization tables from a DQT segment. The AC quantizers don't matter */
+static ngx_int_t ngx_http_jpeg_filter_transcode_dqt(ngx_http_jpeg_filter_transcoder_t *t, u_char *p, size_t len) {
+	size_t  size;
+
+	while(len > 0) {
+		/* 64 values with 8 or 16 bits each */
+		size = ((p[0] >> 4) == 0) ? 1 + 64 : 1 + 128;
+
+		if((p[0] >> 4) > 1 || (p[0] & 0x0f) > 3 || len < size) {
+			return NGX_DECLINED;
+		}
+
+		/* The first value in zigzag order belongs to the DC coefficient */
+		t->quant[p[0] & 0x0f] = ((p[0] >> 4) == 0) ? p[1] : (ngx_uint_t)((p[1] << 8) | p[2]);
+
+		p += size;
+		len -= size;
+	}
+
+	return NGX_OK;
+}
+
+/*
+ * Find out the change of the quantized DC coefficient of each component. libmodjpeg adds the value of an effect
+ * to the dequantized DC coefficient, but the transcoder only sees the quantized one. Both agree only if the value
+ * is a multiple of the DC quantizer of the component, otherwise the image is left to libmodjpeg. Each element is
+ * checked on its own, the same way libmodjpeg applies them one after the other, and the values are not summed up
+ * first, like in ngx_http_jpeg_filter_optimize().
+ */
+static ngx_int_t ngx_http_jpeg_filter_transcode_shift(ngx_http_jpeg_filter_transcoder_t *t) {
+	ngx_int_t   value[3], q;
+	ngx_uint_t  i, c;
+
+	t->shift[0] = 0;
+	t->shift[1] = 0;
+	t->shift[2] = 0;
+
+	for(i = 0; i < t->nops; i++) {
+		switch(t->ops[i].op) {
+			case NGX_HTTP_JPEG_FILTER_OP_LUMINANCE:
+				value[0] = t->ops[i].arg1;
+				value[1] = 0;
+				value[2] = 0;
+				break;
+			case NGX_HTTP_JPEG_FILTER_OP_TINT:
+				value[0] = 0;
+				value[1] = t->ops[i].arg1;
+				value[2] = t->ops[i].arg2;
+				break;
+			default:
+				continue;
+		}
+
+		/* A grayscale image has no color components to tint */
+		for(c = 0; c < 3 && c < t->components; c++) {
+			if(value[c] == 0) {
+				continue;
+			}
+
+			q = t->quant[t->tq[c]];
+
+			if(q == 0 || value[c] % q != 0) {
+				return NGX_DECLINED;
+			}
+
+			t->shift[c] += value[c] / q;
+		}
+	}
+
+	return NGX_OK;
+}
+
+/* Read the components and their Huffman tables from the scan header */
+static ngx_int_t ngx_http_jpeg_filter_transcode_sos(ngx_http_jpeg_filter_transcoder_t *t, u_char *p, size_t len) {
+	ngx_uint_t  n, i, c = 0, width, height;
+
+	if(t->components == 0 || len < 1) {
+		return NGX_DECLINED;
+	}
+
+	n = p[0];
+
+	if(n < 1 || n > t->components || len != 4 + 2 * n) {
+		return NGX_DECLINED;
+	}
+
+	if(t->shifted == 1) {
+		if(t->rgb == 1) {
+			/* The effects only apply to YCbCr */
+			return NGX_DECLINED;
+		}
+
+		if(ngx_http_jpeg_filter_transcode_shift(t) != NGX_OK) {
+			return NGX_DECLINED;
+		}
+	}
+
+	for(i = 0; i < n; i++) {
+		for(c = 0; c < t->components; c++) {
+			if(t->id[c] == p[1 + 2 * i]) {
+				break;
+			}
+		}
+
+		if(c == t->components) {
+			return NGX_DECLINED;
+		}
+
+		t->scan_dc[i] = p[2 + 2 * i] >> 4;
+		t->scan_ac[i] = p[2 + 2 * i] & 0x0f;
+
+		if(t->scan_dc[i] > 3 || t->scan_ac[i] > 3 || t->dc[t->scan_dc[i]].defined == 0 || t->ac[t->scan_ac[i]].defined == 0) {
+			return NGX_DECLINED;
+		}
+
+		/* Pixelated blocks end with an EOB right after the DC coefficient */
+		if(t->pixelate == 1 && t->ac[t->scan_ac[i]].size[0x00] == 0) {
+			return NGX_DECLINED;
+		}
+
+		/* A single component is not interleaved, i.e. each block is a MCU */
+		t->scan_blocks[i] = (n == 1) ? 1 : t->h[c] * t->v[c];
+		t->scan_shift[i] = t->shift[c];
+	}
+
+	t->scan_components = n;
+
+	/* Only sequential scans. The spectral selection and the successive approximation are fixed */
+	p += 1 + 2 * n;
+
+	if(p[0] != 0 || p[1] != 63 || p[2] != 0) {
+		return NGX_DECLINED;
+	}
+
+	if(n == 1) {
+		width = (t->width * t->h[c] + t->hmax - 1) / t->hmax;
+		height = (t->height * t->v[c] + t->vmax - 1) / t->vmax;
+		t->mcus = ((width + 7) / 8) * ((height + 7) / 8);
+	}
+	else {
+		t->mcus = ((t->width + 8 * t->hmax - 1) / (8 * t->hmax)) * ((t->height + 8 * t->vmax - 1) / (8 * t->vmax));
+	}
+
+	return NGX_OK;
+}
+
+/*
+ * Transcode the given number of MCUs of the current scan starting at t->in with the predictions reset, i.e. at the
+ * start of the scan or of a restart interval. rst is the number of the first restart marker that is expected.
+ */
+static ngx_int_t ngx_http_jpeg_filter_transcode_mcus(ngx_http_jpeg_filter_transcoder_t *t, ngx_uint_t rst, ngx_uint_t mcus) {
+	ngx_int_t   rc, pred[4], npred[4];
+	ngx_uint_t  i, j, mcu;
+
+	t->get = 0;
+	t->get_bits = 0;
+	t->fake = 0;
+	t->marker = 0;
+	t->put = 0;
+	t->put_bits = 0;
+
+	ngx_memzero(pred, sizeof(pred));
+	ngx_memzero(npred, sizeof(npred));
+
+	for(mcu = 0; mcu < mcus; mcu++) {
+		if(t->restart != 0 && mcu != 0 && mcu % t->restart == 0) {
+			if(ngx_http_jpeg_filter_transcode_restart(t, rst) != NGX_OK) {
+				return NGX_DECLINED;
+			}
+
+			rst = (rst + 1) & 7;
+
+			ngx_memzero(pred, sizeof(pred));
+			ngx_memzero(npred, sizeof(npred));
+		}
+
+		for(i = 0; i < t->scan_components; i++) {
+			for(j = 0; j < t->scan_blocks[i]; j++) {
+				rc = ngx_http_jpeg_filter_transcode_block(t, &t->dc[t->scan_dc[i]], &t->ac[t->scan_ac[i]], t->scan_shift[i], &pred[i], &npred[i]);
+				if(rc != NGX_OK) {
+					return rc;
+				}
+			}
+		}
+	}
+
+	/* The decoder must not have run past the entropy coded data */
+	if(t->fake > t->get_bits) {
+		return NGX_DECLINED;
+	}
+
+	ngx_http_jpeg_filter_transcode_flush(t);
+
+	return NGX_OK;
+}
+
+/*
+ * Transcode a block. The same change of all DC coefficients of a component leaves all differences between
+ * them the same, except for the first block after the start of the scan or a restart marker. The category
+ * of that difference may change though, and it must have a code in the Huffman table.
+ */
+static ngx_int_t ngx_http_jpeg_filter_transcode_block(ngx_http_jpeg_filter_transcoder_t *t, ngx_http_jpeg_filter_huffman_t *dc, ngx_http_jpeg_filter_huffman_t *ac, ngx_int_t shift, ngx_int_t *pred, ngx_int_t *npred) {
+	ngx_int_t   sym, diff;
+	ngx_uint_t  k, r, s, bits;
+
+	sym = ngx_http_jpeg_filter_transcode_decode(t, dc);
+	if(sym < 0 || sym > NGX_HTTP_JPEG_FILTER_DC_CATEGORY) {
+		return NGX_DECLINED;
+	}
+
+	s = sym;
+	diff = 0;
+
+	if(s != 0) {
+		diff = ngx_http_jpeg_filter_transcode_receive(t, s);
+
+		if(diff < (1 << (s - 1))) {
+			diff -= (1 << s) - 1;
+		}
+	}
+
+	*pred += diff;
+
+	diff = *pred + shift - *npred;
+	*npred = *pred + shift;
+
+	bits = (diff < 0) ? -diff : diff;
+
+	for(s = 0; bits != 0; s++) {
+		bits >>= 1;
+	}
+
+	if(s > NGX_HTTP_JPEG_FILTER_DC_CATEGORY || dc->size[s] == 0) {
+		return NGX_DECLINED;
+	}
+
+	ngx_http_jpeg_filter_transcode_put(t, dc->code[s], dc->size[s]);
+	ngx_http_jpeg_filter_transcode_put(t, (diff < 0) ? (ngx_uint_t)(diff - 1) : (ngx_uint_t)diff, s);
+
+	/* The AC coefficients are copied as they are, or dropped */
+	for(k = 1; k < 64; k++) {
+		sym = ngx_http_jpeg_filter_transcode_decode(t, ac);
+		if(sym < 0) {
+			return NGX_DECLINED;
+		}
+
+		r = sym >> 4;
+		s = sym & 0x0f;
+		bits = (s != 0) ? ngx_http_jpeg_filter_transcode_receive(t, s) : 0;
+
+		if(t->pixelate == 0) {
+			ngx_http_jpeg_filter_transcode_put(t, ac->code[sym], ac->size[sym]);
+			ngx_http_jpeg_filter_transcode_put(t, bits, s);
+		}
+
+		if(s == 0) {
+			if(r != 15) {
+				/* EOB */
+				break;
+			}
+
+			k += 15;
+		}
+		else {
+			k += r;
+
+			if(k > 63) {
+				return NGX_DECLINED;
+			}
+		}
+	}
+
+	if(t->pixelate == 1) {
+		ngx_http_jpeg_filter_transcode_put(t, ac->code[0x00], ac->size[0x00]);
+	}
+
+	return NGX_OK;
+}
+
+/* Expect the restart marker n after the current restart interval and write it to the processed image */
+static ngx_int_t ngx_http_jpeg_filter_transcode_restart(ngx_http_jpeg_filter_transcoder_t *t, ngx_uint_t n) {
+	u_char  *p, marker[2];
+
+	if(t->fake > t->get_bits) {
+		return NGX_DECLINED;
+	}
+
+	/* The remaining bits of the interval are padding */
+	p = ngx_http_jpeg_filter_transcode_marker(t->in, t->in_last);
+	if(p == NULL || p[1] != 0xd0 + n) {
+		return NGX_DECLINED;
+	}
+
+	t->in = p + 2;
+	t->get = 0;
+	t->get_bits = 0;
+	t->fake = 0;
+	t->marker = 0;
+
+	ngx_http_jpeg_filter_transcode_flush(t);
+
+	marker[0] = 0xff;
+	marker[1] = 0xd0 + n;
+
+	ngx_http_jpeg_filter_transcode_copy(t, marker, 2);
+
+	return NGX_OK;
+}
+
+/* Find the next marker, skipping its fill bytes. Returns NULL if there is none */
+static u_char *ngx_http_jpeg_filter_transcode_marker(u_char *p, u_char *last) {
+	while(last - p >= 2) {
+		/* memchr() is considerably faster than ngx_strlchr() on the entropy coded data */
+		p = memchr(p, 0xff, last - 1 - p);
+		if(p == NULL) {
+			return NULL;
+		}
+
+		if(p[1] != 0x00 && p[1] != 0xff) {
+			return p;
+		}
+
+		p++;
+	}
+
+	return NULL;
+}
+
+/* Read at least 25 bits of entropy coded data. After its end, zeros are read like libjpeg does it */
+static void ngx_http_jpeg_filter_transcode_fill(ngx_http_jpeg_filter_transcoder_t *t) {
+	u_char  c;
+
+	while(t->get_bits <= 24) {
+		c = 0;
+
+		if(t->marker == 0) {
+			if(t->in < t->in_last && t->in[0] != 0xff) {
+				c = *t->in++;
+			}
+			else if(t->in_last - t->in >= 2 && t->in[1] == 0x00) {
+				/* A stuffed byte */
+				c = 0xff;
+				t->in += 2;
+			}
+			else {
+				t->marker = 1;
+			}
+		}
+
+		if(t->marker == 1) {
+			t->fake += 8;
+		}
+
+		t->get = (t->get << 8) | c;
+		t->get_bits += 8;
+	}
+
+	return;
+}
+
+/* Decode the next Huffman code. Returns its symbol or -1 if the code is not in the table */
+static ngx_int_t ngx_http_jpeg_filter_transcode_decode(ngx_http_jpeg_filter_transcoder_t *t, ngx_http_jpeg_filter_huffman_t *h) {
+	ngx_int_t   code;
+	ngx_uint_t  l, look;
+
+	ngx_http_jpeg_filter_transcode_fill(t);
+
+	look = (t->get >> (t->get_bits - 8)) & 0xff;
+
+	if(h->look_len[look] != 0) {
+		t->get_bits -= h->look_len[look];
+		return h->look_sym[look];
+	}
+
+	for(l = 9; l <= 16; l++) {
+		code = (t->get >> (t->get_bits - l)) & ((1 << l) - 1);
+
+		if(code <= h->maxcode[l]) {
+			t->get_bits -= l;
+			return h->values[h->valptr[l] + code - h->mincode[l]];
+		}
+	}
+
+	return -1;
+}
+
+/* Read the next n bits */
+static ngx_uint_t ngx_http_jpeg_filter_transcode_receive(ngx_http_jpeg_filter_transcoder_t *t, ngx_uint_t n) {
+	ngx_http_jpeg_filter_transcode_fill(t);
+
+	t->get_bits -= n;
+
+	return (t->get >> t->get_bits) & ((1 << n) - 1);
+}
+
+/* Write the lowest n bits, stuffing a 0x00 after each 0xff */
+static void ngx_http_jpeg_filter_transcode_put(ngx_http_jpeg_filter_transcoder_t *t, ngx_uint_t bits, ngx_uint_t n) {
+	u_char  c;
+
+	t->put = (t->put << n) | (bits & ((1 << n) - 1));
+	t->put_bits += n;
+
+	while(t->put_bits >= 8) {
+		t->put_bits -= 8;
+		c = (u_char)(t->put >> t->put_bits);
+
+		if(t->out_end - t->out < 2) {
+			t->overflow = 1;
+			continue;
+		}
+
+		*t->out++ = c;
+
+		if(c == 0xff) {
+			*t->out++ = 0x00;
+		}
+	}
+
+	return;
+}
+
+/* Pad the last byte with ones before a marker */
+static void ngx_http_jpeg_filter_transcode_flush(ngx_http_jpeg_filter_transcoder_t *t) {
+	if(t->put_bits != 0) {
+		ngx_http_jpeg_filter_transcode_put(t, 0x7f, 7);
+	}
+
+	t->put = 0;
+	t->put_bits = 0;
+
+	return;
+}
+
+static void ngx_http_jpeg_filter_transcode_copy(ngx_http_jpeg_filter_transcoder_t *t, u_char *p, size_t len) {
+	if((size_t)(t->out_end - t->out) < len) {
+		t->overflow = 1;
+		return;
+	}
+
+	t->out = ngx_cpymem(t->out, p, len);
+
+	return;
+}
+
+#if (NGX_THREADS)
+/* Post the processing of the image to the thread pool */
+static ngx_int_t ngx_http_jpeg_filter_thread_post(ngx_http_request_t *r, ngx_http_jpeg_filter_ctx_t *ctx) {
+	ngx_thread_task_t  *task;
+
+	ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "jpeg_filter: ngx_http_jpeg_filter_thread_post");
+
+	task = ctx->task;
+
+	if(task == NULL) {
+		task = ngx_thread_task_alloc(r->pool, 0);
+		if(task == NULL) {
+			return NGX_ERROR;
+		}
+
+		task->handler = ngx_http_jpeg_filter_thread_handler;
+		task->ctx = ctx;
+
+		ctx->task = task;
+	}
+
+	task->event.data = r;
+	task->event.handler = ngx_http_jpeg_filter_thread_event_handler;
+
+	ctx->task_done = 0;
+
+	if(ngx_thread_task_post(ctx->conf->thread_pool, task) != NGX_OK) {
+		/* The thread pool is not available, e.g. the queue is full. Process it here */
+		ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "jpeg_filter: failed to post task to thread pool, processing in worker");
+
+		return ngx_http_jpeg_filter_transform(ctx);
+	}
+
+	/* Park the request until the thread is done */
+	r->main->blocked++;
+	r->aio = 1;
+
+	r->connection->buffered |= NGX_HTTP_IMAGE_BUFFERED;
+
+	return NGX_AGAIN;
+}
+
+/* Process the image. This runs in a thread of the thread pool */
+static void ngx_http_jpeg_filter_thread_handler(void *data, ngx_log_t *log) {
+	ngx_http_jpeg_filter_ctx_t *ctx = data;
+
+	ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "jpeg_filter: ngx_http_jpeg_filter_thread_handler");
+
+	ctx->rc = ngx_http_jpeg_filter_transform(ctx);
+}
+
+/* The thread finished processing the image. Resume the request */
+static void ngx_http_jpeg_filter_thread_event_handler(ngx_event_t *ev) {
+	ngx_connection_t            *c;
+	ngx_http_request_t          *r;
+	ngx_http_jpeg_filter_ctx_t  *ctx;
+
+	r = ev->data;
+	c = r->connection;
+
+	ngx_http_set_log_request(c->log, r);
+
+	ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "jpeg_filter: ngx_http_jpeg_filter_thread_event_handler");
+
+	r->main->blocked--;
+	r->aio = 0;
+
+	ctx = ngx_http_get_module_ctx(r, ngx_http_jpeg_filter_module);
+	ctx->task_done = 1;
+
+	/* This will call the body filter again without any data */
+	r->write_event_handler(r);
+
+	ngx_http_run_posted_requests(c);
+}
+
+/*
+ * Split transcoding an image with restart intervals into bands of intervals, one for each task of the thread pool.
+ * The predictions of the DC coefficients start over with each interval, i.e. the bands can be transcoded independently
+ * and are joined with restart markers in between. Returns NGX_AGAIN if the tasks have been posted, or NGX_DECLINED if
+ * the image is processed as a whole.
+ */
+static ngx_int_t ngx_http_jpeg_filter_thread_split(ngx_http_request_t *r, ngx_http_jpeg_filter_ctx_t *ctx) {
+	u_char                             *p, *end;
+	size_t                              size;
+	ngx_uint_t                          i, n, intervals, interval, first;
+	ngx_http_jpeg_filter_band_t        *bands, *band;
+	ngx_http_jpeg_filter_transcoder_t  *t = ctx->transcoder;
+
+	if(t == NULL || ctx->conf->bands < 2) {
+		return NGX_DECLINED;
+	}
+
+	/* The bands need a buffer of their own for the processed image */
+	if(ctx->conf->max_memory != 0 && ngx_http_jpeg_filter_memory(ctx, 0) + ctx->out_size > ctx->conf->max_memory) {
+		return NGX_DECLINED;
+	}
+
+	ctx->bands_start = ngx_http_jpeg_filter_usec();
+
+	/* The segments before the scan go to the output buffer. They are written again if the image is processed as a whole */
+	t->in = ctx->in_image;
+	t->in_last = ctx->in_last;
+	t->out = ctx->out_buffer;
+	t->out_end = ctx->out_buffer + ctx->out_size;
+	t->overflow = 0;
+
+	ngx_http_jpeg_filter_transcode_copy(t, t->in, 2);
+	t->in += 2;
+
+	if(ngx_http_jpeg_filter_transcode_segments(t) != NGX_OK || t->restart == 0) {
+		return NGX_DECLINED;
+	}
+
+	intervals = (t->mcus + t->restart - 1) / t->restart;
+	n = ngx_min((ngx_uint_t)ctx->conf->bands, intervals);
+	n = ngx_min(n, ctx->samples / NGX_HTTP_JPEG_FILTER_BAND_SAMPLES);
+
+	if(n < 2) {
+		return NGX_DECLINED;
+	}
+
+	bands = ngx_pcalloc(r->pool, n * sizeof(ngx_http_jpeg_filter_band_t));
+	if(bands == NULL) {
+		return NGX_ERROR;
+	}
+
+	/* Find the restart markers where the bands start. The scan must be the only one, i.e. it is followed by EOI */
+	p = t->in;
+	interval = 0;
+
+	for(i = 0; i <= n; i++) {
+		first = (i < n) ? i * intervals / n : intervals - 1;
+
+		for(/* void */; interval < first; interval++) {
+			p = ngx_http_jpeg_filter_transcode_marker(p, ctx->in_last);
+			if(p == NULL || p[1] != 0xd0 + (interval & 7)) {
+				return NGX_DECLINED;
+			}
+
+			p += 2;
+		}
+
+		if(i < n) {
+			bands[i].first = first;
+			bands[i].in = p;
+		}
+	}
+
+	end = ngx_http_jpeg_filter_transcode_marker(p, ctx->in_last);
+	if(end == NULL || end[1] != 0xd9) {
+		return NGX_DECLINED;
+	}
+
+	for(i = 0; i < n; i++) {
+		band = &bands[i];
+
+		ngx_memcpy(&band->t, t, sizeof(ngx_http_jpeg_filter_transcoder_t));
+
+		/* The last interval of the image may be shorter */
+		band->mcus = ngx_min(((i + 1) * intervals / n) * t->restart, t->mcus) - band->first * t->restart;
+
+		size = ((i + 1 < n) ? bands[i + 1].in : end) - band->in;
+		size += size / 4 + NGX_HTTP_JPEG_FILTER_OUTPUT_SLACK;
+
+		band->out = ngx_http_jpeg_filter_arena_alloc(r, size);
+		if(band->out == NULL) {
+			return NGX_ERROR;
+		}
+
+		band->t.in = band->in;
+		band->t.out = band->out;
+		band->t.out_end = band->out + size;
+		band->rc = NGX_DECLINED;
+
+		band->task = ngx_thread_task_alloc(r->pool, 0);
+		if(band->task == NULL) {
+			return NGX_ERROR;
+		}
+
+		band->task->handler = ngx_http_jpeg_filter_band_handler;
+		band->task->ctx = band;
+		band->task->event.data = r;
+		band->task->event.handler = ngx_http_jpeg_filter_band_event_handler;
+	}
+
+	ctx->bands = bands;
+	ctx->nbands = n;
+	ctx->bands_pending = 0;
+
+	for(i = 0; i < n; i++) {
+		if(ngx_thread_task_post(ctx->conf->thread_pool, bands[i].task) != NGX_OK) {
+			/* The bands that have been posted already have to finish anyways */
+			ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "jpeg_filter: failed to post band %ui of %ui to thread pool", i + 1, n);
+			break;
+		}
+
+		ctx->bands_pending++;
+	}
+
+	if(ctx->bands_pending == 0) {
+		ctx->bands = NULL;
+		return NGX_DECLINED;
+	}
+
+	ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "jpeg_filter: split %ui restart intervals into %ui bands, %ui posted", intervals, n, ctx->bands_pending);
+
+	/* Park the request until all bands are done */
+	ctx->task_done = 0;
+
+	r->main->blocked++;
+	r->aio = 1;
+
+	r->connection->buffered |= NGX_HTTP_IMAGE_BUFFERED;
+
+	return NGX_AGAIN;
+}
+
+/* Transcode a band. This runs in a thread of the thread pool */
+static void ngx_http_jpeg_filter_band_handler(void *data, ngx_log_t *log) {
+	ngx_http_jpeg_filter_band_t *band = data;
+
+	ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0, "jpeg_filter: transcoding band starting at restart interval %ui", band->first);
+
+	band->rc = ngx_http_jpeg_filter_transcode_mcus(&band->t, band->first & 7, band->mcus);
+
+	if(band->t.overflow == 1) {
+		band->rc = NGX_DECLINED;
+	}
+}
+
+/* A band is done. Join the bands and resume the request after the last one */
+static void ngx_http_jpeg_filter_band_event_handler(ngx_event_t *ev) {
+	ngx_int_t                    rc;
+	ngx_connection_t            *c;
+	ngx_http_request_t          *r;
+	ngx_http_jpeg_filter_ctx_t  *ctx;
+
+	r = ev->data;
+	c = r->connection;
+
+	ngx_http_set_log_request(c->log, r);
+
+	ctx = ngx_http_get_module_ctx(r, ngx_http_jpeg_filter_module);
+
+	if(--ctx->bands_pending > 0) {
+		return;
+	}
+
+	ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "jpeg_filter: all bands are done");
+
+	r->main->blocked--;
+	r->aio = 0;
+
+	rc = ngx_http_jpeg_filter_band_join(ctx);
+
+	ctx->bands = NULL;
+
+	if(rc == NGX_DECLINED) {
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "jpeg_filter: can't transcode the image in bands, processing it as a whole");
+
+		rc = ngx_http_jpeg_filter_thread_post(r, ctx);
+		if(rc == NGX_AGAIN) {
+			return;
+		}
+	}
+
+	ctx->rc = rc;
+	ctx->task_done = 1;
+
+	/* This will call the body filter again without any data */
+	r->write_event_handler(r);
+
+	ngx_http_run_posted_requests(c);
+}
+
+/* Put the transcoded bands after the segments before the scan, with the restart markers in between */
+static ngx_int_t ngx_http_jpeg_filter_band_join(ngx_http_jpeg_filter_ctx_t *ctx) {
+	u_char                             *p, marker[2];
+	ngx_uint_t                          i;
+	ngx_http_jpeg_filter_band_t        *band;
+	ngx_http_jpeg_filter_transcoder_t  *t = ctx->transcoder;
+
+	for(i = 0; i < ctx->nbands; i++) {
+		if(ctx->bands[i].rc != NGX_OK) {
+			return NGX_DECLINED;
+		}
+	}
+
+	for(i = 0; i < ctx->nbands; i++) {
+		band = &ctx->bands[i];
+
+		if(i > 0) {
+			marker[0] = 0xff;
+			marker[1] = 0xd0 + ((band->first - 1) & 7);
+
+			ngx_http_jpeg_filter_transcode_copy(t, marker, 2);
+		}
+
+		ngx_http_jpeg_filter_transcode_copy(t, band->out, band->t.out - band->out);
+	}
+
+	p = (u_char *)"\xff\xd9";
+
+	ngx_http_jpeg_filter_transcode_copy(t, p, 2);
+
+	if(t->overflow == 1) {
+		return NGX_DECLINED;
+	}
+
+	ctx->out_image = ctx->out_buffer;
+	ctx->out_last = t->out;
+	ctx->transcoded = 1;
+
+	ngx_http_jpeg_filter_observe(ctx, NGX_HTTP_JPEG_FILTER_STAGE_CHAIN, ngx_http_jpeg_filter_usec() - ctx->bands_start);
+
+	ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ctx->log, 0, "jpeg_filter: transcoded image of %uz bytes into %uz bytes in %ui bands", (size_t)(ctx->in_last - ctx->in_image), (size_t)(t->out - ctx->out_buffer), ctx->nbands);
+
+	return NGX_OK;
+}
+#endif
+
+/* Build the key for the cache from the URI (or the configured key), the validators of the original image and the processing chain */
+static ngx_int_t ngx_http_jpeg_filter_cache_key(ngx_http_request_t *r, ngx_http_jpeg_filter_ctx_t *ctx) {
+	ngx_md5_t                     md5;
+	ngx_str_t                     key;
+	ngx_http_jpeg_filter_conf_t  *conf = ctx->conf;
+
+	if(conf->cache_key != NULL) {
+		if(ngx_http_complex_value(r, conf->cache_key, &key) != NGX_OK) {
+			return NGX_ERROR;
+		}
+	}
+	else {
+		key = r->uri;
+	}
+
+	/* Evaluate the processing chain because it is part of the key */
+	if(ngx_http_jpeg_filter_resolve(r, ctx) != NGX_OK) {
+		return NGX_ERROR;
+	}
+
+	ngx_md5_init(&md5);
+
+	ngx_md5_update(&md5, key.data, key.len);
+	ngx_md5_update(&md5, "\0", 1);
+
+	if(conf->cache_key == NULL && r->args.len != 0) {
+		ngx_md5_update(&md5, r->args.data, r->args.len);
+		ngx_md5_update(&md5, "\0", 1);
+	}
+
+	ngx_http_jpeg_filter_hash(r, ctx, &md5);
+
+	ngx_md5_final(ctx->cache_key, &md5);
+
+	return NGX_OK;
+}
+
+/* Add everything to the hash that determines the processed image besides the original image itself */
+static void ngx_http_jpeg_filter_hash(ngx_http_request_t *r, ngx_http_jpeg_filter_ctx_t *ctx, ngx_md5_t *md5) {
+	ngx_uint_t                       i;
+	ngx_http_jpeg_filter_conf_t     *conf = ctx->conf;
+	ngx_http_jpeg_filter_element_t  *felts;
+
+	/* The validators of the original image */
+	if(r->headers_out.etag != NULL) {
+		ngx_md5_update(md5, r->headers_out.etag->value.data, r->headers_out.etag->value.len);
+	}
+
+	ngx_md5_update(md5, "\0", 1);
+	ngx_md5_update(md5, &r->headers_out.last_modified_time, sizeof(time_t));
+
+	/* The output options */
+	ngx_md5_update(md5, &conf->max_pixel, sizeof(ngx_uint_t));
+	ngx_md5_update(md5, &conf->optimize, sizeof(ngx_uint_t));
+	ngx_md5_update(md5, &conf->progressive, sizeof(ngx_uint_t));
+	ngx_md5_update(md5, &conf->arithmetric, sizeof(ngx_flag_t));
+	ngx_md5_update(md5, &conf->transcode, sizeof(ngx_flag_t));
+
+	/* The processing chain as configured and with the evaluated values */
+	if(conf->filter_elements != NULL) {
+		felts = conf->filter_elements->elts;
+
+		for(i = 0; i < conf->filter_elements->nelts; i++) {
+			ngx_md5_update(md5, &felts[i].type, sizeof(ngx_uint_t));
+
+			ngx_md5_update(md5, felts[i].cv1.value.data, felts[i].cv1.value.len);
+			ngx_md5_update(md5, "\0", 1);
+			ngx_md5_update(md5, felts[i].cv2.value.data, felts[i].cv2.value.len);
+			ngx_md5_update(md5, "\0", 1);
+
+			if(felts[i].variable == 0) {
+				continue;
+			}
+
+			ngx_md5_update(md5, &ctx->values[i].val1.len, sizeof(size_t));
+			ngx_md5_update(md5, ctx->values[i].val1.data, ctx->values[i].val1.len);
+			ngx_md5_update(md5, &ctx->values[i].val2.len, sizeof(size_t));
+			ngx_md5_update(md5, ctx->values[i].val2.data, ctx->values[i].val2.len);
+		}
+	}
+
+	return;
+}
+
+/* Look for the processed image in the cache. On a hit, the processed image is copied to the context */
+static ngx_int_t ngx_http_jpeg_filter_cache_lookup(ngx_http_request_t *r, ngx_http_jpeg_filter_ctx_t *ctx) {
+	u_char                             *p;
+	ngx_http_jpeg_filter_cache_t       *cache;
+	ngx_http_jpeg_filter_cache_node_t  *cn;
+
+	ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "jpeg_filter: ngx_http_jpeg_filter_cache_lookup");
+
+	if(ngx_http_jpeg_filter_cache_key(r, ctx) != NGX_OK) {
+		return NGX_ERROR;
+	}
+
+	ctx->cache_lookup = 1;
+
+	cache = ctx->conf->cache_zone->data;
+
+	ngx_shmtx_lock(&cache->shpool->mutex);
+
+	cn = ngx_http_jpeg_filter_cache_find(cache, ctx->cache_key);
+
+	if(cn == NULL) {
+		ngx_shmtx_unlock(&cache->shpool->mutex);
+
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "jpeg_filter: cache miss");
+
+		return NGX_DECLINED;
+	}
+
+	/*
+	 * Copy the image because the entry might get evicted
+	 * by another worker while we are sending it.
+	 */
+	p = ngx_pnalloc(r->pool, cn->len);
+	if(p == NULL) {
+		ngx_shmtx_unlock(&cache->shpool->mutex);
+		return NGX_ERROR;
+	}
+
+	ngx_memcpy(p, cn->data, cn->len);
+
+	ctx->out_image = p;
+	ctx->out_last = p + cn->len;
+	ctx->out_bytes = cn->len;
+
+	/* Mark as recently used */
+	ngx_queue_remove(&cn->queue);
+	ngx_queue_insert_head(&cache->sh->queue, &cn->queue);
+
+	ngx_shmtx_unlock(&cache->shpool->mutex);
+
+	ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "jpeg_filter: cache hit (%uz bytes)", ctx->out_last - ctx->out_image);
+
+	ctx->cache_hit = 1;
+
+	return NGX_OK;
+}
+
+/* Store the processed image in the cache */
+static void ngx_http_jpeg_filter_cache_store(ngx_http_request_t *r, ngx_http_jpeg_filter_ctx_t *ctx) {
+	size_t                              len;
+	ngx_queue_t                        *q;
+	ngx_http_jpeg_filter_cache_t       *cache;
+	ngx_http_jpeg_filter_cache_node_t  *cn;
+
+	ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "jpeg_filter: ngx_http_jpeg_filter_cache_store");
+
+	if(ctx->cache_lookup == 0 || ctx->cache_hit == 1 || ctx->out_image == NULL) {
+		return;
+	}
+
+	cache = ctx->conf->cache_zone->data;
+
+	len = ctx->out_last - ctx->out_image;
+
+	/* Don't evict anything for an image that wouldn't fit anyways */
+	if(len > cache->max_size) {
+		ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "jpeg_filter: image with %uz bytes is too big for the cache \"%V\"", len, &ctx->conf->cache_zone->shm.name);
+		return;
+	}
+
+	ngx_shmtx_lock(&cache->shpool->mutex);
+
+	/* Another worker might have been faster */
+	cn = ngx_http_jpeg_filter_cache_find(cache, ctx->cache_key);
+	if(cn != NULL) {
+		ngx_shmtx_unlock(&cache->shpool->mutex);
+		return;
+	}
+
+	/* Evict the least recently used images until there's enough space */
+	for( ;; ) {
+		cn = ngx_slab_alloc_locked(cache->shpool, offsetof(ngx_http_jpeg_filter_cache_node_t, data) + len);
+		if(cn != NULL) {
+			break;
+		}
+
+		if(ngx_queue_empty(&cache->sh->queue)) {
+			ngx_shmtx_unlock(&cache->shpool->mutex);
+
+			ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "jpeg_filter: image with %uz bytes is too big for the cache \"%V\"", len, &ctx->conf->cache_zone->shm.name);
+
+			return;
+		}
+
+		q = ngx_queue_last(&cache->sh->queue);
+		ngx_queue_remove(q);
+
+		cn = ngx_queue_data(q, ngx_http_jpeg_filter_cache_node_t, queue);
+
+		ngx_rbtree_delete(&cache->sh->rbtree, &cn->node);
+		ngx_slab_free_locked(cache->shpool, cn);
+	}
+
+	ngx_memcpy(&cn->node.key, ctx->cache_key, sizeof(ngx_rbtree_key_t));
+	ngx_memcpy(cn->key, ctx->cache_key, sizeof(cn->key));
+
+	cn->expire = ngx_time() + ctx->conf->cache_valid;
+	cn->len = len;
+
+	ngx_memcpy(cn->data, ctx->out_image, len);
+
+	ngx_rbtree_insert(&cache->sh->rbtree, &cn->node);
+	ngx_queue_insert_head(&cache->sh->queue, &cn->queue);
+
+	ngx_shmtx_unlock(&cache->shpool->mutex);
+
+	return;
+}
+
+/* Find an image in the cache. Expired images are removed. The cache must be locked */
+static ngx_http_jpeg_filter_cache_node_t *ngx_http_jpeg_filter_cache_find(ngx_http_jpeg_filter_cache_t *cache, u_char *key) {
+	ngx_http_jpeg_filter_cache_node_t  *cn;
+
+	cn = (ngx_http_jpeg_filter_cache_node_t *)ngx_http_jpeg_filter_cache_rbtree_lookup(&cache->sh->rbtree, key);
+	if(cn == NULL) {
+		return NULL;
+	}
+
+	if(cn->expire < ngx_time()) {
+		ngx_queue_remove(&cn->queue);
+		ngx_rbtree_delete(&cache->sh->rbtree, &cn->node);
+		ngx_slab_free_locked(cache->shpool, cn);
+
+		return NULL;
+	}
+
+	return cn;
+}
+
+/*
+ * Find a node by its key in an rbtree. The nodes must start like
+ * ngx_http_jpeg_filter_cache_node_t, i.e. with the rbtree node, the queue, and the key.
+ */
+static ngx_rbtree_node_t *ngx_http_jpeg_filter_cache_rbtree_lookup(ngx_rbtree_t *rbtree, u_char *key) {
+	ngx_int_t                           rc;
+	ngx_rbtree_key_t                    node_key;
+	ngx_rbtree_node_t                  *node, *sentinel;
+	ngx_http_jpeg_filter_cache_node_t  *cn;
+
+	ngx_memcpy(&node_key, key, sizeof(ngx_rbtree_key_t));
+
+	node = rbtree->root;
+	sentinel = rbtree->sentinel;
+
+	while(node != sentinel) {
+		if(node_key < node->key) {
+			node = node->left;
+			continue;
+		}
+
+		if(node_key > node->key) {
+			node = node->right;
+			continue;
+		}
+
+		cn = (ngx_http_jpeg_filter_cache_node_t *)node;
+
+		rc = ngx_memcmp(key, cn->key, sizeof(cn->key));
+
+		if(rc == 0) {
+			return node;
+		}
+
+		node = (rc < 0) ? node->left : node->right;
+	}
+
+	return NULL;
+}
+
+/* Insert a node into the rbtree. Nodes with the same rbtree key are ordered by their full key */
+static void ngx_http_jpeg_filter_cache_rbtree_insert_value(ngx_rbtree_node_t *temp, ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel) {
+	ngx_rbtree_node_t                  **p;
+	ngx_http_jpeg_filter_cache_node_t   *cn, *cnt;
+
+	for( ;; ) {
+		if(node->key < temp->key) {
+			p = &temp->left;
+		}
+		else if(node->key > temp->key) {
+			p = &temp->right;
+		}
+		else {
+			cn = (ngx_http_jpeg_filter_cache_node_t *)node;
+			cnt = (ngx_http_jpeg_filter_cache_node_t *)temp;
+
+			p = (ngx_memcmp(cn->key, cnt->key, sizeof(cn->key)) < 0) ? &temp->left : &temp->right;
+		}
+
+		if(*p == sentinel) {
+			break;
+		}
+
+		temp = *p;
+	}
+
+	*p = node;
+	node->parent = temp;
+	node->left = sentinel;
+	node->right = sentinel;
+	ngx_rbt_red(node);
+}
+
+/* Initialize the shared memory zone of the cache */
+static ngx_int_t ngx_http_jpeg_filter_cache_init_zone(ngx_shm_zone_t *shm_zone, void *data) {
+	ngx_http_jpeg_filter_cache_t *ocache = data;
+
+	size_t                              len;
+	ngx_queue_t                        *q;
+	ngx_http_jpeg_filter_cache_t       *cache;
+	ngx_http_jpeg_filter_cache_node_t  *cn;
+
+	cache = shm_zone->data;
+
+	cache->max_size = shm_zone->shm.size / NGX_HTTP_JPEG_FILTER_CACHE_FRACTION;
+
+	if(ocache != NULL) {
+		cache->sh = ocache->sh;
+		cache->shpool = ocache->shpool;
+
+		/*
+		 * The configuration has been reloaded and the dropons might
+		 * have changed. Don't deliver any images processed with the old configuration.
+		 */
+		ngx_shmtx_lock(&cache->shpool->mutex);
+
+		while(!ngx_queue_empty(&cache->sh->queue)) {
+			q = ngx_queue_last(&cache->sh->queue);
+			ngx_queue_remove(q);
+
+			cn = ngx_queue_data(q, ngx_http_jpeg_filter_cache_node_t, queue);
+
+			ngx_rbtree_delete(&cache->sh->rbtree, &cn->node);
+			ngx_slab_free_locked(cache->shpool, cn);
+		}
+
+		ngx_shmtx_unlock(&cache->shpool->mutex);
+
+		return NGX_OK;
+	}
+
+	cache->shpool = (ngx_slab_pool_t *)shm_zone->shm.addr;
+
+	if(shm_zone->shm.exists) {
+		cache->sh = cache->shpool->data;
+		return NGX_OK;
+	}
+
+	cache->sh = ngx_slab_alloc(cache->shpool, sizeof(ngx_http_jpeg_filter_cache_sh_t));
+	if(cache->sh == NULL) {
+		return NGX_ERROR;
+	}
+
+	cache->shpool->data = cache->sh;
+
+	ngx_rbtree_init(&cache->sh->rbtree, &cache->sh->sentinel, ngx_http_jpeg_filter_cache_rbtree_insert_value);
+	ngx_queue_init(&cache->sh->queue);
+
+	len = sizeof(" in jpeg_filter_cache zone \"\"") + shm_zone->shm.name.len;
+
+	cache->shpool->log_ctx = ngx_slab_alloc(cache->shpool, len);
+	if(cache->shpool->log_ctx == NULL) {
+		return NGX_ERROR;
+	}
+
+	ngx_sprintf(cache->shpool->log_ctx, " in jpeg_filter_cache zone \"%V\"%Z", &shm_zone->shm.name);
+
+	return NGX_OK;
+}
+
+#if (NGX_HTTP_CACHE)
+/*
+ * Look up the processed image in the cache on disk. Returns NGX_OK if it has been found, NGX_AGAIN
+ * if the cache file is being read in a thread or with AIO, and NGX_DECLINED otherwise. Call it again
+ * after NGX_AGAIN. The functions of the file cache work on r->cache, which might belong to the
+ * proxy cache of the request. Our entry is only put there while they are called.
+ */
+static ngx_int_t ngx_http_jpeg_filter_store_lookup(ngx_http_request_t *r, ngx_http_jpeg_filter_ctx_t *ctx) {
+	u_char                       *p, hash[16];
+	ngx_md5_t                     md5;
+	ngx_int_t                     rc;
+	ngx_str_t                    *key;
+	ngx_pool_cleanup_t           *cln;
+	ngx_http_cache_t             *c, *saved;
+	ngx_http_jpeg_filter_conf_t  *conf = ctx->conf;
+
+	ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "jpeg_filter: ngx_http_jpeg_filter_store_lookup");
+
+	if(ctx->store_state == NGX_HTTP_JPEG_FILTER_STORE_MISS || ctx->store_state == NGX_HTTP_JPEG_FILTER_STORE_DONE) {
+		return NGX_DECLINED;
+	}
+
+	saved = r->cache;
+
+	if(ctx->store == NULL) {
+		ctx->store_state = NGX_HTTP_JPEG_FILTER_STORE_DONE;
+
+		if(ngx_http_file_cache_new(r) != NGX_OK) {
+			r->cache = saved;
+			return NGX_DECLINED;
+		}
+
+		c = r->cache;
+		r->cache = saved;
+
+		/* The key as configured ... */
+		key = ngx_array_push(&c->keys);
+		if(key == NULL) {
+			return NGX_DECLINED;
+		}
+
+		if(conf->store_key != NULL) {
+			if(ngx_http_complex_value(r, conf->store_key, key) != NGX_OK) {
+				return NGX_DECLINED;
+			}
+		}
+		else if(r->args.len != 0) {
+			key->len = r->uri.len + 1 + r->args.len;
+			key->data = ngx_pnalloc(r->pool, key->len);
+			if(key->data == NULL) {
+				return NGX_DECLINED;
+			}
+
+			p = ngx_cpymem(key->data, r->uri.data, r->uri.len);
+			*p++ = '?';
+			ngx_memcpy(p, r->args.data, r->args.len);
+		}
+		else {
+			*key = r->uri;
+		}
+
+		/* ... and everything else that determines the processed image */
+		if(ngx_http_jpeg_filter_resolve(r, ctx) != NGX_OK) {
+			return NGX_DECLINED;
+		}
+
+		ngx_md5_init(&md5);
+		ngx_http_jpeg_filter_hash(r, ctx, &md5);
+		ngx_md5_final(hash, &md5);
+
+		key = ngx_array_push(&c->keys);
+		if(key == NULL) {
+			return NGX_DECLINED;
+		}
+
+		key->data = ngx_pnalloc(r->pool, sizeof(hash) * 2 + 1);
+		if(key->data == NULL) {
+			return NGX_DECLINED;
+		}
+
+		*key->data = ' ';
+		key->len = ngx_hex_dump(key->data + 1, hash, sizeof(hash)) - key->data;
+
+		c->file_cache = conf->store_zone->data;
+		c->min_uses = 1;
+
+		r->cache = c;
+
+		ngx_http_file_cache_create_key(r);
+
+		/* The processed image follows right after the header of the cache file */
+		c->body_start = c->header_start;
+
+		ctx->store = c;
+	}
+
+	c = ctx->store;
+	r->cache = c;
+
+	rc = ngx_http_file_cache_open(r);
+
+	r->cache = saved;
+
+	switch(rc) {
+	case NGX_OK:
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "jpeg_filter: store hit (%O bytes)", c->length - (off_t)c->body_start);
+
+		ctx->store_state = NGX_HTTP_JPEG_FILTER_STORE_DONE;
+		ctx->out_bytes = c->length - c->body_start;
+
+		return NGX_OK;
+	case NGX_AGAIN:
+		ctx->store_state = NGX_HTTP_JPEG_FILTER_STORE_READING;
+
+		return NGX_AGAIN;
+	case NGX_DECLINED:
+	case NGX_HTTP_CACHE_STALE:
+		/* Not in the cache or expired. This request will store it */
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "jpeg_filter: store miss");
+
+		cln = ngx_pool_cleanup_add(r->pool, 0);
+		if(cln == NULL) {
+			ctx->store_state = NGX_HTTP_JPEG_FILTER_STORE_DONE;
+			return NGX_DECLINED;
+		}
+
+		cln->handler = ngx_http_jpeg_filter_store_cleanup;
+		cln->data = ctx;
+
+		ctx->store_state = NGX_HTTP_JPEG_FILTER_STORE_MISS;
+
+		return NGX_DECLINED;
+	default:
+		/* Another request is storing it, or the cache file is broken */
+		ctx->store_state = NGX_HTTP_JPEG_FILTER_STORE_DONE;
+
+		return NGX_DECLINED;
+	}
+}
+
+/* Write the processed image into a temporary file and move it into the cache on disk */
+static void ngx_http_jpeg_filter_store_update(ngx_http_request_t *r, ngx_http_jpeg_filter_ctx_t *ctx) {
+	u_char                 *buf;
+	size_t                  len;
+	ngx_temp_file_t        *tf = NULL;
+	ngx_http_cache_t       *c = ctx->store, *saved;
+	ngx_http_file_cache_t  *cache = c->file_cache;
+
+	ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "jpeg_filter: ngx_http_jpeg_filter_store_update");
+
+	ctx->store_state = NGX_HTTP_JPEG_FILTER_STORE_DONE;
+
+	len = ctx->out_last - ctx->out_image;
+
+	saved = r->cache;
+	r->cache = c;
+
+	c->valid_sec = ngx_time() + ctx->conf->store_valid;
+	c->date = ngx_time();
+	c->last_modified = r->headers_out.last_modified_time;
+
+	buf = ngx_pnalloc(r->pool, c->header_start);
+	if(buf == NULL) {
+		goto failed;
+	}
+
+	if(ngx_http_file_cache_set_header(r, buf) != NGX_OK) {
+		goto failed;
+	}
+
+	tf = ngx_pcalloc(r->pool, sizeof(ngx_temp_file_t));
+	if(tf == NULL) {
+		goto failed;
+	}
+
+	tf->file.fd = NGX_INVALID_FILE;
+	tf->file.log = r->connection->log;
+	tf->path = cache->temp_path;
+	tf->pool = r->pool;
+	tf->persistent = 1;
+	tf->access = NGX_FILE_OWNER_ACCESS;
+
+	if(ngx_create_temp_file(&tf->file, tf->path, tf->pool, tf->persistent, 0, tf->access) != NGX_OK) {
+		goto failed;
+	}
+
+	if(ngx_write_file(&tf->file, buf, c->header_start, 0) == NGX_ERROR) {
+		goto failed;
+	}
+
+	if(ngx_write_file(&tf->file, ctx->out_image, len, c->header_start) == NGX_ERROR) {
+		goto failed;
+	}
+
+	ngx_http_file_cache_update(r, tf);
+
+	r->cache = saved;
+
+	return;
+
+failed:
+	ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "jpeg_filter: failed to store the processed image in \"%V\"", &c->file.name);
+
+	ngx_http_file_cache_free(c, tf);
+
+	r->cache = saved;
+
+	return;
+}
+
+/* Give up the entry in the cache on disk if the image has not been processed after a miss */
+static void ngx_http_jpeg_filter_store_cleanup(void *data) {
+	ngx_http_jpeg_filter_ctx_t *ctx = data;
+
+	if(ctx->store_state == NGX_HTTP_JPEG_FILTER_STORE_MISS) {
+		ngx_http_file_cache_free(ctx->store, NULL);
+	}
+
+	return;
+}
+
+/* Check whether a zone is (file_cache = 1) or is not (file_cache = 0) one of jpeg_filter_cache_path */
+static ngx_int_t ngx_http_jpeg_filter_store_check(ngx_conf_t *cf, ngx_shm_zone_t *zone, ngx_uint_t file_cache) {
+	ngx_uint_t                         i;
+	ngx_http_file_cache_t            **caches;
+	ngx_http_jpeg_filter_main_conf_t  *mcf;
+
+	mcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_jpeg_filter_module);
+
+	caches = mcf->caches.elts;
+
+	for(i = 0; i < mcf->caches.nelts; i++) {
+		if(caches[i]->shm_zone == zone) {
+			break;
+		}
+	}
+
+	if((i < mcf->caches.nelts) == (file_cache == 1)) {
+		return NGX_OK;
+	}
+
+	if(file_cache == 1) {
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "jpeg_filter: \"jpeg_filter_store\" zone \"%V\" is unknown", &zone->shm.name);
+	}
+	else {
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "jpeg_filter: \"jpeg_filter_cache\" zone \"%V\" is already used by \"jpeg_filter_cache_path\"", &zone->shm.name);
+	}
+
+	return NGX_ERROR;
+}
+#endif
+
+/* Load a dynamic dropon from files or bytestreams */
+static ngx_int_t ngx_http_jpeg_filter_dropon_load(mj_dropon_t *d, ngx_uint_t type, ngx_str_t *val1, ngx_str_t *val2, ngx_log_t *log) {
+	switch(type) {
+		case NGX_HTTP_JPEG_FILTER_TYPE_DROPON_FILE1:
+			if(mj_read_dropon_from_file(d, (char *)val1->data, NULL, MJ_BLEND_FULL) != MJ_OK) {
+				ngx_log_error(NGX_LOG_WARN, log, 0, "jpeg_filter: dropon could not load the file \"%s\"", val1->data);
+				return NGX_ERROR;
+			}
+
+			break;
+		case NGX_HTTP_JPEG_FILTER_TYPE_DROPON_FILE2:
+			if(val2->data == NULL || mj_read_dropon_from_file(d, (char *)val1->data, (char *)val2->data, MJ_BLEND_FULL) != MJ_OK) {
+				ngx_log_error(NGX_LOG_WARN, log, 0, "jpeg_filter: dropon could not load the file \"%s\" or \"%s\"", val1->data, val2->data ? val2->data : (u_char *)"");
+				return NGX_ERROR;
+			}
+
+			break;
+		case NGX_HTTP_JPEG_FILTER_TYPE_DROPON_MEMORY1:
+			if(mj_read_dropon_from_memory(d, (char *)val1->data, val1->len, NULL, 0, MJ_BLEND_FULL) != MJ_OK) {
+				ngx_log_error(NGX_LOG_WARN, log, 0, "jpeg_filter: dropon could not load the bitstream");
+				return NGX_ERROR;
+			}
+
+			break;
+		case NGX_HTTP_JPEG_FILTER_TYPE_DROPON_MEMORY2:
+			if(val2->data == NULL || mj_read_dropon_from_memory(d, (char *)val1->data, val1->len, (char *)val2->data, val2->len, MJ_BLEND_FULL) != MJ_OK) {
+				ngx_log_error(NGX_LOG_WARN, log, 0, "jpeg_filter: dropon could not load the bitstream");
+				return NGX_ERROR;
+			}
+
+			break;
+		default:
+			return NGX_ERROR;
+	}
+
+	return NGX_OK;
+}
+
+/*
+ * Build the key of a dynamic dropon. Files are identified by their path, inode, size, and mtime.
+ * Bytestreams are identified by their content.
+ */
+static ngx_int_t ngx_http_jpeg_filter_dropon_cache_key(u_char *key, ngx_uint_t type, ngx_str_t *val1, ngx_str_t *val2, ngx_log_t *log) {
+	ngx_md5_t        md5;
+	ngx_str_t       *val[2];
+	ngx_uint_t       i, n;
+	ngx_file_info_t  fi;
+
+	val[0] = val1;
+	val[1] = val2;
+
+	n = 1;
+	if(type == NGX_HTTP_JPEG_FILTER_TYPE_DROPON_FILE2 || type == NGX_HTTP_JPEG_FILTER_TYPE_DROPON_MEMORY2) {
+		n = 2;
+	}
+
+	ngx_md5_init(&md5);
+	ngx_md5_update(&md5, &type, sizeof(ngx_uint_t));
+
+	for(i = 0; i < n; i++) {
+		if(val[i]->data == NULL) {
+			return NGX_DECLINED;
+		}
+
+		ngx_md5_update(&md5, &val[i]->len, sizeof(size_t));
+		ngx_md5_update(&md5, val[i]->data, val[i]->len);
+
+		if(type == NGX_HTTP_JPEG_FILTER_TYPE_DROPON_FILE1 || type == NGX_HTTP_JPEG_FILTER_TYPE_DROPON_FILE2) {
+			if(ngx_file_info(val[i]->data, &fi) == NGX_FILE_ERROR) {
+				ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0, "jpeg_filter: dropon cache can't stat \"%s\"", val[i]->data);
+				return NGX_DECLINED;
+			}
+
+			ngx_md5_update(&md5, &fi.st_ino, sizeof(fi.st_ino));
+			ngx_md5_update(&md5, &fi.st_size, sizeof(fi.st_size));
+			ngx_md5_update(&md5, &fi.st_mtime, sizeof(fi.st_mtime));
+		}
+	}
+
+	ngx_md5_final(key, &md5);
+
+	return NGX_OK;
+}
+
+/*
+ * Get a dynamic dropon from the cache or load it. The dropon must be released
+ * with ngx_http_jpeg_filter_dropon_cache_release() after use. Returns NULL if the dropon can't be loaded.
+ */
+static ngx_http_jpeg_filter_dropon_node_t *ngx_http_jpeg_filter_dropon_cache_get(ngx_uint_t type, ngx_str_t *val1, ngx_str_t *val2, ngx_log_t *log) {
+	u_char                               key[16];
+	ngx_int_t                            rc;
+	ngx_queue_t                         *q;
+	ngx_http_jpeg_filter_dropon_node_t  *dn, *en;
+	ngx_http_jpeg_filter_dropon_cache_t *cache = ngx_http_jpeg_filter_dropon_cache;
+
+	rc = ngx_http_jpeg_filter_dropon_cache_key(key, type, val1, val2, log);
+
+	if(rc == NGX_OK) {
+		ngx_http_jpeg_filter_dropon_cache_lock(log);
+
+		dn = (ngx_http_jpeg_filter_dropon_node_t *)ngx_http_jpeg_filter_cache_rbtree_lookup(&cache->rbtree, key);
+
+		if(dn != NULL) {
+			dn->refs++;
+			cache->hits++;
+
+			/* Mark as recently used */
+			ngx_queue_remove(&dn->queue);
+			ngx_queue_insert_head(&cache->queue, &dn->queue);
+
+			ngx_http_jpeg_filter_dropon_cache_unlock(log);
+
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "jpeg_filter: dropon cache hit");
+
+			return dn;
+		}
+
+		cache->misses++;
+
+		ngx_http_jpeg_filter_dropon_cache_unlock(log);
+
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "jpeg_filter: dropon cache miss");
+	}
+
+	/* Load the dropon without holding the lock */
+	dn = ngx_alloc(sizeof(ngx_http_jpeg_filter_dropon_node_t), log);
+	if(dn == NULL) {
+		return NULL;
+	}
+
+	ngx_memzero(dn, sizeof(ngx_http_jpeg_filter_dropon_node_t));
+
+	mj_init_dropon(&dn->dropon);
+
+	if(ngx_http_jpeg_filter_dropon_load(&dn->dropon, type, val1, val2, log) != NGX_OK) {
+		mj_free_dropon(&dn->dropon);
+		ngx_free(dn);
+
+		return NULL;
+	}
+
+	dn->refs = 1;
+
+	/* The decoded dropon has three color components and an alpha channel */
+	dn->size = sizeof(ngx_http_jpeg_filter_dropon_node_t) + (size_t)dn->dropon.width * dn->dropon.height * 4;
+
+	if(rc != NGX_OK || dn->size > cache->max_size) {
+		/* This dropon can't be cached. It will be freed on release */
+		return dn;
+	}
+
+	ngx_memcpy(&dn->node.key, key, sizeof(ngx_rbtree_key_t));
+	ngx_memcpy(dn->key, key, sizeof(dn->key));
+
+	ngx_http_jpeg_filter_dropon_cache_lock(log);
+
+	/* Another thread might have been faster */
+	en = (ngx_http_jpeg_filter_dropon_node_t *)ngx_http_jpeg_filter_cache_rbtree_lookup(&cache->rbtree, key);
+
+	if(en != NULL) {
+		en->refs++;
+
+		ngx_http_jpeg_filter_dropon_cache_unlock(log);
+
+		mj_free_dropon(&dn->dropon);
+		ngx_free(dn);
+
+		return en;
+	}
+
+	/* Evict the least recently used dropons that are not in use until there's enough space */
+	q = ngx_queue_last(&cache->queue);
+
+	while(cache->size + dn->size > cache->max_size && q != ngx_queue_sentinel(&cache->queue)) {
+		en = ngx_queue_data(q, ngx_http_jpeg_filter_dropon_node_t, queue);
+
+		q = ngx_queue_prev(q);
+
+		if(en->refs != 0) {
+			continue;
+		}
+
+		ngx_queue_remove(&en->queue);
+		ngx_rbtree_delete(&cache->rbtree, &en->node);
+
+		cache->size -= en->size;
+		cache->evictions++;
+
+		mj_free_dropon(&en->dropon);
+		ngx_free(en);
+	}
+
+	if(cache->size + dn->size <= cache->max_size) {
+		ngx_rbtree_insert(&cache->rbtree, &dn->node);
+		ngx_queue_insert_head(&cache->queue, &dn->queue);
+
+		cache->size += dn->size;
+
+		dn->cached = 1;
+	}
+
+	ngx_http_jpeg_filter_dropon_cache_unlock(log);
+
+	return dn;
+}
+
+/* Release a dynamic dropon after use */
+static void ngx_http_jpeg_filter_dropon_cache_release(ngx_http_jpeg_filter_dropon_node_t *dn, ngx_log_t *log) {
+	if(dn->cached == 0) {
+		/* Nobody else knows about this dropon */
+		mj_free_dropon(&dn->dropon);
+		ngx_free(dn);
+
+		return;
+	}
+
+	ngx_http_jpeg_filter_dropon_cache_lock(log);
+
+	dn->refs--;
+
+	ngx_http_jpeg_filter_dropon_cache_unlock(log);
+
+	return;
+}
+
+static void ngx_http_jpeg_filter_dropon_cache_lock(ngx_log_t *log) {
+#if (NGX_THREADS)
+	ngx_thread_mutex_lock(&ngx_http_jpeg_filter_dropon_cache->mutex, log);
+#endif
+
+	return;
+}
+
+static void ngx_http_jpeg_filter_dropon_cache_unlock(ngx_log_t *log) {
+#if (NGX_THREADS)
+	ngx_thread_mutex_unlock(&ngx_http_jpeg_filter_dropon_cache->mutex, log);
+#endif
+
+	return;
+}
+
+/* A function similar to ngx_atoi that can handle negative numbers */
+static ngx_int_t ngx_atois(u_char *line, size_t n) {
+	ngx_int_t  value, sign, cutoff, cutlim;
+
+	if(n == 0) {
+		return NGX_ERROR;
+	}
+
+	cutoff = NGX_MAX_INT_T_VALUE / 10;
+	cutlim = NGX_MAX_INT_T_VALUE % 10;
+
+	sign = 1;
+	if(*line == '-') {
+		sign = -1;
+		line++;
+		n--;
+	}
+
+	for(value = 0; n--; line++) {
+		if(*line < '0' || *line > '9') {
+			return NGX_ERROR;
+		}
+
+		if(value >= cutoff && (value > cutoff || *line - '0' > cutlim)) {
+			return NGX_ERROR;
+		}
+
+		value = value * 10 + (*line - '0');
+	}
+
+	return (sign * value);
+}
+
+/* Interpret an evaluated complex value as an int */
+static ngx_int_t ngx_http_jpeg_filter_get_int_value(ngx_str_t *val, ngx_int_t defval) {
+	if(val->data == NULL) {
+		return defval;
+	}
+
+	return ngx_atois(val->data, val->len);
+}
+
+/* Check whether a value is a valid integer. A value that is not known yet is valid */
+static ngx_uint_t ngx_http_jpeg_filter_is_int_value(ngx_str_t *val) {
+	if(val->data == NULL) {
+		return 1;
+	}
+
+	if(ngx_atois(val->data, val->len) != NGX_ERROR) {
+		return 1;
+	}
+
+	/* ngx_atois() can't tell an error from -1 */
+	return (val->len == 2 && val->data[0] == '-' && val->data[1] == '1') ? 1 : 0;
+}
+
+/* Get the complex value as a string */
+static ngx_int_t ngx_http_jpeg_filter_get_string_value(ngx_http_request_t *r, ngx_http_complex_value_t *cv, ngx_str_t *val) {
+	if(ngx_http_complex_value(r, cv, val) != NGX_OK) {
+		return NGX_ERROR;
+	}
+
+	/* Subtract 1 from the length because we compiled the complex value with 'zero=1' */
+	if(cv->lengths != NULL && val->len != 0) {
+		val->len--;
+	}
+
+	return NGX_OK;
+}
+
+/*
+ * Allocate a buffer for an image that lives until the request is done. Without jpeg_filter_arena, it is allocated
+ * from the pool. Otherwise the smallest free block of the arena that fits is taken, or a new one is mapped. Reusing
+ * the blocks saves mapping and faulting in the pages for every image.
+ */
+static void *ngx_http_jpeg_filter_arena_alloc(ngx_http_request_t *r, size_t size) {
+	u_char                        *p;
+	size_t                         align;
+	ngx_queue_t                   *q;
+	ngx_pool_cleanup_t            *cln;
+	ngx_http_jpeg_filter_block_t  *block, *best = NULL;
+	ngx_http_jpeg_filter_arena_t  *arena = ngx_http_jpeg_filter_arena;
+
+	if(arena == NULL) {
+		return ngx_palloc(r->pool, size);
+	}
+
+	cln = ngx_pool_cleanup_add(r->pool, 0);
+	if(cln == NULL) {
+		return NULL;
+	}
+
+	size += sizeof(ngx_http_jpeg_filter_block_t);
+
+	/* Don't waste a block that is more than twice as large */
+	for(q = ngx_queue_head(&arena->queue); q != ngx_queue_sentinel(&arena->queue); q = ngx_queue_next(q)) {
+		block = ngx_queue_data(q, ngx_http_jpeg_filter_block_t, queue);
+
+		if(block->size >= size && block->size <= 2 * size && (best == NULL || block->size < best->size)) {
+			best = block;
+		}
+	}
+
+	if(best != NULL) {
+		ngx_queue_remove(&best->queue);
+		arena->size -= best->size;
+		arena->hits++;
+
+		ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "jpeg_filter: reusing arena block of %uz bytes for %uz bytes", best->size, size);
+	}
+	else {
+		align = (arena->hugepages == 1 && size >= NGX_HTTP_JPEG_FILTER_HUGEPAGE) ? NGX_HTTP_JPEG_FILTER_HUGEPAGE : ngx_pagesize;
+		size = ngx_align(size, align);
+
+		p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON, -1, 0);
+		if(p == MAP_FAILED) {
+			ngx_log_error(NGX_LOG_ERR, r->connection->log, ngx_errno, "jpeg_filter: mmap(%uz) failed", size);
+			return NULL;
+		}
+
+#ifdef MADV_HUGEPAGE
+		if(align == NGX_HTTP_JPEG_FILTER_HUGEPAGE) {
+			(void)madvise(p, size, MADV_HUGEPAGE);
+		}
+#endif
+
+		best = (ngx_http_jpeg_filter_block_t *)p;
+		best->size = size;
+
+		arena->misses++;
+
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "jpeg_filter: mapped arena block of %uz bytes", size);
+	}
+
+
+	cln->handler = ngx_http_jpeg_filter_arena_release;
+	cln->data = best;
+
+	return (u_char *)best + sizeof(ngx_http_jpeg_filter_block_t);
+}
+
+/* Give a buffer from ngx_http_jpeg_filter_arena_alloc() back before the request is done */
+static void ngx_http_jpeg_filter_arena_free(ngx_http_request_t *r, void *p) {
+	ngx_pool_cleanup_t  *c;
+
+	if(ngx_http_jpeg_filter_arena == NULL) {
+		ngx_pfree(r->pool, p);
+		return;
+	}
+
+	for(c = r->pool->cleanup; c; c = c->next) {
+		if(c->handler == ngx_http_jpeg_filter_arena_release && (u_char *)c->data + sizeof(ngx_http_jpeg_filter_block_t) == p) {
+			ngx_http_jpeg_filter_arena_release(c->data);
+			c->handler = NULL;
+			return;
+		}
+	}
+
+	return;
+}
+
+/* Give a block back to the arena. The least recently used blocks are unmapped if the arena gets too large */
+static void ngx_http_jpeg_filter_arena_release(void *data) {
+	ngx_queue_t                   *q;
+	ngx_http_jpeg_filter_block_t  *block = data, *lru;
+	ngx_http_jpeg_filter_arena_t  *arena = ngx_http_jpeg_filter_arena;
+
+	if(arena == NULL || block->size > arena->max_size) {
+		ngx_http_jpeg_filter_arena_unmap(block, ngx_cycle->log);
+		return;
+	}
+
+	while(arena->size + block->size > arena->max_size) {
+		q = ngx_queue_last(&arena->queue);
+		ngx_queue_remove(q);
+
+		lru = ngx_queue_data(q, ngx_http_jpeg_filter_block_t, queue);
+		arena->size -= lru->size;
+
+		ngx_http_jpeg_filter_arena_unmap(lru, ngx_cycle->log);
+	}
+
+	ngx_queue_insert_head(&arena->queue, &block->queue);
+	arena->size += block->size;
+
+	return;
+}
+
+static void ngx_http_jpeg_filter_arena_unmap(ngx_http_jpeg_filter_block_t *block, ngx_log_t *log) {
+	if(munmap(block, block->size) == -1) {
+		ngx_log_error(NGX_LOG_ALERT, log, ngx_errno, "jpeg_filter: munmap() failed");
+	}
+
+	return;
+}
+
+/* Cleanup after the request finished */
+static void ngx_http_jpeg_filter_cleanup(void *data) {
+	ngx_http_jpeg_filter_ctx_t *ctx = data;
+
+	/* Only an image that didn't fit into the buffer from the pool has been allocated by the encoder */
+	if(ctx->out_image != NULL && ctx->out_image != ctx->out_buffer) {
+		free(ctx->out_image);
+	}
+
+	return;
+}
+
+/* Content handler for jpeg_filter_status. Prints the metrics of all locations in the Prometheus text format */
+static ngx_int_t ngx_http_jpeg_filter_status_handler(ngx_http_request_t *r) {
+	u_char                                  *p, **labels;
+	size_t                                   size;
+	ngx_int_t                                rc;
+	ngx_buf_t                               *b;
+	ngx_uint_t                               i, j, k, n, count;
+	ngx_chain_t                              out;
+	ngx_http_jpeg_filter_metrics_t          *m;
+	ngx_http_jpeg_filter_main_conf_t        *mcf;
+	ngx_http_jpeg_filter_status_location_t  *loc;
+
+	if(!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+		return NGX_HTTP_NOT_ALLOWED;
+	}
+
+	rc = ngx_http_discard_request_body(r);
+	if(rc != NGX_OK) {
+		return rc;
+	}
+
+	mcf = ngx_http_get_module_main_conf(r, ngx_http_jpeg_filter_module);
+
+	if(mcf->status_zone == NULL || mcf->status_zone->data == NULL) {
+		return NGX_HTTP_NO_CONTENT;
+	}
+
+	m = mcf->status_zone->data;
+	loc = mcf->locations.elts;
+	n = mcf->locations.nelts;
+
+	/* The labels of the locations. Every character may have to be escaped */
+	labels = ngx_palloc(r->pool, n * sizeof(u_char *));
+	if(labels == NULL) {
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	size = 4096;
+
+	for(i = 0; i < n; i++) {
+		labels[i] = ngx_pnalloc(r->pool, sizeof("server=\"\",location=\"\",instance=\"\"") + 2 * (loc[i].server.len + loc[i].location.len) + NGX_INT_T_LEN);
+		if(labels[i] == NULL) {
+			return NGX_HTTP_INTERNAL_SERVER_ERROR;
+		}
+
+		p = ngx_cpymem(labels[i], "server=\"", sizeof("server=\"") - 1);
+		p = ngx_http_jpeg_filter_status_escape(p, &loc[i].server);
+		p = ngx_cpymem(p, "\",location=\"", sizeof("\",location=\"") - 1);
+		p = ngx_http_jpeg_filter_status_escape(p, &loc[i].location);
+		*p++ = '"';
+
+		/* Tell apart locations with the same names, e.g. in servers without a server_name */
+		if(loc[i].instance != 0) {
+			p = ngx_sprintf(p, ",instance=\"%ui\"", loc[i].instance);
+		}
+
+		*p = '\0';
+
+		size += (NGX_HTTP_JPEG_FILTER_RESULTS + 4 + NGX_HTTP_JPEG_FILTER_STAGES * (NGX_HTTP_JPEG_FILTER_BUCKETS + 3) + 2 * NGX_HTTP_JPEG_FILTER_OPS) * (p - labels[i] + 64 + NGX_ATOMIC_T_LEN);
+	}
+
+	b = ngx_create_temp_buf(r->pool, size);
+	if(b == NULL) {
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	p = b->last;
+
+	p = ngx_sprintf(p, "# HELP jpeg_filter_responses_total Responses by result.\n# TYPE jpeg_filter_responses_total counter\n");
+	for(i = 0; i < n; i++) {
+		for(j = 0; j < NGX_HTTP_JPEG_FILTER_RESULTS; j++) {
+			p = ngx_sprintf(p, "jpeg_filter_responses_total{%s,result=\"%s\"} %uA\n", labels[i], ngx_http_jpeg_filter_result_names[j], m[i].responses[j]);
+		}
+	}
+
+	p = ngx_sprintf(p, "# HELP jpeg_filter_in_bytes_total Size of the processed original images.\n# TYPE jpeg_filter_in_bytes_total counter\n");
+	for(i = 0; i < n; i++) {
+		p = ngx_sprintf(p, "jpeg_filter_in_bytes_total{%s} %uA\n", labels[i], m[i].in_bytes);
+	}
+
+	p = ngx_sprintf(p, "# HELP jpeg_filter_out_bytes_total Size of the processed images.\n# TYPE jpeg_filter_out_bytes_total counter\n");
+	for(i = 0; i < n; i++) {
+		p = ngx_sprintf(p, "jpeg_filter_out_bytes_total{%s} %uA\n", labels[i], m[i].out_bytes);
+	}
+
+	p = ngx_sprintf(p, "# HELP jpeg_filter_decoded_pixels_total Pixel of the processed images.\n# TYPE jpeg_filter_decoded_pixels_total counter\n");
+	for(i = 0; i < n; i++) {
+		p = ngx_sprintf(p, "jpeg_filter_decoded_pixels_total{%s} %uA\n", labels[i], m[i].pixels);
+	}
+
+	p = ngx_sprintf(p, "# HELP jpeg_filter_buffered_bytes Memory currently used for buffering original images.\n# TYPE jpeg_filter_buffered_bytes gauge\n");
+	for(i = 0; i < n; i++) {
+		p = ngx_sprintf(p, "jpeg_filter_buffered_bytes{%s} %uA\n", labels[i], m[i].buffered);
+	}
+
+	p = ngx_sprintf(p, "# HELP jpeg_filter_stage_seconds Latency of the stages of processing an image.\n# TYPE jpeg_filter_stage_seconds histogram\n");
+	for(i = 0; i < n; i++) {
+		for(j = 0; j < NGX_HTTP_JPEG_FILTER_STAGES; j++) {
+			count = 0;
+
+			for(k = 0; k <= NGX_HTTP_JPEG_FILTER_BUCKETS; k++) {
+				count += m[i].stage_buckets[j][k];
+				p = ngx_sprintf(p, "jpeg_filter_stage_seconds_bucket{%s,stage=\"%s\",le=\"%s\"} %ui\n", labels[i], ngx_http_jpeg_filter_stage_names[j], ngx_http_jpeg_filter_bucket_names[k], count);
+			}
+
+			p = ngx_sprintf(p, "jpeg_filter_stage_seconds_sum{%s,stage=\"%s\"} %uA.%06uA\n", labels[i], ngx_http_jpeg_filter_stage_names[j], m[i].stage_usec[j] / 1000000, m[i].stage_usec[j] % 1000000);
+			p = ngx_sprintf(p, "jpeg_filter_stage_seconds_count{%s,stage=\"%s\"} %ui\n", labels[i], ngx_http_jpeg_filter_stage_names[j], count);
+		}
+	}
+
+	p = ngx_sprintf(p, "# HELP jpeg_filter_operations_total Applied operations of the processing chain.\n# TYPE jpeg_filter_operations_total counter\n");
+	for(i = 0; i < n; i++) {
+		for(j = 1; j < NGX_HTTP_JPEG_FILTER_OPS; j++) {
+			p = ngx_sprintf(p, "jpeg_filter_operations_total{%s,op=\"%s\"} %uA\n", labels[i], ngx_http_jpeg_filter_op_names[j], m[i].op_count[j]);
+		}
+	}
+
+	p = ngx_sprintf(p, "# HELP jpeg_filter_operation_seconds_total Time spent on the operations of the processing chain.\n# TYPE jpeg_filter_operation_seconds_total counter\n");
+	for(i = 0; i < n; i++) {
+		for(j = 1; j < NGX_HTTP_JPEG_FILTER_OPS; j++) {
+			p = ngx_sprintf(p, "jpeg_filter_operation_seconds_total{%s,op=\"%s\"} %uA.%06uA\n", labels[i], ngx_http_jpeg_filter_op_names[j], m[i].op_usec[j] / 1000000, m[i].op_usec[j] % 1000000);
+		}
+	}
+
+	b->last = p;
+	b->last_buf = (r == r->main) ? 1 : 0;
+	b->last_in_chain = 1;
+
+	out.buf = b;
+	out.next = NULL;
+
+	r->headers_out.status = NGX_HTTP_OK;
+	r->headers_out.content_length_n = b->last - b->pos;
+	ngx_str_set(&r->headers_out.content_type, "text/plain; version=0.0.4");
+	r->headers_out.content_type_len = r->headers_out.content_type.len;
+	r->headers_out.content_type_lowcase = NULL;
+
+	rc = ngx_http_send_header(r);
+
+	if(rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+		return rc;
+	}
+
+	return ngx_http_output_filter(r, &out);
+}
+
+/* Escape a value for a label in the Prometheus text format */
+static u_char *ngx_http_jpeg_filter_status_escape(u_char *p, ngx_str_t *value) {
+	ngx_uint_t  i;
+
+	for(i = 0; i < value->len; i++) {
+		switch(value->data[i]) {
+			case '\\':
+			case '"':
+				*p++ = '\\';
+				*p++ = value->data[i];
+				break;
+			case '\n':
+				*p++ = '\\';
+				*p++ = 'n';
+				break;
+			default:
+				*p++ = value->data[i];
+				break;
+		}
+	}
+
+	return p;
+}
+
+/* Initialize the shared memory zone for the metrics. The metrics are reset if the configuration is reloaded */
+static ngx_int_t ngx_http_jpeg_filter_status_init_zone(ngx_shm_zone_t *shm_zone, void *data) {
+	size_t                             size;
+	ngx_slab_pool_t                   *shpool;
+	ngx_http_jpeg_filter_main_conf_t  *mcf = shm_zone->data;
+
+	size = mcf->locations.nelts * sizeof(ngx_http_jpeg_filter_metrics_t);
+
+	if(data != NULL) {
+		/* The zone has the same size, hence the same number of locations */
+		ngx_memzero(data, size);
+		shm_zone->data = data;
+
+		return NGX_OK;
+	}
+
+	shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+	shm_zone->data = ngx_slab_calloc(shpool, size);
+	if(shm_zone->data == NULL) {
+		return NGX_ERROR;
+	}
+
+	return NGX_OK;
+}
+
+static ngx_int_t ngx_http_jpeg_filter_add_variables(ngx_conf_t *cf) {
+	ngx_http_variable_t  *var, *v;
+
+	for(v = ngx_http_jpeg_filter_vars; v->name.len; v++) {
+		var = ngx_http_add_variable(cf, &v->name, v->flags);
+		if(var == NULL) {
+			return NGX_ERROR;
+		}
+
+		var->get_handler = v->get_handler;
+		var->data = v->data;
+	}
+
+	return NGX_OK;
+}
+
+/* $jpeg_filter_status, the result of the response with the same names as in the metrics */
+static ngx_int_t ngx_http_jpeg_filter_result_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data) {
+	ngx_http_jpeg_filter_ctx_t  *ctx;
+
+	ctx = ngx_http_get_module_ctx(r, ngx_http_jpeg_filter_module);
+	if(ctx == NULL || ctx->result_set == 0) {
+		v->not_found = 1;
+		return NGX_OK;
+	}
+
+	v->data = (u_char *)ngx_http_jpeg_filter_result_names[ctx->result];
+	v->len = ngx_strlen(v->data);
+	v->valid = 1;
+	v->no_cacheable = 0;
+	v->not_found = 0;
+
+	return NGX_OK;
+}
+
+/* $jpeg_filter_in_bytes, $jpeg_filter_out_bytes, and $jpeg_filter_pixels. data is the offset of the value in the context */
+static ngx_int_t ngx_http_jpeg_filter_size_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data) {
+	u_char                      *p;
+	size_t                       value;
+	ngx_http_jpeg_filter_ctx_t  *ctx;
+
+	ctx = ngx_http_get_module_ctx(r, ngx_http_jpeg_filter_module);
+	if(ctx == NULL) {
+		v->not_found = 1;
+		return NGX_OK;
+	}
+
+	value = *(size_t *)((char *)ctx + data);
+	if(value == 0) {
+		v->not_found = 1;
+		return NGX_OK;
+	}
+
+	p = ngx_pnalloc(r->pool, NGX_SIZE_T_LEN);
+	if(p == NULL) {
+		return NGX_ERROR;
+	}
+
+	v->len = ngx_sprintf(p, "%uz", value) - p;
+	v->data = p;
+	v->valid = 1;
+	v->no_cacheable = 0;
+	v->not_found = 0;
+
+	return NGX_OK;
+}
+
+/* $jpeg_filter_buffered_ms, $jpeg_filter_decode_ms, $jpeg_filter_chain_ms, and $jpeg_filter_encode_ms. data is the stage */
+static ngx_int_t ngx_http_jpeg_filter_msec_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data) {
+	u_char                      *p;
+	ngx_http_jpeg_filter_ctx_t  *ctx;
+
+	ctx = ngx_http_get_module_ctx(r, ngx_http_jpeg_filter_module);
+	if(ctx == NULL || (ctx->timed & (1 << data)) == 0) {
+		v->not_found = 1;
+		return NGX_OK;
+	}
+
+	p = ngx_pnalloc(r->pool, NGX_INT_T_LEN + 4);
+	if(p == NULL) {
+		return NGX_ERROR;
+	}
+
+	v->len = ngx_sprintf(p, "%ui.%03ui", ctx->usec[data] / 1000, ctx->usec[data] % 1000) - p;
+	v->data = p;
+	v->valid = 1;
+	v->no_cacheable = 0;
+	v->not_found = 0;
+
+	return NGX_OK;
+}
+
+/* Process the "jpeg_filter_arena" configuration directive */
+static char *ngx_conf_jpeg_filter_arena(ngx_conf_t *cf, ngx_command_t *cmd, void *c) {
+	ngx_http_jpeg_filter_main_conf_t *mcf = c;
+
+	ssize_t      size;
+	ngx_str_t   *value;
+
+	if(mcf->arena_size != NGX_CONF_UNSET_SIZE) {
+		return "is duplicate";
+	}
+
+	value = cf->args->elts;
+
+	size = ngx_parse_size(&value[1]);
+	if(size == NGX_ERROR) {
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "jpeg_filter: invalid size \"%V\"", &value[1]);
+		return NGX_CONF_ERROR;
+	}
+
+	mcf->arena_size = (size_t)size;
+
+	if(cf->args->nelts == 3) {
+		if(ngx_strcmp(value[2].data, "hugepages") != 0) {
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "jpeg_filter: invalid parameter \"%V\"", &value[2]);
+			return NGX_CONF_ERROR;
+		}
+
+#ifndef MADV_HUGEPAGE
+		ngx_conf_log_error(NGX_LOG_WARN, cf, 0, "jpeg_filter: transparent huge pages are not supported on this platform, ignoring \"%V\"", &value[2]);
+#endif
+
+		mcf->arena_hugepages = 1;
+	}
+
+	return NGX_CONF_OK;
+}
+
+/* Process the "jpeg_filter_status" configuration directive */
+static char *ngx_conf_jpeg_filter_status(ngx_conf_t *cf, ngx_command_t *cmd, void *c) {
+	ngx_http_core_loc_conf_t          *clcf;
+	ngx_http_jpeg_filter_main_conf_t  *mcf;
+
+	clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+	clcf->handler = ngx_http_jpeg_filter_status_handler;
+
+	mcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_jpeg_filter_module);
+	mcf->status = 1;
+
+	return NGX_CONF_OK;
+}
+
+/* Process the "jpeg_filter_limit" configuration directive */
+static char *ngx_conf_jpeg_filter_limit(ngx_conf_t *cf, ngx_command_t *cmd, void *c) {
+	ngx_http_jpeg_filter_main_conf_t *mcf = c;
+
+	ssize_t      size;
+	ngx_int_t    n;
+	ngx_str_t   *value, s, name = ngx_string("jpeg_filter_limit");
+	ngx_uint_t   i;
+
+	if(mcf->limit_queue != NGX_CONF_UNSET_MSEC) {
+		return "is duplicate";
+	}
+
+	value = cf->args->elts;
+
+	mcf->limit_concurrent = 0;
+	mcf->limit_memory = 0;
+	mcf->limit_queue = 0;
+
+	if(ngx_strcmp(value[1].data, "off") == 0) {
+		if(cf->args->nelts != 2) {
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "jpeg_filter: invalid parameter \"%V\"", &value[2]);
+			return NGX_CONF_ERROR;
+		}
+
+		return NGX_CONF_OK;
+	}
+
+	for(i = 1; i < cf->args->nelts; i++) {
+		if(ngx_strncmp(value[i].data, "concurrent=", 11) == 0) {
+			s.data = value[i].data + 11;
+			s.len = value[i].len - 11;
+
+			n = ngx_atoi(s.data, s.len);
+			if(n == NGX_ERROR || n == 0) {
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "jpeg_filter: invalid number \"%V\"", &value[i]);
+				return NGX_CONF_ERROR;
+			}
+
+			mcf->limit_concurrent = (ngx_uint_t)n;
+
+			continue;
+		}
+
+		if(ngx_strncmp(value[i].data, "memory=", 7) == 0) {
+			s.data = value[i].data + 7;
+			s.len = value[i].len - 7;
+
+			size = ngx_parse_size(&s);
+			if(size == NGX_ERROR || size == 0) {
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "jpeg_filter: invalid size \"%V\"", &value[i]);
+				return NGX_CONF_ERROR;
+			}
+
+			mcf->limit_memory = (size_t)size;
+
+			continue;
+		}
+
+		if(ngx_strncmp(value[i].data, "queue=", 6) == 0) {
+			s.data = value[i].data + 6;
+			s.len = value[i].len - 6;
+
+			n = ngx_parse_time(&s, 0);
+			if(n == NGX_ERROR) {
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "jpeg_filter: invalid time \"%V\"", &value[i]);
+				return NGX_CONF_ERROR;
+			}
+
+			mcf->limit_queue = (ngx_msec_t)n;
+
+			continue;
+		}
+
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "jpeg_filter: invalid parameter \"%V\"", &value[i]);
+		return NGX_CONF_ERROR;
+	}
+
+	if(mcf->limit_concurrent == 0 && mcf->limit_memory == 0) {
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "jpeg_filter: \"%V\" must have \"concurrent\" or \"memory\" parameter", &cmd->name);
+		return NGX_CONF_ERROR;
+	}
+
+	mcf->limit_zone = ngx_shared_memory_add(cf, &name, 8 * ngx_pagesize, &ngx_http_jpeg_filter_module);
+	if(mcf->limit_zone == NULL) {
+		return NGX_CONF_ERROR;
+	}
+
+	mcf->limit_zone->init = ngx_http_jpeg_filter_limit_init_zone;
+
+	return NGX_CONF_OK;
+}
+
+/* Process the "jpeg_filter_auto" configuration directive */
+static char *ngx_conf_jpeg_filter_auto(ngx_conf_t *cf, ngx_command_t *cmd, void *c) {
+	ngx_http_jpeg_filter_conf_t *conf = c;
+
+	ssize_t      size;
+	ngx_int_t    n;
+	ngx_str_t   *value, s;
+	ngx_uint_t   i;
+
+	if(conf->auto_pixel != NGX_CONF_UNSET_UINT) {
+		return "is duplicate";
+	}
+
+	value = cf->args->elts;
+
+	/* Parameters that are not given keep their defaults */
+	conf->auto_pixel = 100000;
+	conf->auto_size = 10 * 1024;
+	conf->auto_gain = 1024;
+
+	for(i = 1; i < cf->args->nelts; i++) {
+		if(ngx_strncmp(value[i].data, "pixel=", 6) == 0) {
+			s.data = value[i].data + 6;
+			s.len = value[i].len - 6;
+
+			n = ngx_atoi(s.data, s.len);
+			if(n == NGX_ERROR) {
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "jpeg_filter: invalid number \"%V\"", &value[i]);
+				return NGX_CONF_ERROR;
+			}
+
+			conf->auto_pixel = (ngx_uint_t)n;
+
+			continue;
+		}
+
+		if(ngx_strncmp(value[i].data, "size=", 5) == 0) {
+			s.data = value[i].data + 5;
+			s.len = value[i].len - 5;
+
+			size = ngx_parse_size(&s);
+			if(size == NGX_ERROR) {
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "jpeg_filter: invalid size \"%V\"", &value[i]);
+				return NGX_CONF_ERROR;
+			}
+
+			conf->auto_size = (size_t)size;
+
+			continue;
+		}
+
+		if(ngx_strncmp(value[i].data, "gain=", 5) == 0) {
+			s.data = value[i].data + 5;
+			s.len = value[i].len - 5;
+
+			size = ngx_parse_size(&s);
+			if(size == NGX_ERROR) {
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "jpeg_filter: invalid size \"%V\"", &value[i]);
+				return NGX_CONF_ERROR;
+			}
+
+			conf->auto_gain = (size_t)size;
+
+			continue;
+		}
+
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "jpeg_filter: invalid parameter \"%V\"", &value[i]);
+		return NGX_CONF_ERROR;
+	}
+
+	return NGX_CONF_OK;
+}
+
+/* Process the "jpeg_filter_effect" configuration directives */
+static char *ngx_conf_jpeg_filter_effect(ngx_conf_t *cf, ngx_command_t *cmd, void *c) {
+	ngx_http_jpeg_filter_conf_t *conf = c;
+
+	ngx_str_t                         *value;
+	ngx_http_compile_complex_value_t   ccv;
+	ngx_http_jpeg_filter_element_t    *fe;
+
+	ngx_log_debug0(NGX_LOG_DEBUG_CORE, cf->log, 0, "jpeg_filter: ngx_conf_jpeg_filter_effect");
+
+	value = cf->args->elts;
+
+	/* Initialize the processing chain */
+	if(conf->filter_elements == NULL) {
+		conf->filter_elements = ngx_array_create(cf->pool, 10, sizeof(ngx_http_jpeg_filter_element_t));
+		if(conf->filter_elements == NULL) {
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "jpeg_filter: failed to create filter chain");
+			return NGX_CONF_ERROR;
+		}
+	}
+
+	/* Add a new element to the processing chain */
+	fe = (ngx_http_jpeg_filter_element_t *)ngx_array_push(conf->filter_elements);
+	if(fe == NULL) {
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "jpeg_filter: failed to add new filter to filter chain for \"%s\"", value[0].data);
+		return NGX_CONF_ERROR;
+	}
+
+	ngx_memzero(fe, sizeof(ngx_http_jpeg_filter_element_t));
+
+	if(cf->args->nelts == 2) {
+		fe->type = NGX_HTTP_JPEG_FILTER_TYPE_EFFECT1;
+
+		/* Get the effect name as complex value */
+		ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+
+		ccv.cf = cf;
+		ccv.value = &value[1];
+		ccv.complex_value = &fe->cv1;
+		ccv.zero = 1;
+
+		if(ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "jpeg_filter: failed to compile complex value \"%s %s\"", value[0].data, value[1].data);
+			return NGX_CONF_ERROR;
+		}
+	}
+	else if(cf->args->nelts == 3) {
+		fe->type = NGX_HTTP_JPEG_FILTER_TYPE_EFFECT2;
+
+		/* Get the effect name as complex value */
+		ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+
+		ccv.cf = cf;
+		ccv.value = &value[1];
+		ccv.complex_value = &fe->cv1;
+		ccv.zero = 1;
+
+		if(ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "jpeg_filter: failed to compile complex value for \"%s %s %s\"", value[0].data, value[1].data, value[2].data);
+			return NGX_CONF_ERROR;
+		}
+
+		/* Get the effect value as complex value */
+		ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+
+		ccv.cf = cf;
+		ccv.value = &value[2];
+		ccv.complex_value = &fe->cv2;
+		ccv.zero = 1;
+
+		if(ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "jpeg_filter: failed to compile complex value for \"%s %s %s\"", value[0].data, value[1].data, value[2].data);
+			return NGX_CONF_ERROR;
+		}
+	}
+
+	return ngx_conf_jpeg_filter_compile(cf, conf, fe);
+}
+
+/* Process the "jpeg_filter_dropon*" configuration directives */
+static char *ngx_conf_jpeg_filter_dropon(ngx_conf_t *cf, ngx_command_t *cmd, void *c) {
+	ngx_http_jpeg_filter_conf_t *conf = c;
+
+	ngx_str_t                         *value;
+	ngx_http_compile_complex_value_t   ccv;
+	ngx_http_jpeg_filter_element_t    *fe;
+
+	ngx_log_debug0(NGX_LOG_DEBUG_CORE, cf->log, 0, "jpeg_filter: ngx_conf_jpeg_filter_dropon");
+
+	value = cf->args->elts;
+
+	/* Initialize the processing chain */
+	if(conf->filter_elements == NULL) {
+		conf->filter_elements = ngx_array_create(cf->pool, 10, sizeof(ngx_http_jpeg_filter_element_t));
+		if(conf->filter_elements == NULL) {
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "jpeg_filter: failed to create filter chain");
+			return NGX_CONF_ERROR;
+		}
+	}
+
+	/* Add a new element to the processing chain */
+	fe = (ngx_http_jpeg_filter_element_t *)ngx_array_push(conf->filter_elements);
+	if(fe == NULL) {
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "jpeg_filter: failed to add new filter to filter chain (%s)", value[0].data);
+		return NGX_CONF_ERROR;
+	}
+
+	ngx_memzero(fe, sizeof(ngx_http_jpeg_filter_element_t));
 
 	if(ngx_strcmp(value[0].data, "jpeg_filter_dropon_align") == 0) {
 		fe->type = NGX_HTTP_JPEG_FILTER_TYPE_DROPON_ALIGN;
@@ -1138,123 +6675,423 @@ static char *ngx_conf_jpeg_filter_dropon(ngx_conf_t *cf, ngx_command_t *cmd, voi
 		ccv.complex_value = &fe->cv1;
 		ccv.zero = 1;
 
-		if(ngx_http_compile_complex_value(&ccv) != NGX_OK) {
-			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "jpeg_filter: failed to compile complex value for \"%s %s %s\"", value[0].data, value[1].data, value[2].data);
-			return NGX_CONF_ERROR;
-		}
+		if(ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "jpeg_filter: failed to compile complex value for \"%s %s %s\"", value[0].data, value[1].data, value[2].data);
+			return NGX_CONF_ERROR;
+		}
+
+		if(fe->cv1.lengths != NULL) {
+			has_variables = 1;
+		}
+
+		if(cf->args->nelts == 3) {
+			/* Mask */
+			ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+
+			ccv.cf = cf;
+			ccv.value = &value[2];
+			ccv.complex_value = &fe->cv2;
+			ccv.zero = 1;
+
+			if(ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "jpeg_filter: failed to compile complex value for \"%s %s %s\"", value[0].data, value[1].data, value[2].data);
+				return NGX_CONF_ERROR;
+			}
+
+			if(fe->cv2.lengths != NULL) {
+				has_variables = 1;
+			}
+		}
+
+		/* Check if there are any variables in the values */
+		if(has_variables == 0) {
+			fe->dropon = (mj_dropon_t *)ngx_palloc(cf->pool, sizeof(mj_dropon_t));
+			if(fe->dropon == NULL) {
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "jpeg_filter: could not allocate memory for dropon");
+				return NGX_CONF_ERROR;
+			}
+
+			mj_init_dropon(fe->dropon);
+
+			if(cf->args->nelts == 2) {
+				/* Dropon without a mask */
+				if(mj_read_dropon_from_file(fe->dropon, (char *)value[1].data, NULL, MJ_BLEND_FULL) != MJ_OK) {
+					ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "jpeg_filter: dropon could not load the file \"%s\"", value[1].data);
+					return NGX_CONF_ERROR;
+				}
+			}
+			else {
+				/* Dropon with a mask */
+				if(mj_read_dropon_from_file(fe->dropon, (char *)value[1].data, (char *)value[2].data, MJ_BLEND_FULL) != MJ_OK) {
+					ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "jpeg_filter: dropon could not load the file \"%s\" or \"%s\"", value[1].data, value[2].data);
+					return NGX_CONF_ERROR;
+				}
+			}
+
+			/* Add a cleanup routine for the allocated dropon */
+			ngx_pool_cleanup_t *cln;
+
+			cln = ngx_pool_cleanup_add(cf->pool, 0);
+			if(cln == NULL) {
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "jpeg_filter: failed to add cleanup routine for dropon");
+				return NGX_CONF_ERROR;
+			}
+
+			cln->handler = ngx_http_jpeg_filter_conf_cleanup;
+			cln->data = fe->dropon;
+
+			fe->op.op = NGX_HTTP_JPEG_FILTER_OP_DROPON;
+			fe->op.dropon = fe->dropon;
+
+			return NGX_CONF_OK;
+		}
+		else {
+			if(cf->args->nelts == 2) {
+				fe->type = NGX_HTTP_JPEG_FILTER_TYPE_DROPON_FILE1;
+			}
+			else {
+				fe->type = NGX_HTTP_JPEG_FILTER_TYPE_DROPON_FILE2;
+			}
+
+			fe->dropon = NULL;
+		}
+	}
+	else if(ngx_strcmp(value[0].data, "jpeg_filter_dropon_memory") == 0) {
+		/* Dropon */
+		ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+
+		ccv.cf = cf;
+		ccv.value = &value[1];
+		ccv.complex_value = &fe->cv1;
+		ccv.zero = 1;
+
+		if(ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "jpeg_filter: failed to compile complex value for \"%s %s %s\"", value[0].data, value[1].data, value[2].data);
+			return NGX_CONF_ERROR;
+		}
+
+		if(cf->args->nelts == 3) {
+			/* Mask */
+			ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+
+			ccv.cf = cf;
+			ccv.value = &value[2];
+			ccv.complex_value = &fe->cv2;
+			ccv.zero = 1;
+
+			if(ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "jpeg_filter: failed to compile complex value for \"%s %s %s\"", value[0].data, value[1].data, value[2].data);
+				return NGX_CONF_ERROR;
+			}
+		}
+
+		if(cf->args->nelts == 2) {
+			fe->type = NGX_HTTP_JPEG_FILTER_TYPE_DROPON_MEMORY1;
+		}
+		else {
+			fe->type = NGX_HTTP_JPEG_FILTER_TYPE_DROPON_MEMORY2;
+		}
+
+		fe->dropon = NULL;
+	}
+
+	return ngx_conf_jpeg_filter_compile(cf, conf, fe);
+}
+
+/*
+ * Resolve an element of the processing chain at configuration time as far as it doesn't contain
+ * variables, such that invalid values are rejected right away. Dynamic dropons are always
+ * resolved for each request.
+ */
+static char *ngx_conf_jpeg_filter_compile(ngx_conf_t *cf, ngx_http_jpeg_filter_conf_t *conf, ngx_http_jpeg_filter_element_t *fe) {
+	ngx_str_t  *value, *invalid, val1, val2;
+
+	value = cf->args->elts;
+
+	val1 = fe->cv1.value;
+	val2 = fe->cv2.value;
+
+	if(fe->cv1.lengths != NULL) {
+		ngx_str_null(&val1);
+	}
+
+	if(fe->cv2.lengths != NULL) {
+		ngx_str_null(&val2);
+	}
+
+	if(ngx_http_jpeg_filter_compile(fe->type, &val1, &val2, &fe->op, &invalid) != NGX_OK) {
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "jpeg_filter: invalid value \"%V\" in \"%V\"", invalid, &value[0]);
+		return NGX_CONF_ERROR;
+	}
+
+	if(fe->cv1.lengths != NULL || fe->cv2.lengths != NULL || fe->op.op == NGX_HTTP_JPEG_FILTER_OP_DROPON_DYNAMIC) {
+		fe->variable = 1;
+		conf->variables = 1;
+	}
+
+	return NGX_CONF_OK;
+}
+
+/* Process the "jpeg_filter_thread_pool" configuration directive */
+static char *ngx_conf_jpeg_filter_thread_pool(ngx_conf_t *cf, ngx_command_t *cmd, void *c) {
+#if (NGX_THREADS)
+	ngx_http_jpeg_filter_conf_t *conf = c;
+
+	ngx_str_t  *value;
+
+	ngx_log_debug0(NGX_LOG_DEBUG_CORE, cf->log, 0, "jpeg_filter: ngx_conf_jpeg_filter_thread_pool");
+
+	if(conf->thread_pool != NGX_CONF_UNSET_PTR) {
+		return "is duplicate";
+	}
+
+	value = cf->args->elts;
+
+	if(ngx_strcmp(value[1].data, "off") == 0) {
+		conf->thread_pool = NULL;
+		return NGX_CONF_OK;
+	}
+
+	conf->thread_pool = ngx_thread_pool_add(cf, &value[1]);
+	if(conf->thread_pool == NULL) {
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "jpeg_filter: failed to add thread pool \"%V\"", &value[1]);
+		return NGX_CONF_ERROR;
+	}
+
+	return NGX_CONF_OK;
+#else
+	ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "jpeg_filter: \"%V\" requires nginx to be built with \"--with-threads\"", &cmd->name);
+
+	return NGX_CONF_ERROR;
+#endif
+}
+
+/* Process the "jpeg_filter_cache" configuration directive */
+static char *ngx_conf_jpeg_filter_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *c) {
+	ngx_http_jpeg_filter_conf_t *conf = c;
+
+	u_char                            *p;
+	ssize_t                            size;
+	ngx_str_t                         *value, name, s;
+	ngx_int_t                          valid;
+	ngx_uint_t                         i;
+	ngx_http_jpeg_filter_cache_t      *cache;
+	ngx_http_compile_complex_value_t   ccv;
+
+	ngx_log_debug0(NGX_LOG_DEBUG_CORE, cf->log, 0, "jpeg_filter: ngx_conf_jpeg_filter_cache");
+
+	if(conf->cache_zone != NGX_CONF_UNSET_PTR) {
+		return "is duplicate";
+	}
+
+	value = cf->args->elts;
+
+	if(ngx_strcmp(value[1].data, "off") == 0) {
+		if(cf->args->nelts != 2) {
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "jpeg_filter: invalid parameter \"%V\"", &value[2]);
+			return NGX_CONF_ERROR;
+		}
+
+		conf->cache_zone = NULL;
+		return NGX_CONF_OK;
+	}
+
+	ngx_str_null(&name);
+	size = 0;
+	valid = NGX_CONF_UNSET;
+
+	for(i = 1; i < cf->args->nelts; i++) {
+		if(ngx_strncmp(value[i].data, "zone=", 5) == 0) {
+			name.data = value[i].data + 5;
+
+			p = (u_char *)ngx_strchr(name.data, ':');
+
+			if(p != NULL) {
+				name.len = p - name.data;
+
+				s.data = p + 1;
+				s.len = value[i].data + value[i].len - s.data;
+
+				size = ngx_parse_size(&s);
+				if(size == NGX_ERROR) {
+					ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "jpeg_filter: invalid zone size \"%V\"", &value[i]);
+					return NGX_CONF_ERROR;
+				}
+
+				if(size < (ssize_t)(8 * ngx_pagesize)) {
+					ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "jpeg_filter: zone \"%V\" is too small", &value[i]);
+					return NGX_CONF_ERROR;
+				}
+			}
+			else {
+				name.len = value[i].len - 5;
+			}
 
-		if(fe->cv1.lengths != NULL) {
-			has_variables = 1;
+			continue;
 		}
 
-		if(cf->args->nelts == 3) {
-			/* Mask */
+		if(ngx_strncmp(value[i].data, "key=", 4) == 0) {
+			s.data = value[i].data + 4;
+			s.len = value[i].len - 4;
+
+			conf->cache_key = ngx_palloc(cf->pool, sizeof(ngx_http_complex_value_t));
+			if(conf->cache_key == NULL) {
+				return NGX_CONF_ERROR;
+			}
+
 			ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
 
 			ccv.cf = cf;
-			ccv.value = &value[2];
-			ccv.complex_value = &fe->cv2;
-			ccv.zero = 1;
+			ccv.value = &s;
+			ccv.complex_value = conf->cache_key;
 
 			if(ngx_http_compile_complex_value(&ccv) != NGX_OK) {
-				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "jpeg_filter: failed to compile complex value for \"%s %s %s\"", value[0].data, value[1].data, value[2].data);
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "jpeg_filter: failed to compile complex value for \"%V\"", &value[i]);
 				return NGX_CONF_ERROR;
 			}
 
-			if(fe->cv2.lengths != NULL) {
-				has_variables = 1;
-			}
+			continue;
 		}
 
-		/* Check if there are any variables in the values */
-		if(has_variables == 0) {
-			fe->dropon = (mj_dropon_t *)ngx_palloc(cf->pool, sizeof(mj_dropon_t));
-			if(fe->dropon == NULL) {
-				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "jpeg_filter: could not allocate memory for dropon");
+		if(ngx_strncmp(value[i].data, "valid=", 6) == 0) {
+			s.data = value[i].data + 6;
+			s.len = value[i].len - 6;
+
+			valid = ngx_parse_time(&s, 1);
+			if(valid == NGX_ERROR) {
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "jpeg_filter: invalid time \"%V\"", &value[i]);
 				return NGX_CONF_ERROR;
 			}
 
-			mj_init_dropon(fe->dropon);
+			continue;
+		}
 
-			if(cf->args->nelts == 2) {
-				/* Dropon without a mask */
-				if(mj_read_dropon_from_file(fe->dropon, (char *)value[1].data, NULL, MJ_BLEND_FULL) != MJ_OK) {
-					ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "jpeg_filter: dropon could not load the file \"%s\"", value[1].data);
-					return NGX_CONF_ERROR;
-				}
-			}
-			else {
-				/* Dropon with a mask */
-				if(mj_read_dropon_from_file(fe->dropon, (char *)value[1].data, (char *)value[2].data, MJ_BLEND_FULL) != MJ_OK) {
-					ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "jpeg_filter: dropon could not load the file \"%s\" or \"%s\"", value[1].data, value[2].data);
-					return NGX_CONF_ERROR;
-				}
-			}
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "jpeg_filter: invalid parameter \"%V\"", &value[i]);
+		return NGX_CONF_ERROR;
+	}
 
-			/* Add a cleanup routine for the allocated dropon */
-			ngx_pool_cleanup_t *cln;
+	if(name.len == 0) {
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "jpeg_filter: \"%V\" must have \"zone\" parameter", &cmd->name);
+		return NGX_CONF_ERROR;
+	}
 
-			cln = ngx_pool_cleanup_add(cf->pool, 0);
-			if(cln == NULL) {
-				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "jpeg_filter: failed to add cleanup routine for dropon");
-				return NGX_CONF_ERROR;
-			}
+	conf->cache_zone = ngx_shared_memory_add(cf, &name, size, &ngx_http_jpeg_filter_module);
+	if(conf->cache_zone == NULL) {
+		return NGX_CONF_ERROR;
+	}
 
-			cln->handler = ngx_http_jpeg_filter_conf_cleanup;
-			cln->data = fe->dropon;
+	if(conf->cache_zone->data == NULL) {
+		cache = ngx_pcalloc(cf->pool, sizeof(ngx_http_jpeg_filter_cache_t));
+		if(cache == NULL) {
+			return NGX_CONF_ERROR;
 		}
-		else {
-			if(cf->args->nelts == 2) {
-				fe->type = NGX_HTTP_JPEG_FILTER_TYPE_DROPON_FILE1;
-			}
-			else {
-				fe->type = NGX_HTTP_JPEG_FILTER_TYPE_DROPON_FILE2;
-			}
 
-			fe->dropon = NULL;
-		}
+		conf->cache_zone->init = ngx_http_jpeg_filter_cache_init_zone;
+		conf->cache_zone->data = cache;
 	}
-	else if(ngx_strcmp(value[0].data, "jpeg_filter_dropon_memory") == 0) {
-		/* Dropon */
-		ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
 
-		ccv.cf = cf;
-		ccv.value = &value[1];
-		ccv.complex_value = &fe->cv1;
-		ccv.zero = 1;
+	if(valid != NGX_CONF_UNSET) {
+		conf->cache_valid = (time_t)valid;
+	}
 
-		if(ngx_http_compile_complex_value(&ccv) != NGX_OK) {
-			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "jpeg_filter: failed to compile complex value for \"%s %s %s\"", value[0].data, value[1].data, value[2].data);
+	return NGX_CONF_OK;
+}
+
+#if (NGX_HTTP_CACHE)
+/* Process the "jpeg_filter_store" configuration directive */
+static char *ngx_conf_jpeg_filter_store(ngx_conf_t *cf, ngx_command_t *cmd, void *c) {
+	ngx_http_jpeg_filter_conf_t *conf = c;
+
+	ngx_str_t                         *value, name, s;
+	ngx_int_t                          valid;
+	ngx_uint_t                         i;
+	ngx_http_compile_complex_value_t   ccv;
+
+	if(conf->store_zone != NGX_CONF_UNSET_PTR) {
+		return "is duplicate";
+	}
+
+	value = cf->args->elts;
+
+	if(ngx_strcmp(value[1].data, "off") == 0) {
+		if(cf->args->nelts != 2) {
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "jpeg_filter: invalid parameter \"%V\"", &value[2]);
 			return NGX_CONF_ERROR;
 		}
 
-		if(cf->args->nelts == 3) {
-			/* Mask */
+		conf->store_zone = NULL;
+		return NGX_CONF_OK;
+	}
+
+	ngx_str_null(&name);
+	valid = NGX_CONF_UNSET;
+
+	for(i = 1; i < cf->args->nelts; i++) {
+		if(ngx_strncmp(value[i].data, "zone=", 5) == 0) {
+			name.data = value[i].data + 5;
+			name.len = value[i].len - 5;
+
+			continue;
+		}
+
+		if(ngx_strncmp(value[i].data, "key=", 4) == 0) {
+			s.data = value[i].data + 4;
+			s.len = value[i].len - 4;
+
+			conf->store_key = ngx_palloc(cf->pool, sizeof(ngx_http_complex_value_t));
+			if(conf->store_key == NULL) {
+				return NGX_CONF_ERROR;
+			}
+
 			ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
 
 			ccv.cf = cf;
-			ccv.value = &value[2];
-			ccv.complex_value = &fe->cv2;
-			ccv.zero = 1;
+			ccv.value = &s;
+			ccv.complex_value = conf->store_key;
 
 			if(ngx_http_compile_complex_value(&ccv) != NGX_OK) {
-				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "jpeg_filter: failed to compile complex value for \"%s %s %s\"", value[0].data, value[1].data, value[2].data);
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "jpeg_filter: failed to compile complex value for \"%V\"", &value[i]);
 				return NGX_CONF_ERROR;
 			}
-		}
 
-		if(cf->args->nelts == 2) {
-			fe->type = NGX_HTTP_JPEG_FILTER_TYPE_DROPON_MEMORY1;
+			continue;
 		}
-		else {
-			fe->type = NGX_HTTP_JPEG_FILTER_TYPE_DROPON_MEMORY2;
+
+		if(ngx_strncmp(value[i].data, "valid=", 6) == 0) {
+			s.data = value[i].data + 6;
+			s.len = value[i].len - 6;
+
+			valid = ngx_parse_time(&s, 1);
+			if(valid == NGX_ERROR) {
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "jpeg_filter: invalid time \"%V\"", &value[i]);
+				return NGX_CONF_ERROR;
+			}
+
+			continue;
 		}
 
-		fe->dropon = NULL;
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "jpeg_filter: invalid parameter \"%V\"", &value[i]);
+		return NGX_CONF_ERROR;
+	}
+
+	if(name.len == 0) {
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "jpeg_filter: \"%V\" must have \"zone\" parameter", &cmd->name);
+		return NGX_CONF_ERROR;
+	}
+
+	/* The zone is defined by jpeg_filter_cache_path, possibly later in the configuration */
+	conf->store_zone = ngx_shared_memory_add(cf, &name, 0, &ngx_http_jpeg_filter_module);
+	if(conf->store_zone == NULL) {
+		return NGX_CONF_ERROR;
+	}
+
+	if(valid != NGX_CONF_UNSET) {
+		conf->store_valid = (time_t)valid;
 	}
 
 	return NGX_CONF_OK;
 }
+#endif
 
 /* Cleanup stuff was allocated without a pool during configuration */
 static void ngx_http_jpeg_filter_conf_cleanup(void *data) {
@@ -1265,6 +7102,42 @@ static void ngx_http_jpeg_filter_conf_cleanup(void *data) {
 	return;
 }
 
+static void *ngx_http_jpeg_filter_create_main_conf(ngx_conf_t *cf) {
+	ngx_http_jpeg_filter_main_conf_t  *mcf;
+
+	mcf = ngx_pcalloc(cf->pool, sizeof(ngx_http_jpeg_filter_main_conf_t));
+	if(mcf == NULL) {
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "jpeg_filter: failed to allocate memory for filter main config");
+		return NULL;
+	}
+
+	mcf->dropon_cache_size = NGX_CONF_UNSET_SIZE;
+	mcf->arena_size = NGX_CONF_UNSET_SIZE;
+	mcf->limit_queue = NGX_CONF_UNSET_MSEC;
+
+	if(ngx_array_init(&mcf->locations, cf->pool, 4, sizeof(ngx_http_jpeg_filter_status_location_t)) != NGX_OK) {
+		return NULL;
+	}
+
+#if (NGX_HTTP_CACHE)
+	if(ngx_array_init(&mcf->caches, cf->pool, 4, sizeof(ngx_http_file_cache_t *)) != NGX_OK) {
+		return NULL;
+	}
+#endif
+
+	return mcf;
+}
+
+static char *ngx_http_jpeg_filter_init_main_conf(ngx_conf_t *cf, void *c) {
+	ngx_http_jpeg_filter_main_conf_t *mcf = c;
+
+	ngx_conf_init_size_value(mcf->dropon_cache_size, 0);
+	ngx_conf_init_size_value(mcf->arena_size, 0);
+	ngx_conf_init_msec_value(mcf->limit_queue, 0);
+
+	return NGX_CONF_OK;
+}
+
 static void *ngx_http_jpeg_filter_create_conf(ngx_conf_t *cf) {
 	ngx_http_jpeg_filter_conf_t  *conf;
 
@@ -1275,14 +7148,37 @@ static void *ngx_http_jpeg_filter_create_conf(ngx_conf_t *cf) {
 	}
 
 	conf->max_pixel = NGX_CONF_UNSET_UINT;
+	conf->time_budget = NGX_CONF_UNSET_MSEC;
+	conf->max_memory = NGX_CONF_UNSET_SIZE;
 
 	conf->enable = NGX_CONF_UNSET;
-	conf->optimize = NGX_CONF_UNSET;
-	conf->progressive = NGX_CONF_UNSET;
+	conf->optimize = NGX_CONF_UNSET_UINT;
+	conf->progressive = NGX_CONF_UNSET_UINT;
+	conf->transcode = NGX_CONF_UNSET;
 	conf->graceful = NGX_CONF_UNSET;
 
+	conf->auto_pixel = NGX_CONF_UNSET_UINT;
+	conf->auto_size = NGX_CONF_UNSET_SIZE;
+	conf->auto_gain = NGX_CONF_UNSET_SIZE;
+
 	conf->buffer_size = NGX_CONF_UNSET_SIZE;
 
+#if (NGX_THREADS)
+	conf->thread_pool = NGX_CONF_UNSET_PTR;
+#endif
+	conf->bands = NGX_CONF_UNSET;
+
+	conf->bypass = NGX_CONF_UNSET_PTR;
+	conf->metrics = NGX_CONF_UNSET_UINT;
+
+	conf->cache_zone = NGX_CONF_UNSET_PTR;
+	conf->cache_valid = NGX_CONF_UNSET;
+
+#if (NGX_HTTP_CACHE)
+	conf->store_zone = NGX_CONF_UNSET_PTR;
+	conf->store_valid = NGX_CONF_UNSET;
+#endif
+
 	return conf;
 }
 
@@ -1291,23 +7187,279 @@ static char *ngx_http_jpeg_filter_merge_conf(ngx_conf_t *cf, void *parent, void
 	ngx_http_jpeg_filter_conf_t *conf = child;
 
 	ngx_conf_merge_uint_value(conf->max_pixel, prev->max_pixel, 0);
+	ngx_conf_merge_msec_value(conf->time_budget, prev->time_budget, 0);
+	ngx_conf_merge_size_value(conf->max_memory, prev->max_memory, 0);
 
 	ngx_conf_merge_value(conf->enable, prev->enable, 0);
-	ngx_conf_merge_value(conf->optimize, prev->optimize, 0);
-	ngx_conf_merge_value(conf->progressive, prev->progressive, 0);
+	ngx_conf_merge_uint_value(conf->optimize, prev->optimize, 0);
+	ngx_conf_merge_uint_value(conf->progressive, prev->progressive, 0);
+	ngx_conf_merge_value(conf->transcode, prev->transcode, 0);
 	ngx_conf_merge_value(conf->graceful, prev->graceful, 0);
 
+	ngx_conf_merge_uint_value(conf->auto_pixel, prev->auto_pixel, 100000);
+	ngx_conf_merge_size_value(conf->auto_size, prev->auto_size, 10 * 1024);
+	ngx_conf_merge_size_value(conf->auto_gain, prev->auto_gain, 1024);
+
 	ngx_conf_merge_size_value(conf->buffer_size, prev->buffer_size, NGX_HTTP_JPEG_FILTER_BUFFER_SIZE);
 
+#if (NGX_THREADS)
+	ngx_conf_merge_ptr_value(conf->thread_pool, prev->thread_pool, NULL);
+#endif
+	ngx_conf_merge_value(conf->bands, prev->bands, 1);
+
+	ngx_conf_merge_ptr_value(conf->bypass, prev->bypass, NULL);
+
+	/* Every location with the filter enabled gets its own metrics */
+	if(conf->enable == 1 && conf->metrics == NGX_CONF_UNSET_UINT) {
+		ngx_uint_t                               i, instance;
+		ngx_http_core_srv_conf_t                *cscf;
+		ngx_http_core_loc_conf_t                *clcf;
+		ngx_http_jpeg_filter_main_conf_t        *mcf;
+		ngx_http_jpeg_filter_status_location_t  *loc;
+
+		mcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_jpeg_filter_module);
+		cscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_core_module);
+		clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+
+		if(clcf->noname && prev->metrics != NGX_CONF_UNSET_UINT) {
+			/* Blocks like "if" inside a location count for that location, which has been merged before */
+			conf->metrics = prev->metrics;
+		}
+		else {
+			loc = mcf->locations.elts;
+			instance = 0;
+
+			/* The names are only labels. Servers without a server_name all have the same name */
+			for(i = 0; i < mcf->locations.nelts; i++) {
+				if(loc[i].clcf == clcf) {
+					break;
+				}
+
+				if(
+					loc[i].server.len == cscf->server_name.len &&
+					loc[i].location.len == clcf->name.len &&
+					ngx_strncmp(loc[i].server.data, cscf->server_name.data, cscf->server_name.len) == 0 &&
+					ngx_strncmp(loc[i].location.data, clcf->name.data, clcf->name.len) == 0
+				) {
+					instance++;
+				}
+			}
+
+			if(i == mcf->locations.nelts) {
+				loc = ngx_array_push(&mcf->locations);
+				if(loc == NULL) {
+					return NGX_CONF_ERROR;
+				}
+
+				loc->clcf = clcf;
+				loc->server = cscf->server_name;
+				loc->location = clcf->name;
+				loc->instance = instance;
+			}
+
+			conf->metrics = i;
+		}
+	}
+
+	if(conf->cache_zone == NGX_CONF_UNSET_PTR) {
+		conf->cache_zone = prev->cache_zone;
+		conf->cache_key = prev->cache_key;
+		conf->cache_valid = prev->cache_valid;
+	}
+
+	ngx_conf_merge_ptr_value(conf->cache_zone, prev->cache_zone, NULL);
+	ngx_conf_merge_value(conf->cache_valid, prev->cache_valid, NGX_HTTP_JPEG_FILTER_CACHE_VALID);
+
+#if (NGX_HTTP_CACHE)
+	if(conf->store_zone == NGX_CONF_UNSET_PTR) {
+		conf->store_zone = prev->store_zone;
+		conf->store_key = prev->store_key;
+		conf->store_valid = prev->store_valid;
+	}
+
+	ngx_conf_merge_ptr_value(conf->store_zone, prev->store_zone, NULL);
+	ngx_conf_merge_value(conf->store_valid, prev->store_valid, NGX_HTTP_JPEG_FILTER_STORE_VALID);
+
+	/* Both kinds of zones belong to this module. Don't mix them up */
+	if(conf->store_zone != NULL && ngx_http_jpeg_filter_store_check(cf, conf->store_zone, 1) != NGX_OK) {
+		return NGX_CONF_ERROR;
+	}
+
+	if(conf->cache_zone != NULL && ngx_http_jpeg_filter_store_check(cf, conf->cache_zone, 0) != NGX_OK) {
+		return NGX_CONF_ERROR;
+	}
+#endif
+
+	/* Collect the resolved elements of the processing chain into one program */
+	if(conf->filter_elements != NULL && conf->ops == NULL) {
+		ngx_uint_t                       i;
+		ngx_http_jpeg_filter_element_t  *felts = conf->filter_elements->elts;
+
+		conf->ops = ngx_palloc(cf->pool, conf->filter_elements->nelts * sizeof(ngx_http_jpeg_filter_op_t));
+		if(conf->ops == NULL) {
+			return NGX_CONF_ERROR;
+		}
+
+		for(i = 0; i < conf->filter_elements->nelts; i++) {
+			conf->ops[i] = felts[i].op;
+		}
+
+		/* A chain with variables can only be optimized once it has been resolved for a request */
+		if(conf->variables == 0) {
+			ngx_http_jpeg_filter_optimize(conf->ops, conf->filter_elements->nelts);
+		}
+	}
+
 	return NGX_CONF_OK;
 }
 
 static ngx_int_t ngx_http_jpeg_filter_init(ngx_conf_t *cf) {
+	ngx_http_handler_pt        *h;
+	ngx_http_core_main_conf_t  *cmcf;
+
 	ngx_http_next_header_filter = ngx_http_top_header_filter;
 	ngx_http_top_header_filter = ngx_http_jpeg_header_filter;
 
 	ngx_http_next_body_filter = ngx_http_top_body_filter;
 	ngx_http_top_body_filter = ngx_http_jpeg_body_filter;
 
+	/* The preconditions are evaluated by the jpeg filter */
+	cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
+
+	h = ngx_array_push(&cmcf->phases[NGX_HTTP_PRECONTENT_PHASE].handlers);
+	if(h == NULL) {
+		return NGX_ERROR;
+	}
+
+	*h = ngx_http_jpeg_filter_precondition_handler;
+
+	/* The metrics are only collected if they can be looked at */
+	ngx_http_jpeg_filter_main_conf_t  *mcf;
+
+	mcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_jpeg_filter_module);
+
+	if(mcf->status == 1 && mcf->locations.nelts != 0) {
+		ngx_str_t name = ngx_string("jpeg_filter_status");
+
+		mcf->status_zone = ngx_shared_memory_add(cf, &name, 8 * ngx_pagesize + mcf->locations.nelts * sizeof(ngx_http_jpeg_filter_metrics_t), &ngx_http_jpeg_filter_module);
+		if(mcf->status_zone == NULL) {
+			return NGX_ERROR;
+		}
+
+		mcf->status_zone->init = ngx_http_jpeg_filter_status_init_zone;
+		mcf->status_zone->data = mcf;
+	}
+
+	return NGX_OK;
+}
+
+static ngx_int_t ngx_http_jpeg_filter_init_process(ngx_cycle_t *cycle) {
+	ngx_http_jpeg_filter_main_conf_t     *mcf;
+	ngx_http_jpeg_filter_arena_t         *arena;
+	ngx_http_jpeg_filter_dropon_cache_t  *cache;
+
+	mcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_jpeg_filter_module);
+	if(mcf == NULL) {
+		return NGX_OK;
+	}
+
+	/* The cost model for jpeg_filter_time_budget and the payoff of the automatic codings of this worker */
+	if(mcf->locations.nelts != 0) {
+		ngx_http_jpeg_filter_cost = ngx_pcalloc(cycle->pool, mcf->locations.nelts * NGX_HTTP_JPEG_FILTER_COST_CLASSES * sizeof(ngx_uint_t));
+		if(ngx_http_jpeg_filter_cost == NULL) {
+			return NGX_ERROR;
+		}
+
+		ngx_http_jpeg_filter_codings_payoff = ngx_pcalloc(cycle->pool, mcf->locations.nelts * NGX_HTTP_JPEG_FILTER_CODINGS * sizeof(ngx_http_jpeg_filter_coding_t));
+		if(ngx_http_jpeg_filter_codings_payoff == NULL) {
+			return NGX_ERROR;
+		}
+	}
+
+	ngx_queue_init(&ngx_http_jpeg_filter_waiting);
+
+	if(mcf->arena_size != 0) {
+		/* Set up the arena for the image buffers of this worker */
+		arena = ngx_pcalloc(cycle->pool, sizeof(ngx_http_jpeg_filter_arena_t));
+		if(arena == NULL) {
+			return NGX_ERROR;
+		}
+
+		ngx_queue_init(&arena->queue);
+
+		arena->max_size = mcf->arena_size;
+		arena->hugepages = mcf->arena_hugepages;
+
+		ngx_http_jpeg_filter_arena = arena;
+	}
+
+	if(mcf->dropon_cache_size == 0) {
+		return NGX_OK;
+	}
+
+	/* Set up the cache for dynamic dropons of this worker */
+	cache = ngx_pcalloc(cycle->pool, sizeof(ngx_http_jpeg_filter_dropon_cache_t));
+	if(cache == NULL) {
+		return NGX_ERROR;
+	}
+
+	ngx_rbtree_init(&cache->rbtree, &cache->sentinel, ngx_http_jpeg_filter_cache_rbtree_insert_value);
+	ngx_queue_init(&cache->queue);
+
+	cache->max_size = mcf->dropon_cache_size;
+
+#if (NGX_THREADS)
+	if(ngx_thread_mutex_create(&cache->mutex, cycle->log) != NGX_OK) {
+		return NGX_ERROR;
+	}
+#endif
+
+	ngx_http_jpeg_filter_dropon_cache = cache;
+
 	return NGX_OK;
 }
+
+static void ngx_http_jpeg_filter_exit_process(ngx_cycle_t *cycle) {
+	ngx_queue_t                          *q;
+	ngx_http_jpeg_filter_block_t         *block;
+	ngx_http_jpeg_filter_dropon_node_t   *dn;
+	ngx_http_jpeg_filter_arena_t         *arena = ngx_http_jpeg_filter_arena;
+	ngx_http_jpeg_filter_dropon_cache_t  *cache = ngx_http_jpeg_filter_dropon_cache;
+
+	if(arena != NULL) {
+		ngx_log_error(NGX_LOG_INFO, cycle->log, 0, "jpeg_filter: arena: %ui hits, %ui misses", arena->hits, arena->misses);
+
+		/* Unmap all free blocks. Blocks that are still in use are unmapped when they are given back */
+		while(!ngx_queue_empty(&arena->queue)) {
+			q = ngx_queue_head(&arena->queue);
+			ngx_queue_remove(q);
+
+			block = ngx_queue_data(q, ngx_http_jpeg_filter_block_t, queue);
+
+			ngx_http_jpeg_filter_arena_unmap(block, cycle->log);
+		}
+
+		ngx_http_jpeg_filter_arena = NULL;
+	}
+
+	if(cache == NULL) {
+		return;
+	}
+
+	ngx_log_error(NGX_LOG_INFO, cycle->log, 0, "jpeg_filter: dropon cache: %ui hits, %ui misses, %ui evictions", cache->hits, cache->misses, cache->evictions);
+
+	/* Free all cached dropons */
+	while(!ngx_queue_empty(&cache->queue)) {
+		q = ngx_queue_head(&cache->queue);
+		ngx_queue_remove(q);
+
+		dn = ngx_queue_data(q, ngx_http_jpeg_filter_dropon_node_t, queue);
+
+		mj_free_dropon(&dn->dropon);
+		ngx_free(dn);
+	}
+
+	ngx_http_jpeg_filter_dropon_cache = NULL;
+
+	return;
+}